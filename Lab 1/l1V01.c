@@ -14,7 +14,7 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "./stb_image_write.h"
 // Camera settings
-#define CAM_WIDTH 640
+#define CAM_WIDTH 640 // default frame size, another one can be given on the command line
 #define CAM_HEIGHT 480
 #define VIDEO_FILE_PATH "/dev/video0"
 #define CAM_FORMAT V4L2_PIX_FMT_YUYV
@@ -47,17 +47,17 @@ typedef struct Pixel
         _rgba->B = MAX(0, MIN((298 * c + 516 * d + 128) >> 8, 255));
     }
 
-void set_circle(Pixel* rgbConversion){
-    int k = CAM_HEIGHT /2;
-    int h = CAM_WIDTH /2;
+void set_circle(Pixel* rgbConversion, int width, int height){
+    int k = height /2;
+    int h = width /2;
     
-    for(int y = 0; y < CAM_HEIGHT; y++){
+    for(int y = 0; y < height; y++){
 
-       for (int x = 0; x < CAM_WIDTH; x++){
+       for (int x = 0; x < width; x++){
             //(x-h)² + (y-k)²= r²
             double r = sqrt(pow(x-h,2) + pow(y-k,2));
             if (r < CIRCLE_RADIUS && r > CIRCLE_RADIUS -CIRCLE_WIDTH){
-                int px = (y)*(CAM_WIDTH) + (x);
+                int px = (y)*(width) + (x);
                 rgbConversion[px].R = 255;
                 rgbConversion[px].G = 0;
                 rgbConversion[px].B = 0;
@@ -69,20 +69,29 @@ void set_circle(Pixel* rgbConversion){
     
 }
 
-int ProcessImage(const unsigned char *_yuv, int _size)
+int ProcessImage(const unsigned char *_yuv, const struct v4l2_pix_format *pix)
     {
-
-        #define RGB_SIZE CAM_WIDTH * CAM_HEIGHT
-        static Pixel rgbConversion[RGB_SIZE];
+        int width = pix->width;
+        int height = pix->height;
+        Pixel *rgbConversion = (Pixel *)malloc(sizeof(Pixel) * width * height);
+        if (rgbConversion == NULL){
+            printf("Image allocation failed!\n");
+            return -1;
+        }
         int rgbIndex = 0;
-        for (int i = 0; i < _size; i += 4)
+        for (int y = 0; y < height; y++)
         {
-            unsigned char y1 = _yuv[i + 0];
-            unsigned char u = _yuv[i + 1];
-            unsigned char y2 = _yuv[i + 2];
-            unsigned char v = _yuv[i + 3];
-            YUYVtoRGB(y1, u, v, &rgbConversion[rgbIndex++]);
-            YUYVtoRGB(y2, u, v, &rgbConversion[rgbIndex++]);
+            // lines can be padded, bytesperline is where the next one starts
+            const unsigned char *line = _yuv + y * pix->bytesperline;
+            for (int i = 0; i < width * 2; i += 4)
+            {
+                unsigned char y1 = line[i + 0];
+                unsigned char u = line[i + 1];
+                unsigned char y2 = line[i + 2];
+                unsigned char v = line[i + 3];
+                YUYVtoRGB(y1, u, v, &rgbConversion[rgbIndex++]);
+                YUYVtoRGB(y2, u, v, &rgbConversion[rgbIndex++]);
+            }
         }
         // rgbConversion now has the correct rgba data here (if you used V4L2_PIX_FMT_YUYV). Use the data to create a PNG image that is saved to disk.
     
@@ -90,9 +99,9 @@ int ProcessImage(const unsigned char *_yuv, int _size)
         //save image to disk in png format
 
         
-        set_circle(rgbConversion);
-        stbi_write_png(FILE_NAME, CAM_WIDTH, CAM_HEIGHT, CHANNEL_NUM, rgbConversion, CAM_WIDTH*CHANNEL_NUM);
-
+        set_circle(rgbConversion, width, height);
+        stbi_write_png(FILE_NAME, width, height, CHANNEL_NUM, rgbConversion, width*CHANNEL_NUM);
+        free(rgbConversion);
 
         return 0;
 
@@ -101,7 +110,8 @@ int ProcessImage(const unsigned char *_yuv, int _size)
 int setup_camera(
     const int cam_width,
     const int cam_height,
-    const int cam_format){
+    const int cam_format,
+    struct v4l2_pix_format *pix){
     // setting up camera settings
     int cameraHandle = open(VIDEO_FILE_PATH, O_RDWR, 0);
     struct v4l2_format format;
@@ -116,14 +126,30 @@ int setup_camera(
         printf("VIDIOC_S_FMT Video format set fail\n");
         return -1;
     }
-    printf("Camera Set up done!\n");
+    // the driver answers with the size it can actually deliver
+    if (format.fmt.pix.pixelformat != (unsigned int)cam_format){
+        printf("Camera does not deliver the requested format\n");
+        return -1;
+    }
+    if (format.fmt.pix.bytesperline < format.fmt.pix.width * 2)
+        format.fmt.pix.bytesperline = format.fmt.pix.width * 2;
+    *pix = format.fmt.pix;
+    printf("Camera Set up done! %ux%u\n", pix->width, pix->height);
     return cameraHandle;
 }
 
 
 
-int main(){
-    int cameraHandle = setup_camera(CAM_WIDTH, CAM_HEIGHT, CAM_FORMAT);
+int main(int argc, char **argv){
+    // ./l1V01 [WIDTHxHEIGHT]
+    int width = CAM_WIDTH;
+    int height = CAM_HEIGHT;
+    if (argc > 1 && (sscanf(argv[1], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)){
+        printf("Usage: %s [WIDTHxHEIGHT]\n", argv[0]);
+        return 1;
+    }
+    struct v4l2_pix_format pix;
+    int cameraHandle = setup_camera(width, height, CAM_FORMAT, &pix);
     if (cameraHandle < 0){
         return 1;
     }
@@ -200,7 +226,7 @@ int main(){
     {
         return errno;
     }
-    ProcessImage(ImageMemory[buf.index], buf.bytesused);
+    ProcessImage(ImageMemory[buf.index], &pix);
     printf("Buffer settings done!\n");
     if(ioctl(cameraHandle, VIDIOC_QBUF, &buf) < 0){
         printf("Queue failed\n");
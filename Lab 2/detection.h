@@ -0,0 +1,70 @@
+// detection.h - binary detection results published by Lab 2
+//
+// Every processed frame produces one DetectionResult, sent as a single packet
+// on the SOCK_SEQPACKET socket DETECTION_SOCKET. A consumer connects and calls
+// recv() with a buffer of sizeof(DetectionResult); each recv returns exactly
+// one result. A consumer that does not keep up loses results (the sender never
+// waits), 'sequence' shows the gap. With several cameras the results of all of
+// them arrive on the same socket, 'camera' says which one a result is for.
+// Started with --spots, Lab 2 reports every laser spot it finds (up to
+// DETECTION_MAX_SPOTS, most intense first); otherwise just the brightest one.
+// The spot_ fields always describe spots[0] as measured in this frame, pos_x
+// and pos_y are where the tracker puts it: smoothed, and kept on the predicted
+// path for a few frames when the spot is missed ('track' says which).
+#ifndef DETECTION_H
+#define DETECTION_H
+
+#include <stdint.h>
+
+#define DETECTION_SOCKET "/tmp/lab2_detection.sock"
+#define DETECTION_VERSION 6
+#define DETECTION_MAX_SPOTS 8
+
+// direction codes, as returned by direction()
+#define DETECTION_NONE -1
+#define DETECTION_BACK 0
+#define DETECTION_LEFT 1
+#define DETECTION_RIGHT 2
+#define DETECTION_FORWARD 3
+
+// tracker states
+#define DETECTION_TRACK_LOST 0
+#define DETECTION_TRACK_MEASURED 1 // the spot was found in this frame
+#define DETECTION_TRACK_COASTING 2 // missed, pos_x and pos_y are predicted
+
+typedef struct DetectionSpot
+{
+    float x;           // intensity weighted centre
+    float y;
+    int16_t left;      // bounding box, inclusive
+    int16_t top;
+    int16_t right;
+    int16_t bottom;
+    int32_t area;      // pixels
+    int32_t intensity; // red above the laser threshold, summed over the spot
+} DetectionSpot;
+
+typedef struct DetectionResult
+{
+    uint32_t version;      // DETECTION_VERSION
+    uint32_t sequence;     // V4L2 frame sequence number
+    uint64_t timestamp_ns; // capture time, CLOCK_MONOTONIC
+    int32_t pos_x;         // tracked laser position, -1 when the track is lost
+    int32_t pos_y;
+    int32_t brightness;    // highest red value in the spot, 0 when not detected
+    int32_t direction;     // DETECTION_*
+    int32_t camera;        // index of the device on the command line, 0 with one camera
+    int32_t spot_area;     // pixels in the spot, 0 when not detected
+    float spot_x;          // intensity weighted centre of the spot, -1 when not detected
+    float spot_y;
+    int32_t spot_count;    // valid entries in spots
+    int32_t laser_pixels;  // pixels that passed the laser test where the detector looked (and,
+                           // with --background, differ from the learned scene)
+    float velocity_x;      // tracked motion, pixels per processed frame
+    float velocity_y;
+    int32_t track;         // DETECTION_TRACK_*
+    int32_t pad;
+    DetectionSpot spots[DETECTION_MAX_SPOTS];
+} DetectionResult;
+
+#endif // DETECTION_H
@@ -0,0 +1,266 @@
+// frame_bus.h - shared memory layout of the Lab 2 frame bus and a reader for it
+//
+// Lab 2 (started with --frame-bus) publishes camera frames into a ring of slots
+// in a memfd. A local process connects to FRAME_BUS_SOCKET, receives two memfds
+// and reads frames in place, they are never copied. The first memfd holds the
+// header, which readers map read-write to keep their cursor in it. The second
+// holds the slots and is sealed with F_SEAL_FUTURE_WRITE once Lab 2 has mapped
+// it, so readers can only map it read-only. Frames are only copied onto the
+// bus while at least one reader holds an entry in header->consumers, and there
+// are FRAME_BUS_MAX_CONSUMERS entries: connecting fails when they are all taken.
+//
+// The producer never waits for readers. Each slot carries a sequence word that
+// is odd while the slot is written and 2 * (frame + 1) once frame is in it, so a
+// reader that falls behind sees that its slot has been reused and skips ahead.
+// New frames are announced through a futex on the shared 'head' counter.
+//
+// When Lab 2 captures with MMAP buffers it also exports them with VIDIOC_EXPBUF
+// and passes the dmabuf fds after the memfds (header->capture_buffers of them,
+// in r.dmabuf). slot.buffer says which capture buffer a frame came from; that
+// buffer is only valid until the driver refills it, so it suits importers such
+// as hardware encoders that use it right away. With DMABUF capture the camera
+// writes straight into the slots and no fds are passed.
+//
+//   FrameBusReader r;
+//   if (frame_bus_connect(&r, FRAME_BUS_SOCKET) == 0)
+//   {
+//       const unsigned char *frame;
+//       while (frame_bus_next(&r, 1000, &frame) == 0)
+//       {
+//           ... use frame (r.header->width x r.header->height in r.header->pixelformat) ...
+//           if (!frame_bus_done(&r))
+//               ... frame was overwritten while it was used, drop the result ...
+//       }
+//       frame_bus_disconnect(&r);
+//   }
+#ifndef FRAME_BUS_H
+#define FRAME_BUS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define FRAME_BUS_SOCKET "/tmp/lab2_frames.sock"
+#define FRAME_BUS_MAGIC 0x42463243 // "C2FB"
+#define FRAME_BUS_VERSION 3
+#define FRAME_BUS_SLOTS 8
+#define FRAME_BUS_MAX_CONSUMERS 8
+#define FRAME_BUS_PAGE 4096
+
+typedef struct FrameBusSlot
+{
+    uint32_t seq;   // odd while written, 2 * (frame + 1) when frame is complete
+    uint32_t bytes; // bytes of frame data
+    double timestamp;
+    int32_t buffer;  // capture buffer (index into the dmabuf fds) the frame came from, -1 if none
+    uint8_t pad[44]; // one cache line per slot
+} FrameBusSlot;
+typedef struct FrameBusConsumer
+{
+    int32_t pid;     // 0 when the entry is free
+    uint32_t cursor; // next frame this consumer reads
+    uint32_t dropped; // frames it lost by falling behind
+    uint8_t pad[52];
+} FrameBusConsumer;
+typedef struct FrameBusHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pixelformat; // V4L2 fourcc
+    uint32_t stride;
+    uint32_t slots;
+    uint32_t slot_size;   // distance between slots, a page multiple
+    uint32_t data_offset; // first slot in the data memfd, page aligned
+    uint32_t capture_buffers; // exported capture buffers passed after the memfds
+    uint8_t pad0[24];
+    uint32_t head; // frames published, futex word
+    uint8_t pad1[60];
+    FrameBusConsumer consumers[FRAME_BUS_MAX_CONSUMERS];
+    FrameBusSlot slot[FRAME_BUS_SLOTS];
+} FrameBusHeader;
+
+// size of the header memfd, mapped read-write by everybody
+#define FRAME_BUS_HEADER_SIZE ((sizeof(FrameBusHeader) + FRAME_BUS_PAGE - 1) & ~(size_t)(FRAME_BUS_PAGE - 1))
+
+static inline long frame_bus_futex(uint32_t *word, int op, uint32_t value, const struct timespec *timeout)
+{
+    // shared futex, the word lives in the memfd
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+typedef struct FrameBusReader
+{
+    int fd;      // header memfd
+    int data_fd; // slot memfd, write sealed
+    FrameBusHeader *header;
+    const unsigned char *data; // read-only mapping of the slots
+    size_t data_size;
+    int consumer; // entry in header->consumers
+    uint32_t cursor;
+    uint32_t seq; // slot sequence seen by frame_bus_next
+    int dmabuf[FRAME_BUS_SLOTS]; // exported capture buffers
+    int dmabuf_count;
+} FrameBusReader;
+
+static inline void frame_bus_close_fds(FrameBusReader *r)
+{
+    close(r->fd);
+    close(r->data_fd);
+    for (int i = 0; i < r->dmabuf_count; i++)
+        close(r->dmabuf[i]);
+    r->dmabuf_count = 0;
+}
+
+static inline int frame_bus_connect(FrameBusReader *r, const char *socket_path)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    r->data_fd = -1;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+    // the publisher sends one byte with both memfds and any capture dmabufs attached
+    char byte;
+    char control[CMSG_SPACE(sizeof(int) * (2 + FRAME_BUS_SLOTS))];
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    close(sock);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != 1 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+    int fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (fds < 2)
+    {
+        if (fds == 1)
+            close(*(int *)CMSG_DATA(cmsg));
+        return -1;
+    }
+    memcpy(&r->fd, CMSG_DATA(cmsg), sizeof(int));
+    memcpy(&r->data_fd, CMSG_DATA(cmsg) + sizeof(int), sizeof(int));
+    r->dmabuf_count = fds - 2;
+    memcpy(r->dmabuf, CMSG_DATA(cmsg) + 2 * sizeof(int), r->dmabuf_count * sizeof(int));
+
+    r->header = (FrameBusHeader *)mmap(NULL, FRAME_BUS_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+    if (r->header == MAP_FAILED || r->header->magic != FRAME_BUS_MAGIC || r->header->version != FRAME_BUS_VERSION)
+    {
+        if (r->header != MAP_FAILED)
+            munmap(r->header, FRAME_BUS_HEADER_SIZE);
+        frame_bus_close_fds(r);
+        return -1;
+    }
+    r->data_size = (size_t)r->header->slots * r->header->slot_size;
+    r->data = (const unsigned char *)mmap(NULL, r->data_size, PROT_READ, MAP_SHARED, r->data_fd, r->header->data_offset);
+    if (r->data == MAP_FAILED)
+    {
+        munmap(r->header, FRAME_BUS_HEADER_SIZE);
+        frame_bus_close_fds(r);
+        return -1;
+    }
+    // claim a consumer entry, taking over ones left by processes that died; the
+    // producer only fills the ring while an entry is held
+    r->consumer = -1;
+    for (int i = 0; i < FRAME_BUS_MAX_CONSUMERS && r->consumer < 0; i++)
+    {
+        int32_t pid = __atomic_load_n(&r->header->consumers[i].pid, __ATOMIC_RELAXED);
+        if (pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH))
+            continue; // alive, EPERM is a reader running as another user
+        if (__atomic_compare_exchange_n(&r->header->consumers[i].pid, &pid, (int32_t)getpid(), false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            r->consumer = i;
+    }
+    if (r->consumer < 0)
+    {
+        munmap((void *)r->data, r->data_size);
+        munmap(r->header, FRAME_BUS_HEADER_SIZE);
+        frame_bus_close_fds(r);
+        return -1;
+    }
+    r->cursor = __atomic_load_n(&r->header->head, __ATOMIC_ACQUIRE); // start with the next frame
+    r->header->consumers[r->consumer].cursor = r->cursor;
+    r->header->consumers[r->consumer].dropped = 0;
+    return 0;
+}
+
+// Waits up to timeout_ms for the next frame and points *frame at it. Returns 0,
+// or -1 on timeout. A reader that fell more than a ring behind skips to the
+// newest frame, the oldest ones are about to be overwritten anyway.
+static inline int frame_bus_next(FrameBusReader *r, int timeout_ms, const unsigned char **frame)
+{
+    FrameBusHeader *h = r->header;
+    for (;;)
+    {
+        uint32_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+        if (head == r->cursor)
+        {
+            struct timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+            if (frame_bus_futex(&h->head, FUTEX_WAIT, head, &timeout) < 0 && errno == ETIMEDOUT)
+                return -1;
+            continue;
+        }
+        if (head - r->cursor > h->slots)
+        {
+            h->consumers[r->consumer].dropped += head - 1 - r->cursor;
+            r->cursor = head - 1;
+        }
+        uint32_t slot = r->cursor % h->slots;
+        r->seq = __atomic_load_n(&h->slot[slot].seq, __ATOMIC_ACQUIRE);
+        if (r->seq != 2 * (r->cursor + 1))
+        {
+            // already being reused by the producer
+            r->cursor++;
+            h->consumers[r->consumer].dropped++;
+            continue;
+        }
+        *frame = r->data + (size_t)slot * h->slot_size;
+        return 0;
+    }
+}
+
+// Ends the use of the frame from frame_bus_next. Returns false if the producer
+// reused the slot in the meantime, in which case what was read is torn.
+static inline bool frame_bus_done(FrameBusReader *r)
+{
+    FrameBusHeader *h = r->header;
+    uint32_t slot = r->cursor % h->slots;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    bool valid = __atomic_load_n(&h->slot[slot].seq, __ATOMIC_RELAXED) == r->seq;
+    r->cursor++;
+    __atomic_store_n(&h->consumers[r->consumer].cursor, r->cursor, __ATOMIC_RELAXED);
+    return valid;
+}
+
+static inline void frame_bus_disconnect(FrameBusReader *r)
+{
+    __atomic_store_n(&r->header->consumers[r->consumer].pid, 0, __ATOMIC_RELEASE);
+    munmap((void *)r->data, r->data_size);
+    munmap(r->header, FRAME_BUS_HEADER_SIZE);
+    frame_bus_close_fds(r);
+}
+
+#endif // FRAME_BUS_H
@@ -1,3 +1,5 @@
+// gcc -O2 -fopenmp lab2.c -o lab2 -lSDL2 -ljpeg -lm -lpthread (-DUSE_SDL=0 and no -lSDL2 without a display)
+#define _GNU_SOURCE              // O_DIRECT
 #include <stdio.h>           // Standard input/output (printf)
 #include <stdlib.h>          // Standard library
 #include <string.h>          // C string operations
@@ -8,21 +10,76 @@
 #include <sys/stat.h>        // stat (get file descriptor info)
 #include <sys/mman.h>        // memory maps
 #include <linux/videodev2.h> // camera driver interface
+#include <linux/io_uring.h>  // io_uring file writes (raw syscalls, no liburing)
+#include <linux/dma-buf.h>   // cpu access to dmabuf capture buffers
+#include <linux/udmabuf.h>   // dmabufs made from the frame bus memfd
+#include <sys/syscall.h>     // syscall numbers for io_uring
+#include <sys/uio.h>         // iovec for buffer registration
+#include <poll.h>            // waiting on several cameras
+#include <signal.h>          // stopping multi-camera capture with ctrl-c
 #include <math.h>            // math functions (sqrt, pow)
+#ifdef __SSE2__
+#include <emmintrin.h>       // laser mask compares
+#endif
+#ifndef USE_SDL
+#define USE_SDL 1 // -DUSE_SDL=0 builds without SDL, Lab 2 then always runs headless
+#endif
+#if USE_SDL
 #include <SDL2/SDL.h>        // Image rendering
+#endif
 #include <omp.h>             // Used in multithreading
 #include <pthread.h>         // Pthread used in image capture
 #include <stdbool.h>         // Used is SDL_Event
+#include <setjmp.h>          // libjpeg error recovery
+#include <jpeglib.h>         // MJPEG decoding (libjpeg-turbo)
 // imported libraries for image processing
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "./stb_image_write.h"
+#include "./frame_bus.h"         // shared memory frame bus for other local processes
+#include "./detection.h"         // binary detection results for the motor controller
 // Camera settings
-#define CAM_WIDTH 640
+#define CAM_WIDTH 640  // default frame size, another one can be given on the command line
 #define CAM_HEIGHT 480
 #define VIDEO_FILE_PATH "/dev/video0"
-#define CAM_FORMAT V4L2_PIX_FMT_YUYV
+#define CAM_FPS 30 // wanted frame rate, the cheapest format reaching it at CAM_WIDTH x CAM_HEIGHT is used
+#define CAM_MEMORY V4L2_MEMORY_MMAP // V4L2_MEMORY_USERPTR captures into our hugepage pool,
+                                    // V4L2_MEMORY_DMABUF straight into the frame bus (needs /dev/udmabuf)
+#define CAM_BUFFERS 2               // MMAP and USERPTR buffers
+#define POOL_ALIGN 4096             // pool buffers start on a page (and so a cache line)
+#define HUGE_PAGE (2 << 20)
+#define BENCHMARK_RUNS 20
+#define DMABUF_QUEUED 3             // frame bus slots queued to the driver, the others stay readable
+#define MAX_CAMERAS 4               // devices in multi-camera mode
+#define MULTI_CAM_BUFFERS 4         // MMAP buffers per camera in multi-camera mode
+#define CAMERA_REPORT_SECONDS 5.0   // per camera statistics interval
+#define CAMERA_POLL_MS 200          // how long a camera worker waits before checking for a stop
+#define RENDER_KEYS 16              // key presses the render thread can queue for capture
 // Process image
 #define FILE_NAME "test.png"
+#define JPG_FILE_NAME "test.jpg"
+#define JPG_QUALITY 90
+#define JPG_SUBSAMPLE 0 // 0 keeps the camera's 4:2:2 chroma, 1 writes 4:2:0
+#define JPG_RESTART_ROWS 4 // MCU rows per restart interval, the intervals are encoded in parallel
+// Recording
+#define REC_FILE_NAME "record.avi"
+#define REC_QUALITY 80
+#define REC_EVERY_N 1          // record every Nth processed frame
+#define REC_SLOTS 4            // frames that can be queued for encoding/writing before new ones are dropped
+#define REC_MAX_BYTES (1u << 30) // AVI 1.0 files must stay below 1 GB, later frames are dropped
+#define Y4M_RAW_FILE_NAME "raw.y4m"       // camera YUYV as 4:2:2
+#define Y4M_OVERLAY_FILE_NAME "overlay.y4m" // processed frame as 4:4:4
+#define Y4M_FPS 30
+#define Y4M_O_DIRECT true // bypass the page cache for Y4M recordings
+#define PRETRIGGER_SECONDS 3.0       // history written when an event triggers
+#define PRETRIGGER_BUDGET (64 << 20) // memory for raw frames, 109 frames at 640x480
+#define PRETRIGGER_FILE_NAME "pretrigger_%03d.y4m"
+#define PRETRIGGER_HOLD 0.25         // seconds a new direction has to last before it is an event
+#define PRETRIGGER_INTERVAL 10.0     // seconds at least between two dumps triggered by direction
+#define DETECTION_MAX_CLIENTS 8 // consumers of the detection result socket
+// File output
+#define URING_BUFFERS 8
+#define URING_BUFFER_SIZE (1 << 20) // each buffer is one write
+#define URING_ALIGN 4096            // O_DIRECT alignment
 #define CHANNEL_NUM 4
 #define IMG_THREADS 8
 // Circle size
@@ -30,10 +87,14 @@
 #define CIRCLE_RADIUS 50
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define MAX(a, b) (((a) < (b)) ? (b) : (a))
+#define KEY_ESCAPE 27 // keys are ASCII, as SDL key codes for letters are
+#if USE_SDL
 // Var for SDL window
 SDL_Window *g_window = NULL;
 SDL_Renderer *g_renderer = NULL;
 SDL_Texture *g_streamTexture = NULL;
+SDL_Texture *g_markerTexture = NULL; // circle drawn over a YUY2 preview
+#endif
 typedef struct Pixel
 {
     unsigned char B;
@@ -41,12 +102,19 @@ typedef struct Pixel
     unsigned char R;
     unsigned char A;
 } Pixel; // Used to store pixel colors
-typedef struct ImageParts
+typedef struct CameraFormat
 {
-    int start;
-    int end;
-    int rgb_index;
-} ImageParts; // Used in multithreading when splitting image
+    unsigned int pixelformat;
+    int width;
+    int height;
+    int bytesperline;
+    int sizeimage;
+    double fps;
+    const struct Converter *converter;  // turns frames of this format into pixels
+    const struct FrameKernels *kernels; // loops specialised for this size
+} CameraFormat; // What a camera was set up to deliver
+CameraFormat g_format = {V4L2_PIX_FMT_YUYV, CAM_WIDTH, CAM_HEIGHT, CAM_WIDTH * 2, CAM_WIDTH * CAM_HEIGHT * 2, CAM_FPS, NULL, NULL};
+static __thread int img_threads = IMG_THREADS; // OpenMP team size, multi-camera workers share IMG_THREADS
 static void YUYVtoRGB(unsigned char y, unsigned char u, unsigned char v, Pixel *_rgba)
 {
     int c = y - 16;
@@ -57,288 +125,3313 @@ static void YUYVtoRGB(unsigned char y, unsigned char u, unsigned char v, Pixel *
     _rgba->G = MAX(0, MIN((298 * c - 100 * d - 208 * e + 128) >> 8, 255));
     _rgba->B = MAX(0, MIN((298 * c + 516 * d + 128) >> 8, 255));
 }
-void find_laser(Pixel *rgbConversion, int *pos_x, int *pos_y, int *brightest_red)
+// Frame size kernels
+// The per-pixel loops are written once with the frame size as arguments and
+// instantiated for the common camera sizes, where the constant size lets the
+// compiler unroll and vectorise them. Other sizes use the generic versions.
+static inline __attribute__((always_inline)) void yuyv_row(const unsigned char *line, int width, Pixel *out)
 {
-    for (int y = 0; y < CAM_HEIGHT; y++)
+    for (int x = 0; x < width; x += 2, line += 4)
     {
-        for (int x = 0; x < CAM_WIDTH; x++)
+        YUYVtoRGB(line[0], line[1], line[3], &out[x]);
+        YUYVtoRGB(line[2], line[1], line[3], &out[x + 1]);
+    }
+}
+static inline __attribute__((always_inline)) bool laser_pixel(Pixel p)
+{
+    // bright, saturated red
+    return p.R >= 210 && p.A >= 200 && p.G <= 60 && p.B <= 60;
+}
+// Laser mask
+// The laser test, as one bit per pixel: bit x % 64 of word x / 64 of a row is
+// pixel x, rows are padded to whole words with clear bits. With the set bits
+// counted per row, the detectors only look at the rows and words that have
+// laser pixels, reading 1/32 of the converted frame's bytes to find them.
+// Only the window set with mask_window is tested, everything else is clear.
+typedef struct LaserMask
+{
+    int words; // 64 bit words per row
+    uint64_t *bits;
+    int *count; // set bits per row
+    int total;
+    int top; // window, rows top..bottom and words first..last
+    int bottom;
+    int first;
+    int last;
+} LaserMask;
+static inline __attribute__((always_inline)) int mask_row(const Pixel *line, int width, int first, int last, uint64_t *bits)
+{
+    // returns the number of laser pixels in words first..last of the row
+    int count = 0;
+    for (int w = 0; w * 64 < width; w++)
+    {
+        if (w < first || w > last)
+        {
+            bits[w] = 0;
+            continue;
+        }
+        const Pixel *block = &line[w * 64];
+        int end = MIN(64, width - w * 64);
+        uint64_t word = 0;
+        int i = 0;
+#ifdef __SSE2__
+        // four pixels at a time: B, G <= 60 and R >= 210, A >= 200 in every byte, then one bit per pixel
+        const __m128i upper = _mm_set1_epi32((int)0xffff3c3c);
+        const __m128i lower = _mm_set1_epi32((int)0xc8d20000);
+        const __m128i pass = _mm_set1_epi32(-1);
+        for (; i + 4 <= end; i += 4)
+        {
+            __m128i p = _mm_loadu_si128((const __m128i *)&block[i]);
+            __m128i ok = _mm_and_si128(_mm_cmpeq_epi8(_mm_min_epu8(p, upper), p), _mm_cmpeq_epi8(_mm_max_epu8(p, lower), p));
+            word |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(ok, pass))) << i;
+        }
+#endif
+        for (; i < end; i++)
+            word |= (uint64_t)laser_pixel(block[i]) << i;
+        bits[w] = word;
+        count += __builtin_popcountll(word);
+    }
+    return count;
+}
+static inline __attribute__((always_inline)) void mask_frame(const Pixel *rgbConversion, int width, int height, LaserMask *mask)
+{
+    int total = 0;
+#pragma omp parallel for num_threads(img_threads) reduction(+ : total)
+    for (int y = 0; y < height; y++)
+    {
+        uint64_t *bits = &mask->bits[y * mask->words];
+        if (y < mask->top || y > mask->bottom)
+        {
+            memset(bits, 0, mask->words * sizeof(uint64_t));
+            mask->count[y] = 0;
+            continue;
+        }
+        mask->count[y] = mask_row(&rgbConversion[y * width], width, mask->first, mask->last, bits);
+        total += mask->count[y];
+    }
+    mask->total = total;
+}
+static inline __attribute__((always_inline)) void mask_frame_yuyv(const unsigned char *yuyv, int stride, int width,
+                                                                  int height, Pixel *rgbConversion, LaserMask *mask)
+{
+    // the mask straight from the camera frame: the window of each row is
+    // converted into a row on the stack and tested there, and only rows with
+    // laser pixels (all the spot code reads) are stored into rgbConversion
+    int total = 0;
+    yuyv_row(yuyv, 2, rgbConversion); // find_laser starts from pixel 0
+#pragma omp parallel for num_threads(img_threads) reduction(+ : total)
+    for (int y = 0; y < height; y++)
+    {
+        uint64_t *bits = &mask->bits[y * mask->words];
+        if (y < mask->top || y > mask->bottom)
+        {
+            memset(bits, 0, mask->words * sizeof(uint64_t));
+            mask->count[y] = 0;
+            continue;
+        }
+        Pixel line[width];
+        int x0 = mask->first * 64;
+        int x1 = MIN((mask->last + 1) * 64, width);
+        yuyv_row(yuyv + (size_t)y * stride + x0 * 2, x1 - x0, &line[x0]);
+        mask->count[y] = mask_row(line, width, mask->first, mask->last, bits);
+        if (mask->count[y] > 0)
+            memcpy(&rgbConversion[y * width + x0], &line[x0], (x1 - x0) * sizeof(Pixel));
+        total += mask->count[y];
+    }
+    mask->total = total;
+}
+typedef struct FrameKernels
+{
+    int width;
+    int height; // 0 x 0 matches any size
+    void (*convert_yuyv)(const CameraFormat *fmt, const unsigned char *yuyv, Pixel *rgbConversion);
+    void (*laser_mask)(const CameraFormat *fmt, const Pixel *rgbConversion, LaserMask *mask);
+    void (*laser_mask_yuyv)(const CameraFormat *fmt, const unsigned char *yuyv, Pixel *rgbConversion, LaserMask *mask);
+} FrameKernels;
+#define FRAME_KERNELS(W, H)                                                                           \
+    static void convert_yuyv_##W##x##H(const CameraFormat *fmt, const unsigned char *yuyv, Pixel *rgbConversion) \
+    {                                                                                                 \
+        int stride = fmt->bytesperline;                                                               \
+        _Pragma("omp parallel for num_threads(img_threads)") for (int y = 0; y < H; y++)              \
+            yuyv_row(yuyv + y * stride, W, &rgbConversion[y * W]);                                    \
+    }                                                                                                 \
+    static void laser_mask_##W##x##H(const CameraFormat *fmt, const Pixel *rgbConversion, LaserMask *mask) \
+    {                                                                                                 \
+        (void)fmt;                                                                                    \
+        mask_frame(rgbConversion, W, H, mask);                                                        \
+    }                                                                                                 \
+    static void laser_mask_yuyv_##W##x##H(const CameraFormat *fmt, const unsigned char *yuyv, Pixel *rgbConversion, \
+                                          LaserMask *mask)                                            \
+    {                                                                                                 \
+        mask_frame_yuyv(yuyv, fmt->bytesperline, W, H, rgbConversion, mask);                          \
+    }
+FRAME_KERNELS(640, 480)
+FRAME_KERNELS(1280, 720)
+FRAME_KERNELS(1920, 1080)
+static void convert_yuyv_any(const CameraFormat *fmt, const unsigned char *yuyv, Pixel *rgbConversion)
+{
+    int width = fmt->width;
+    int stride = fmt->bytesperline;
+#pragma omp parallel for num_threads(img_threads)
+    for (int y = 0; y < fmt->height; y++)
+        yuyv_row(yuyv + y * stride, width, &rgbConversion[y * width]);
+}
+static void laser_mask_any(const CameraFormat *fmt, const Pixel *rgbConversion, LaserMask *mask)
+{
+    mask_frame(rgbConversion, fmt->width, fmt->height, mask);
+}
+static void laser_mask_yuyv_any(const CameraFormat *fmt, const unsigned char *yuyv, Pixel *rgbConversion, LaserMask *mask)
+{
+    mask_frame_yuyv(yuyv, fmt->bytesperline, fmt->width, fmt->height, rgbConversion, mask);
+}
+static const FrameKernels frame_kernels[] = {
+    {640, 480, convert_yuyv_640x480, laser_mask_640x480, laser_mask_yuyv_640x480},
+    {1280, 720, convert_yuyv_1280x720, laser_mask_1280x720, laser_mask_yuyv_1280x720},
+    {1920, 1080, convert_yuyv_1920x1080, laser_mask_1920x1080, laser_mask_yuyv_1920x1080},
+    {0, 0, convert_yuyv_any, laser_mask_any, laser_mask_yuyv_any},
+};
+const FrameKernels *select_kernels(int width, int height)
+{
+    const FrameKernels *kernels = frame_kernels;
+    while (kernels->width != 0 && (kernels->width != width || kernels->height != height))
+        kernels++;
+    return kernels;
+}
+void mask_window(LaserMask *mask, int height, int left, int top, int right, int bottom)
+{
+    // pixels left..right of rows top..bottom, clipped to the frame
+    mask->top = MAX(top, 0);
+    mask->bottom = MIN(bottom, height - 1);
+    mask->first = MAX(left, 0) / 64;
+    mask->last = MIN(right / 64, mask->words - 1);
+}
+int mask_alloc(LaserMask *mask, int width, int height)
+{
+    mask->words = (width + 63) / 64;
+    mask->total = 0;
+    mask_window(mask, height, 0, 0, width - 1, height - 1);
+    mask->count = (int *)calloc(height, sizeof(int));
+    if (posix_memalign((void **)&mask->bits, POOL_ALIGN, (size_t)mask->words * height * sizeof(uint64_t)) != 0)
+        mask->bits = NULL;
+    if (mask->count == NULL || mask->bits == NULL)
+    {
+        free(mask->count);
+        free(mask->bits);
+        return -1;
+    }
+    return 0;
+}
+void mask_free(LaserMask *mask)
+{
+    free(mask->count);
+    free(mask->bits);
+}
+void laser_mask(const CameraFormat *fmt, const Pixel *rgbConversion, LaserMask *mask)
+{
+    fmt->kernels->laser_mask(fmt, rgbConversion, mask);
+}
+void laser_mask_yuyv(const CameraFormat *fmt, const unsigned char *yuyv, Pixel *rgbConversion, LaserMask *mask)
+{
+    // YUYV frames only, rgbConversion gets just the rows with laser pixels
+    fmt->kernels->laser_mask_yuyv(fmt, yuyv, rgbConversion, mask);
+}
+static inline bool mask_test(const LaserMask *mask, int x, int y)
+{
+    return (mask->bits[y * mask->words + x / 64] >> (x % 64)) & 1;
+}
+static inline int mask_find(const uint64_t *row, int words, int x, bool set)
+{
+    // first pixel at or after x whose bit is set (or clear), words * 64 if there is none
+    int w = x / 64;
+    if (w >= words)
+        return words * 64;
+    uint64_t bits = (set ? row[w] : ~row[w]) & (~0ull << (x % 64));
+    while (bits == 0 && ++w < words)
+        bits = set ? row[w] : ~row[w];
+    return bits != 0 ? w * 64 + __builtin_ctzll(bits) : words * 64;
+}
+void find_laser(const CameraFormat *fmt, const Pixel *rgbConversion, const LaserMask *mask,
+                int *pos_x, int *pos_y, int *brightest_red)
+{
+    // the last of the brightest red pixels wins, only the mask's pixels can
+    int best_r = rgbConversion[*brightest_red].R;
+    int best_a = rgbConversion[*brightest_red].A;
+    for (int y = 0; y < fmt->height; y++)
+    {
+        if (mask->count[y] == 0)
+            continue;
+        const uint64_t *row = &mask->bits[y * mask->words];
+        for (int w = 0; w < mask->words; w++)
+        {
+            for (uint64_t word = row[w]; word != 0; word &= word - 1)
+            {
+                int x = w * 64 + __builtin_ctzll(word);
+                Pixel p = rgbConversion[y * fmt->width + x];
+                if (p.R >= best_r && p.A >= best_a)
+                {
+                    best_r = p.R;
+                    best_a = p.A;
+                    *brightest_red = y * fmt->width + x;
+                    *pos_x = x;
+                    *pos_y = y;
+                }
+            }
+        }
+    }
+}
+// Preview downscaling
+// A 1/2 or 1/4 preview is box filtered straight from the YUYV frame: the rows
+// of a block are summed into a 16 bit row, each block is averaged and only
+// then converted, so the full size frame is never converted nor written.
+static inline __attribute__((always_inline)) void preview_row(const unsigned char *yuyv, int stride, int width,
+                                                              int scale, Pixel *out)
+{
+    // column sums of scale rows, at most 4 * 255
+    uint16_t sum[width * 2];
+#pragma omp simd
+    for (int i = 0; i < width * 2; i++)
+        sum[i] = yuyv[i];
+    for (int r = 1; r < scale; r++)
+    {
+        const unsigned char *line = yuyv + r * stride;
+#pragma omp simd
+        for (int i = 0; i < width * 2; i++)
+            sum[i] += line[i];
+    }
+    // a block holds scale * scale Y samples and half as many U and V
+    int luma = scale * scale;
+    int chroma = luma / 2;
+    for (int x = 0; x < width / scale; x++)
+    {
+        const uint16_t *block = &sum[x * scale * 2];
+        int y = 0, u = 0, v = 0;
+        for (int p = 0; p < scale * 2; p += 4)
+        {
+            y += block[p] + block[p + 2];
+            u += block[p + 1];
+            v += block[p + 3];
+        }
+        YUYVtoRGB((y + luma / 2) / luma, (u + chroma / 2) / chroma, (v + chroma / 2) / chroma, &out[x]);
+    }
+}
+void preview_yuyv(const CameraFormat *fmt, const unsigned char *yuyv, int scale, Pixel *preview)
+{
+    // preview is (width / scale) x (height / scale), scale is 2 or 4
+    int width = fmt->width / scale;
+    int stride = fmt->bytesperline;
+#pragma omp parallel for num_threads(img_threads)
+    for (int y = 0; y < fmt->height / scale; y++)
+    {
+        const unsigned char *rows = yuyv + (size_t)y * scale * stride;
+        if (scale == 2)
+            preview_row(rows, stride, fmt->width, 2, &preview[y * width]);
+        else
+            preview_row(rows, stride, fmt->width, 4, &preview[y * width]);
+    }
+}
+// Laser spot
+// The pixel find_laser returns is just the last of the brightest ones and
+// moves around inside the spot from frame to frame. spot_measure grows the
+// spot from that pixel through its laser red neighbours and weighs every
+// pixel by how far its red value is above the laser threshold. Only a
+// SPOT_WINDOW square around the peak is looked at, so the cost is fixed.
+#define SPOT_WINDOW 31 // pixels, odd
+#define SPOT_FLOOR 209 // red value that weighs nothing, one below laser_pixel's threshold
+typedef struct LaserSpot
+{
+    float x; // intensity weighted centroid, in pixels
+    float y;
+    int area; // laser red pixels connected to the peak, within the window
+    int peak; // highest red value
+    int intensity; // red above SPOT_FLOOR, summed over the spot
+    int left;      // bounding box, inclusive
+    int top;
+    int right;
+    int bottom;
+} LaserSpot;
+void spot_measure(const CameraFormat *fmt, const Pixel *rgbConversion, const LaserMask *mask, int pos_x, int pos_y,
+                  LaserSpot *spot)
+{
+    int half = SPOT_WINDOW / 2;
+    int x0 = MAX(pos_x - half, 0);
+    int y0 = MAX(pos_y - half, 0);
+    int x1 = MIN(pos_x + half, fmt->width - 1);
+    int y1 = MIN(pos_y + half, fmt->height - 1);
+    // breadth first through 4-connected laser pixels, each window pixel queued once
+    bool seen[SPOT_WINDOW][SPOT_WINDOW];
+    short queue[SPOT_WINDOW * SPOT_WINDOW][2];
+    memset(seen, 0, sizeof(seen));
+    int head = 0;
+    int tail = 0;
+    queue[tail][0] = pos_x;
+    queue[tail++][1] = pos_y;
+    seen[pos_y - y0][pos_x - x0] = true;
+    double sum_x = 0, sum_y = 0;
+    LaserSpot found = {0, 0, 0, 0, 0, pos_x, pos_y, pos_x, pos_y};
+    while (head < tail)
+    {
+        int x = queue[head][0];
+        int y = queue[head++][1];
+        int red = rgbConversion[y * fmt->width + x].R;
+        found.intensity += red - SPOT_FLOOR;
+        sum_x += (double)(red - SPOT_FLOOR) * x;
+        sum_y += (double)(red - SPOT_FLOOR) * y;
+        found.peak = MAX(found.peak, red);
+        found.left = MIN(found.left, x);
+        found.top = MIN(found.top, y);
+        found.right = MAX(found.right, x);
+        found.bottom = MAX(found.bottom, y);
+        const int step[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+        for (int i = 0; i < 4; i++)
+        {
+            int nx = x + step[i][0];
+            int ny = y + step[i][1];
+            if (nx < x0 || nx > x1 || ny < y0 || ny > y1 || seen[ny - y0][nx - x0])
+                continue;
+            seen[ny - y0][nx - x0] = true;
+            if (!mask_test(mask, nx, ny))
+                continue;
+            queue[tail][0] = nx;
+            queue[tail++][1] = ny;
+        }
+    }
+    found.x = sum_x / found.intensity;
+    found.y = sum_y / found.intensity;
+    found.area = tail;
+    *spot = found;
+}
+// Tracker
+// An alpha-beta filter on the spot centre: every processed frame the position
+// is moved on by the velocity, then the measurement pulls the position
+// TRACK_ALPHA and the velocity TRACK_BETA of the way towards it. The
+// prediction lets single spot detection build the mask for a TRACK_WINDOW
+// square only, the whole frame is searched when the spot is not in it. A
+// missed spot coasts on its prediction for TRACK_COAST frames before the
+// track is lost; a measurement too far from the prediction starts a new one.
+#define TRACK_ALPHA 0.5f
+#define TRACK_BETA 0.2f
+#define TRACK_WINDOW 96 // pixels, searched around the prediction
+#define TRACK_COAST 5   // missed frames before the track is lost
+typedef struct Tracker
+{
+    int state; // DETECTION_TRACK_*
+    float x;   // estimate
+    float y;
+    float vx; // pixels per frame
+    float vy;
+    int missed;
+} Tracker;
+void track_predict(Tracker *t)
+{
+    t->x += t->vx;
+    t->y += t->vy;
+}
+void track_update(Tracker *t, const CameraFormat *fmt, const LaserSpot *spot)
+{
+    // spot is this frame's measurement, NULL when the spot was missed
+    if (spot == NULL)
+    {
+        bool inside = t->x >= 0 && t->y >= 0 && t->x < fmt->width && t->y < fmt->height;
+        if (t->state != DETECTION_TRACK_LOST && ++t->missed <= TRACK_COAST && inside)
+            t->state = DETECTION_TRACK_COASTING;
+        else
+            t->state = DETECTION_TRACK_LOST;
+        return;
+    }
+    float rx = spot->x - t->x;
+    float ry = spot->y - t->y;
+    if (t->state == DETECTION_TRACK_LOST || fabsf(rx) > TRACK_WINDOW / 2 || fabsf(ry) > TRACK_WINDOW / 2)
+    {
+        t->x = spot->x;
+        t->y = spot->y;
+        t->vx = 0;
+        t->vy = 0;
+    }
+    else
+    {
+        t->x += TRACK_ALPHA * rx;
+        t->y += TRACK_ALPHA * ry;
+        t->vx += TRACK_BETA * rx;
+        t->vy += TRACK_BETA * ry;
+    }
+    t->state = DETECTION_TRACK_MEASURED;
+    t->missed = 0;
+}
+// Background model
+// With --background a running average of the frame's luma is kept, and laser
+// pixels within BG_THRESHOLD of it are dropped from the mask before the spots
+// are looked for: a red object that stands still is not a laser spot. The
+// average is 12.4 fixed point in a uint16_t per pixel and moves 1/2^BG_SHIFT
+// of the way to every frame. Where a spot was found it only moves
+// 1/2^BG_HOLD_SHIFT, so a pointer held still takes a while to fade into the
+// background. The frame is updated in tiles of BG_TILE_ROWS rows on the
+// OpenMP team, eight pixels per SSE2 step.
+#define BG_SHIFT 5        // time constant of 32 frames, about a second at 30 fps
+#define BG_HOLD_SHIFT 8   // 256 frames for the spot's pixels
+#define BG_THRESHOLD 16   // luma difference from the average that is movement
+#define BG_TILE_ROWS 16
+typedef struct Background
+{
+    uint16_t *average; // luma << 4, NULL without --background
+    bool started;      // average holds the scene
+} Background;
+static void luma_row(const CameraFormat *fmt, const unsigned char *src, const Pixel *rgbConversion, int y, unsigned char *out)
+{
+    // the frame's Y for row y, from the camera format when it has a Y plane
+    const unsigned char *line = src + (size_t)y * fmt->bytesperline;
+    switch (fmt->pixelformat)
+    {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_UYVY:
+        line += fmt->pixelformat == V4L2_PIX_FMT_UYVY;
+#pragma omp simd
+        for (int x = 0; x < fmt->width; x++)
+            out[x] = line[2 * x];
+        break;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_YUV420:
+        memcpy(out, line, fmt->width);
+        break;
+    default:
+        // decoded formats, back from the pixels
+        for (int x = 0; x < fmt->width; x++)
+        {
+            Pixel p = rgbConversion[y * fmt->width + x];
+            out[x] = ((66 * p.R + 129 * p.G + 25 * p.B + 128) >> 8) + 16;
+        }
+    }
+}
+static inline void background_row(const unsigned char *luma, const uint64_t *hold, int width, uint16_t *average)
+{
+    // average += (luma << 4 - average) / 2^shift, rounded, with the slow shift where hold is set
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bit = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+    const __m128i half = _mm_set1_epi16(1 << (BG_SHIFT - 1));
+    const __m128i hold_half = _mm_set1_epi16(1 << (BG_HOLD_SHIFT - 1));
+    for (; x + 8 <= width; x += 8)
+    {
+        __m128i y = _mm_slli_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)&luma[x]), zero), 4);
+        __m128i avg = _mm_loadu_si128((const __m128i *)&average[x]);
+        __m128i delta = _mm_sub_epi16(y, avg);
+        __m128i held = _mm_and_si128(_mm_set1_epi16((hold[x / 64] >> (x % 64)) & 0xff), bit);
+        held = _mm_cmpeq_epi16(held, bit);
+        __m128i step = _mm_or_si128(_mm_and_si128(held, _mm_srai_epi16(_mm_add_epi16(delta, hold_half), BG_HOLD_SHIFT)),
+                                    _mm_andnot_si128(held, _mm_srai_epi16(_mm_add_epi16(delta, half), BG_SHIFT)));
+        _mm_storeu_si128((__m128i *)&average[x], _mm_add_epi16(avg, step));
+    }
+#endif
+    for (; x < width; x++)
+    {
+        int shift = (hold[x / 64] >> (x % 64)) & 1 ? BG_HOLD_SHIFT : BG_SHIFT;
+        int delta = (luma[x] << 4) - average[x];
+        average[x] += (delta + (1 << (shift - 1))) >> shift;
+    }
+}
+void background_filter(const CameraFormat *fmt, const unsigned char *src, const Pixel *rgbConversion, Background *bg,
+                       LaserMask *mask)
+{
+    // clears the mask bits of pixels that look like the background, the rows
+    // with laser pixels are few so this is not split over the team
+    if (!bg->started)
+        return;
+    unsigned char luma[fmt->width];
+    int total = 0;
+    for (int y = 0; y < fmt->height; y++)
+    {
+        if (mask->count[y] == 0)
+            continue;
+        luma_row(fmt, src, rgbConversion, y, luma);
+        const uint16_t *average = &bg->average[y * fmt->width];
+        uint64_t *row = &mask->bits[y * mask->words];
+        int count = 0;
+        for (int w = 0; w < mask->words; w++)
+        {
+            for (uint64_t word = row[w]; word != 0; word &= word - 1)
+            {
+                int x = w * 64 + __builtin_ctzll(word);
+                if (abs(luma[x] - (average[x] >> 4)) <= BG_THRESHOLD)
+                    row[w] &= ~(1ull << (x % 64));
+            }
+            count += __builtin_popcountll(row[w]);
+        }
+        mask->count[y] = count;
+        total += count;
+    }
+    mask->total = total;
+}
+void background_update(const CameraFormat *fmt, const unsigned char *src, const Pixel *rgbConversion, Background *bg,
+                       const LaserMask *mask)
+{
+    // learns this frame, except slowly where the mask still has laser pixels
+    int width = fmt->width;
+    int tiles = (fmt->height + BG_TILE_ROWS - 1) / BG_TILE_ROWS;
+#pragma omp parallel for num_threads(img_threads)
+    for (int tile = 0; tile < tiles; tile++)
+    {
+        unsigned char luma[width];
+        for (int y = tile * BG_TILE_ROWS; y < MIN((tile + 1) * BG_TILE_ROWS, fmt->height); y++)
+        {
+            uint16_t *average = &bg->average[y * width];
+            luma_row(fmt, src, rgbConversion, y, luma);
+            if (!bg->started)
+            {
+                for (int x = 0; x < width; x++)
+                    average[x] = luma[x] << 4;
+                continue;
+            }
+            background_row(luma, &mask->bits[y * mask->words], width, average);
+        }
+    }
+    bg->started = true;
+}
+// Spot labelling
+// With --spots every laser spot in the frame is found, for scenes with more
+// than one pointer. Each row is cut into runs of laser red pixels, a run is
+// joined to the runs it touches in the row above through a union-find over
+// the runs, and the runs' sums are added up per spot. A frame with more than
+// SPOT_MAX_RUNS runs (mostly red, not a laser) is only labelled that far.
+#define SPOT_MAX_RUNS 65536
+typedef struct SpotRun
+{
+    int y;
+    int left; // first and last pixel
+    int right;
+    int parent;     // union-find, roots are their own parent and come before their runs
+    int spot;       // index into the sums, roots only
+    int intensity;  // red above SPOT_FLOOR, summed over the run
+    int weighted_x; // the same weighted by x
+    int peak;
+} SpotRun;
+typedef struct SpotSum
+{
+    LaserSpot spot;
+    double sum_x; // intensity weighted
+    double sum_y;
+} SpotSum;
+typedef struct Detector
+{
+    bool all_spots; // label every spot, otherwise measure around find_laser's pixel
+    LaserMask mask; // laser pixels of the current frame
+    Tracker tracker; // follows spots[0]
+    Background background;
+    SpotRun *runs;  // labelling scratch, SPOT_MAX_RUNS of each
+    SpotSum *sums;
+} Detector; // Per camera detection state
+void detector_close(Detector *det)
+{
+    mask_free(&det->mask);
+    free(det->runs);
+    free(det->sums);
+    free(det->background.average);
+    free(det);
+}
+Detector *detector_open(const CameraFormat *fmt, bool all_spots, bool background)
+{
+    Detector *det = (Detector *)calloc(1, sizeof(Detector));
+    if (det == NULL)
+        return NULL;
+    det->all_spots = all_spots;
+    det->tracker.state = DETECTION_TRACK_LOST;
+    if (mask_alloc(&det->mask, fmt->width, fmt->height) < 0)
+    {
+        free(det);
+        return NULL;
+    }
+    if (all_spots)
+    {
+        det->runs = (SpotRun *)malloc(SPOT_MAX_RUNS * sizeof(SpotRun));
+        det->sums = (SpotSum *)malloc(SPOT_MAX_RUNS * sizeof(SpotSum));
+    }
+    if (background && posix_memalign((void **)&det->background.average, POOL_ALIGN,
+                                     (size_t)fmt->width * fmt->height * sizeof(uint16_t)) != 0)
+        det->background.average = NULL;
+    if ((all_spots && (det->runs == NULL || det->sums == NULL)) || (background && det->background.average == NULL))
+    {
+        detector_close(det);
+        return NULL;
+    }
+    return det;
+}
+static int spot_root(SpotRun *runs, int i)
+{
+    while (runs[i].parent != i)
+    {
+        runs[i].parent = runs[runs[i].parent].parent; // path halving
+        i = runs[i].parent;
+    }
+    return i;
+}
+static void spot_join(SpotRun *runs, int a, int b)
+{
+    a = spot_root(runs, a);
+    b = spot_root(runs, b);
+    if (a < b)
+        runs[b].parent = a;
+    else if (b < a)
+        runs[a].parent = b;
+}
+static int spot_brighter(const void *a, const void *b)
+{
+    return ((const SpotSum *)b)->spot.intensity - ((const SpotSum *)a)->spot.intensity;
+}
+int label_spots(const CameraFormat *fmt, const Pixel *rgbConversion, Detector *det, LaserSpot *spots, int max_spots)
+{
+    // fills spots with the max_spots most intense spots, brightest first, and returns how many
+    SpotRun *runs = det->runs;
+    int count = 0;
+    int above = 0; // runs of the row above are above..row_start-1
+    const LaserMask *mask = &det->mask;
+    for (int y = 0; y < fmt->height && count < SPOT_MAX_RUNS; y++)
+    {
+        const Pixel *line = &rgbConversion[y * fmt->width];
+        const uint64_t *row = &mask->bits[y * mask->words];
+        int row_start = count;
+        // the runs are read off the mask, rows without laser pixels are skipped
+        int x = mask->count[y] != 0 ? mask_find(row, mask->words, 0, true) : fmt->width;
+        for (; x < fmt->width && count < SPOT_MAX_RUNS; x = mask_find(row, mask->words, x, true))
         {
-            int px = (y) * (CAM_WIDTH) + (x);
-            if (
-                rgbConversion[px].R >= 210 &&
-                rgbConversion[px].A >= 200 &&
-                rgbConversion[px].G <= 60 &&
-                rgbConversion[px].B <= 60 &&
-                rgbConversion[px].R >= rgbConversion[*brightest_red].R &&
-                rgbConversion[px].A >= rgbConversion[*brightest_red].A)
+            SpotRun *run = &runs[count];
+            run->y = y;
+            run->left = x;
+            run->parent = count;
+            run->intensity = 0;
+            run->weighted_x = 0;
+            run->peak = 0;
+            int end = mask_find(row, mask->words, x, false);
+            for (; x < end; x++)
             {
-                *brightest_red = px;
-                *pos_x = x;
-                *pos_y = y;
+                run->intensity += line[x].R - SPOT_FLOOR;
+                run->weighted_x += (line[x].R - SPOT_FLOOR) * x;
+                run->peak = MAX(run->peak, line[x].R);
             }
+            run->right = end - 1;
+            // both rows are ordered by x, runs ending left of this one touch none after it either
+            while (above < row_start && runs[above].right < run->left)
+                above++;
+            for (int a = above; a < row_start && runs[a].left <= run->right; a++)
+                spot_join(runs, a, count);
+            count++;
+        }
+        above = row_start;
+    }
+    // a root has a lower index than its runs, so it is met first
+    SpotSum *sums = det->sums;
+    int found = 0;
+    for (int i = 0; i < count; i++)
+    {
+        SpotRun *run = &runs[i];
+        int root = spot_root(runs, i);
+        if (root == i)
+        {
+            run->spot = found++;
+            SpotSum *sum = &sums[run->spot];
+            memset(sum, 0, sizeof(*sum));
+            sum->spot.left = run->left;
+            sum->spot.top = run->y;
+            sum->spot.right = run->right;
+            sum->spot.bottom = run->y;
         }
+        SpotSum *sum = &sums[runs[root].spot];
+        sum->spot.area += run->right - run->left + 1;
+        sum->spot.intensity += run->intensity;
+        sum->spot.peak = MAX(sum->spot.peak, run->peak);
+        sum->spot.left = MIN(sum->spot.left, run->left);
+        sum->spot.right = MAX(sum->spot.right, run->right);
+        sum->spot.bottom = run->y;
+        sum->sum_x += run->weighted_x;
+        sum->sum_y += (double)run->intensity * run->y;
     }
+    qsort(sums, found, sizeof(SpotSum), spot_brighter);
+    found = MIN(found, max_spots);
+    for (int i = 0; i < found; i++)
+    {
+        spots[i] = sums[i].spot;
+        spots[i].x = sums[i].sum_x / sums[i].spot.intensity;
+        spots[i].y = sums[i].sum_y / sums[i].spot.intensity;
+    }
+    return found;
 }
-int direction(int px_x, int px_y)
+int direction(const CameraFormat *fmt, int px_x, int px_y)
 {
     if (px_y == -1 || px_x == -1)
     {
         // Not detected
         return -1;
     }
-    else if (px_y >= ((CAM_HEIGHT * 3) / 4))
+    else if (px_y >= ((fmt->height * 3) / 4))
     {
         // BACK
         return 0;
     }
-    else if (px_x <= (CAM_WIDTH / 4) && px_y <= ((CAM_HEIGHT * 3) / 4))
+    else if (px_x <= (fmt->width / 4) && px_y <= ((fmt->height * 3) / 4))
     {
         // LEFT
         return 1;
     }
-    else if (px_x >= (CAM_WIDTH * 3) / 4 && px_y <= ((CAM_HEIGHT * 3) / 4))
+    else if (px_x >= (fmt->width * 3) / 4 && px_y <= ((fmt->height * 3) / 4))
     {
         // RIGHT
         return 2;
     }
-    else if (px_x <= ((CAM_WIDTH * 3) / 4) && (px_x) >= (CAM_WIDTH / 4) && px_y <= ((CAM_HEIGHT * 3) / 4))
+    else if (px_x <= ((fmt->width * 3) / 4) && (px_x) >= (fmt->width / 4) && px_y <= ((fmt->height * 3) / 4))
+    {
+        // FORWARD
+        return 3;
+    }
+}
+void set_circle(const CameraFormat *fmt, Pixel *rgbConversion, int *pos_x, int *pos_y)
+{
+    // only the square the ring fits in is visited, distances are compared squared
+    int outer = CIRCLE_RADIUS * CIRCLE_RADIUS;
+    int inner = (CIRCLE_RADIUS - CIRCLE_WIDTH) * (CIRCLE_RADIUS - CIRCLE_WIDTH);
+    int top = MAX(*pos_y - CIRCLE_RADIUS + 1, 0);
+    int bottom = MIN(*pos_y + CIRCLE_RADIUS - 1, fmt->height - 1);
+    int left = MAX(*pos_x - CIRCLE_RADIUS + 1, 0);
+    int right = MIN(*pos_x + CIRCLE_RADIUS - 1, fmt->width - 1);
+
+    for (int y = top; y <= bottom; y++)
+    {
+        int dy = y - *pos_y;
+        for (int x = left; x <= right; x++)
+        {
+            int dx = x - *pos_x;
+            int r2 = dx * dx + dy * dy;
+            if (r2 < outer && r2 > inner)
+            {
+                int px = (y) * (fmt->width) + (x);
+                rgbConversion[px].R = 0;
+                rgbConversion[px].G = 0;
+                rgbConversion[px].B = 255;
+                rgbConversion[px].A = 255;
+            }
+        }
+    }
+}
+void PrintImageData(double ProcessImage_timer, int last_dic)
+{
+    switch (last_dic)
+    {
+    case 0:
+        printf("Thread Time avg: %.2f ms and direction back \n",
+               ProcessImage_timer);
+        break;
+    case 1:
+        printf("Thread Time avg: %.2f ms and direction left \n",
+               ProcessImage_timer);
+        break;
+    case 2:
+        printf("Thread Time avg: %.2f ms and direction right \n",
+               ProcessImage_timer);
+        break;
+    case 3:
+        printf("Thread Time avg: %.2f ms and direction forward \n",
+               ProcessImage_timer);
+        break;
+    default:
+        printf("Thread Time avg: %.2f ms and direction not deteced\n",
+               ProcessImage_timer);
+    }
+}
+static void BGRAtoRGBA(Pixel *dst, const Pixel *src, int count)
+{
+    // texture is BGRA, the image writers want RGBA
+    for (int i = 0; i < count; i++)
+    {
+        Pixel p = src[i];
+        dst[i].B = p.R;
+        dst[i].G = p.G;
+        dst[i].R = p.B;
+        dst[i].A = p.A;
+    }
+}
+// io_uring file writer
+// An stbi_write_func backend: data is gathered in registered, page aligned
+// buffers and each full buffer is queued as a WRITE_FIXED at its file offset.
+// A buffer goes back on the free list when its completion arrives, so the
+// caller only waits when every buffer is still in flight. liburing is not
+// needed, the ring is driven with the raw syscalls.
+typedef struct UringWriter
+{
+    int fd;
+    bool direct;   // O_DIRECT, writes are padded to URING_ALIGN and the file trimmed on close
+    int ring_fd;   // -1 when io_uring is unavailable, buffers are then written with pwrite
+    bool fixed;    // buffers are registered with the ring
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned char *memory; // URING_BUFFERS * URING_BUFFER_SIZE
+    int free_list[URING_BUFFERS];
+    int free_count;
+    int in_flight;
+    off_t offset[URING_BUFFERS]; // where a queued buffer goes in the file
+    size_t length[URING_BUFFERS];
+    size_t written[URING_BUFFERS];
+    int current; // buffer being filled, -1 if none
+    size_t used;
+    off_t next_offset;
+    bool failed;
+} UringWriter;
+static unsigned char *uring_buffer(UringWriter *w, int i)
+{
+    return w->memory + (size_t)i * URING_BUFFER_SIZE;
+}
+static void uring_pwrite(UringWriter *w, int i)
+{
+    // writes what is left of buffer i in place and frees it
+    size_t done = w->written[i];
+    while (done < w->length[i])
+    {
+        ssize_t n = pwrite(w->fd, uring_buffer(w, i) + done, w->length[i] - done, w->offset[i] + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            perror("pwrite failed");
+            w->failed = true;
+            break;
+        }
+        done += n;
+    }
+    w->free_list[w->free_count++] = i;
+}
+static void uring_submit(UringWriter *w, int i)
+{
+    // queues what is left of buffer i
+    size_t done = w->written[i];
+    if (w->ring_fd < 0)
+    {
+        uring_pwrite(w, i);
+        return;
+    }
+    unsigned tail = *w->sq_tail;
+    unsigned index = tail & *w->sq_mask;
+    struct io_uring_sqe *sqe = &w->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = w->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = w->fd;
+    sqe->addr = (unsigned long)(uring_buffer(w, i) + done);
+    sqe->len = w->length[i] - done;
+    sqe->off = w->offset[i] + done;
+    sqe->buf_index = w->fixed ? i : 0;
+    sqe->user_data = i;
+    w->sq_array[index] = index;
+    __atomic_store_n(w->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    long submitted;
+    while ((submitted = syscall(__NR_io_uring_enter, w->ring_fd, 1, 0, 0, NULL, 0)) < 0 && errno == EINTR)
+        ;
+    if (submitted == 1)
+    {
+        w->in_flight++;
+        return;
+    }
+    // not taken by the kernel (EAGAIN, EBUSY, ENOMEM), so no completion will
+    // come for it: take the entry back and write the buffer here
+    printf("io_uring submit failed: %s\n", submitted < 0 ? strerror(errno) : "not consumed");
+    __atomic_store_n(w->sq_tail, tail, __ATOMIC_RELEASE);
+    w->failed = true;
+    uring_pwrite(w, i);
+}
+static int uring_reap(UringWriter *w, bool wait)
+{
+    // -1 when waiting is impossible, the buffers in flight then never come back
+    if (w->ring_fd < 0 || w->in_flight == 0)
+        return 0;
+    unsigned head = *w->cq_head;
+    if (wait && head == __atomic_load_n(w->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        long waited;
+        while ((waited = syscall(__NR_io_uring_enter, w->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0)) < 0 &&
+               errno == EINTR)
+            ;
+        if (waited < 0)
+        {
+            printf("io_uring wait failed: %s\n", strerror(errno));
+            w->failed = true;
+            return -1;
+        }
+    }
+    while (head != __atomic_load_n(w->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &w->cqes[head & *w->cq_mask];
+        int i = (int)cqe->user_data;
+        int res = cqe->res;
+        head++;
+        __atomic_store_n(w->cq_head, head, __ATOMIC_RELEASE);
+        w->in_flight--;
+        if (res > 0)
+            w->written[i] += res;
+        if (res <= 0 && !w->failed)
+        {
+            printf("io_uring write failed: %s\n", strerror(res < 0 ? -res : EIO));
+            w->failed = true;
+        }
+        if (res > 0 && w->written[i] < w->length[i] && w->direct)
+        {
+            // the rest would start off a URING_ALIGN boundary, which O_DIRECT refuses
+            printf("io_uring short write on an O_DIRECT file\n");
+            w->failed = true;
+            w->free_list[w->free_count++] = i;
+        }
+        else if (res > 0 && w->written[i] < w->length[i])
+            uring_submit(w, i); // short write, queue the rest
+        else
+            w->free_list[w->free_count++] = i;
+    }
+    return 0;
+}
+static void uring_queue_current(UringWriter *w)
+{
+    if (w->current < 0)
+        return;
+    int i = w->current;
+    size_t length = w->used;
+    if (w->direct && length % URING_ALIGN != 0)
+    {
+        // only the last buffer can be partial, the padding is cut off on close
+        size_t padded = (length + URING_ALIGN - 1) & ~(size_t)(URING_ALIGN - 1);
+        memset(uring_buffer(w, i) + length, 0, padded - length);
+        length = padded;
+    }
+    w->offset[i] = w->next_offset;
+    w->length[i] = length;
+    w->written[i] = 0;
+    w->next_offset += w->used;
+    w->current = -1;
+    uring_submit(w, i);
+}
+void uring_write(void *context, void *data, int size)
+{
+    UringWriter *w = (UringWriter *)context;
+    const unsigned char *src = (const unsigned char *)data;
+    while (size > 0)
+    {
+        if (w->current < 0)
+        {
+            uring_reap(w, false);
+            while (w->free_count == 0)
+                if (uring_reap(w, true) < 0)
+                    return; // every buffer is stuck in flight, the rest is lost
+            w->current = w->free_list[--w->free_count];
+            w->used = 0;
+        }
+        size_t n = MIN((size_t)size, URING_BUFFER_SIZE - w->used);
+        memcpy(uring_buffer(w, w->current) + w->used, src, n);
+        w->used += n;
+        src += n;
+        size -= n;
+        if (w->used == URING_BUFFER_SIZE)
+            uring_queue_current(w);
+    }
+}
+static int uring_setup_ring(UringWriter *w)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    w->ring_fd = syscall(__NR_io_uring_setup, URING_BUFFERS, &params);
+    if (w->ring_fd < 0)
+        return -1;
+    w->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    w->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    w->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    w->sq_ring = mmap(NULL, w->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      w->ring_fd, IORING_OFF_SQ_RING);
+    w->cq_ring = mmap(NULL, w->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      w->ring_fd, IORING_OFF_CQ_RING);
+    w->sqes = (struct io_uring_sqe *)mmap(NULL, w->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                          w->ring_fd, IORING_OFF_SQES);
+    if (w->sq_ring == MAP_FAILED || w->cq_ring == MAP_FAILED || w->sqes == MAP_FAILED)
+        return -1;
+    unsigned char *sq = (unsigned char *)w->sq_ring;
+    unsigned char *cq = (unsigned char *)w->cq_ring;
+    w->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    w->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    w->sq_array = (unsigned *)(sq + params.sq_off.array);
+    w->cq_head = (unsigned *)(cq + params.cq_off.head);
+    w->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    w->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    w->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // registered buffers skip the per write page pinning, plain writes still work without
+    struct iovec iov[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; i++)
+    {
+        iov[i].iov_base = uring_buffer(w, i);
+        iov[i].iov_len = URING_BUFFER_SIZE;
+    }
+    w->fixed = syscall(__NR_io_uring_register, w->ring_fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) == 0;
+    return 0;
+}
+static void uring_teardown_ring(UringWriter *w)
+{
+    if (w->sq_ring != NULL && w->sq_ring != MAP_FAILED)
+        munmap(w->sq_ring, w->sq_ring_size);
+    if (w->cq_ring != NULL && w->cq_ring != MAP_FAILED)
+        munmap(w->cq_ring, w->cq_ring_size);
+    if (w->sqes != NULL && w->sqes != MAP_FAILED)
+        munmap(w->sqes, w->sqes_size);
+    if (w->ring_fd >= 0)
+        close(w->ring_fd);
+    w->ring_fd = -1;
+}
+UringWriter *uring_open(const char *file_name, bool direct)
+{
+    UringWriter *w = (UringWriter *)calloc(1, sizeof(UringWriter));
+    if (w == NULL)
+        return NULL;
+    if (posix_memalign((void **)&w->memory, URING_ALIGN, (size_t)URING_BUFFERS * URING_BUFFER_SIZE) != 0)
+    {
+        free(w);
+        return NULL;
+    }
+    w->fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+    w->direct = direct && w->fd >= 0;
+    if (w->fd < 0 && direct && errno == EINVAL)
+        w->fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644); // file system without O_DIRECT
+    if (w->fd < 0)
+    {
+        printf("Could not open %s\n", file_name);
+        free(w->memory);
+        free(w);
+        return NULL;
+    }
+    if (uring_setup_ring(w) < 0)
+    {
+        printf("io_uring unavailable, writing %s with pwrite\n", file_name);
+        uring_teardown_ring(w);
+    }
+    for (int i = 0; i < URING_BUFFERS; i++)
+        w->free_list[w->free_count++] = i;
+    w->current = -1;
+    return w;
+}
+int uring_close(UringWriter *w)
+{
+    uring_queue_current(w);
+    while (w->in_flight > 0 && uring_reap(w, true) == 0)
+        ;
+    if (w->direct && ftruncate(w->fd, w->next_offset) < 0)
+        w->failed = true;
+    if (close(w->fd) < 0)
+        w->failed = true;
+    uring_teardown_ring(w);
+    int ok = !w->failed;
+    free(w->memory);
+    free(w);
+    return ok ? 0 : -1;
+}
+int save_snapshot(const char *file_name, Pixel *rgbConversion)
+{
+    // Streams the frame one row at a time so only a row is copied, not the whole image
+    UringWriter *file = uring_open(file_name, false);
+    if (file == NULL)
+        return -1;
+    Pixel row[g_format.width];
+    stbi_png_stream *png = stbi_write_png_stream_begin(uring_write, file, g_format.width, g_format.height, CHANNEL_NUM);
+    for (int y = 0; png != NULL && y < g_format.height; y++)
+    {
+        BGRAtoRGBA(row, &rgbConversion[y * g_format.width], g_format.width);
+        stbi_write_png_stream_row(png, row);
+    }
+    int saved = stbi_write_png_stream_end(png);
+    return uring_close(file) == 0 && saved ? 0 : -1;
+}
+// MJPEG/AVI recorder
+// Capture copies a frame into a free slot and returns, an encoder thread turns
+// the slot into a JPEG and a writer thread appends it to the AVI. When every
+// slot is busy (disk or CPU behind) the new frame is dropped instead of waiting.
+// A write error stops the recording, later frames only count as dropped.
+typedef struct RecSlot
+{
+    Pixel *frame;       // BGRA copy of the processed frame, RGBA once the encoder has it
+    unsigned char *jpg; // encoded frame
+    int jpg_len;
+    int jpg_cap;
+    double time; // capture time, used for the frame rate in the header
+} RecSlot;
+typedef struct RecQueue
+{
+    int slot[REC_SLOTS];
+    int head;
+    int count;
+} RecQueue;
+typedef struct Recorder
+{
+    FILE *file;
+    RecSlot slots[REC_SLOTS];
+    RecQueue free_q;    // slots capture can fill
+    RecQueue encode_q;  // frames waiting for the encoder
+    RecQueue write_q;   // jpgs waiting for the writer
+    pthread_mutex_t lock;
+    pthread_cond_t encode_ready;
+    pthread_cond_t write_ready;
+    pthread_t encoder;
+    pthread_t writer;
+    bool stopping;
+    bool encoder_done;
+    unsigned int *index; // offset/size pairs for idx1
+    int index_cap;
+    int frames;          // frames in the file
+    long movi_start;     // file offset of the 'movi' fourcc
+    unsigned int movi_size;
+    unsigned int max_jpg;
+    double first_time;
+    double last_time;
+    int frame_counter;   // for REC_EVERY_N
+    int dropped;
+    bool failed;         // writing the file failed, writer thread only until close
+} Recorder;
+static void rec_queue_push(RecQueue *q, int slot)
+{
+    q->slot[(q->head + q->count) % REC_SLOTS] = slot;
+    q->count++;
+}
+static int rec_queue_pop(RecQueue *q)
+{
+    int slot = q->slot[q->head];
+    q->head = (q->head + 1) % REC_SLOTS;
+    q->count--;
+    return slot;
+}
+static void avi_u32(FILE *file, unsigned int v)
+{
+    unsigned char b[4] = {v & 255, (v >> 8) & 255, (v >> 16) & 255, v >> 24};
+    fwrite(b, 1, 4, file);
+}
+static void avi_u16(FILE *file, unsigned int v)
+{
+    unsigned char b[2] = {v & 255, (v >> 8) & 255};
+    fwrite(b, 1, 2, file);
+}
+static void avi_patch_u32(FILE *file, long offset, unsigned int v)
+{
+    fseek(file, offset, SEEK_SET);
+    avi_u32(file, v);
+}
+// Offsets of the fields that are only known when the recording is closed
+#define AVI_RIFF_SIZE 4
+#define AVI_USEC_PER_FRAME 32
+#define AVI_TOTAL_FRAMES 48
+#define AVI_SUGGESTED_BUFFER 60
+#define AVI_STRH_SCALE 128
+#define AVI_STRH_RATE 132
+#define AVI_STRH_LENGTH 140
+#define AVI_STRH_BUFFER 144
+#define AVI_MOVI_SIZE 216
+static void avi_write_header(FILE *file)
+{
+    fwrite("RIFF", 1, 4, file);
+    avi_u32(file, 0); // patched on close
+    fwrite("AVI LIST", 1, 8, file);
+    avi_u32(file, 192);
+    fwrite("hdrlavih", 1, 8, file);
+    avi_u32(file, 56);
+    avi_u32(file, 33333);   // us per frame, patched on close
+    avi_u32(file, 0);       // max bytes per second
+    avi_u32(file, 0);       // padding granularity
+    avi_u32(file, 0x10);    // AVIF_HASINDEX
+    avi_u32(file, 0);       // total frames, patched on close
+    avi_u32(file, 0);       // initial frames
+    avi_u32(file, 1);       // streams
+    avi_u32(file, 0);       // suggested buffer size, patched on close
+    avi_u32(file, g_format.width);
+    avi_u32(file, g_format.height);
+    for (int i = 0; i < 4; i++)
+        avi_u32(file, 0);
+    fwrite("LIST", 1, 4, file);
+    avi_u32(file, 116);
+    fwrite("strlstrh", 1, 8, file);
+    avi_u32(file, 56);
+    fwrite("vidsMJPG", 1, 8, file);
+    avi_u32(file, 0);       // flags
+    avi_u16(file, 0);       // priority
+    avi_u16(file, 0);       // language
+    avi_u32(file, 0);       // initial frames
+    avi_u32(file, 1);       // scale, patched on close
+    avi_u32(file, 30);      // rate, patched on close
+    avi_u32(file, 0);       // start
+    avi_u32(file, 0);       // length, patched on close
+    avi_u32(file, 0);       // suggested buffer size, patched on close
+    avi_u32(file, 0xFFFFFFFF); // quality
+    avi_u32(file, 0);       // sample size
+    avi_u16(file, 0);
+    avi_u16(file, 0);
+    avi_u16(file, g_format.width);
+    avi_u16(file, g_format.height);
+    fwrite("strf", 1, 4, file);
+    avi_u32(file, 40);      // BITMAPINFOHEADER
+    avi_u32(file, 40);
+    avi_u32(file, g_format.width);
+    avi_u32(file, g_format.height);
+    avi_u16(file, 1);       // planes
+    avi_u16(file, 24);      // bit count
+    fwrite("MJPG", 1, 4, file);
+    avi_u32(file, g_format.width * g_format.height * 3);
+    for (int i = 0; i < 4; i++)
+        avi_u32(file, 0);
+    fwrite("LIST", 1, 4, file);
+    avi_u32(file, 4);       // movi size, patched on close
+    fwrite("movi", 1, 4, file);
+}
+static void rec_sink(void *context, void *data, int size)
+{
+    // in-memory sink for stbi_write_jpg_to_func, the slot buffer only ever grows
+    RecSlot *slot = (RecSlot *)context;
+    if (slot->jpg_len < 0)
+        return;
+    if (slot->jpg_len + size > slot->jpg_cap)
+    {
+        int cap = MAX(slot->jpg_cap * 2, slot->jpg_len + size);
+        unsigned char *jpg = (unsigned char *)realloc(slot->jpg, cap);
+        if (jpg == NULL)
+        {
+            slot->jpg_len = -1;
+            return;
+        }
+        slot->jpg = jpg;
+        slot->jpg_cap = cap;
+    }
+    memcpy(slot->jpg + slot->jpg_len, data, size);
+    slot->jpg_len += size;
+}
+static void *rec_encoder(void *arg)
+{
+    Recorder *rec = (Recorder *)arg;
+    pthread_mutex_lock(&rec->lock);
+    for (;;)
+    {
+        while (rec->encode_q.count == 0 && !rec->stopping)
+            pthread_cond_wait(&rec->encode_ready, &rec->lock);
+        if (rec->encode_q.count == 0)
+            break; // stopping and drained
+        int i = rec_queue_pop(&rec->encode_q);
+        pthread_mutex_unlock(&rec->lock);
+
+        RecSlot *slot = &rec->slots[i];
+        slot->jpg_len = 0;
+        BGRAtoRGBA(slot->frame, slot->frame, g_format.width * g_format.height);
+        int ok = stbi_write_jpg_to_func(rec_sink, slot, g_format.width, g_format.height, CHANNEL_NUM,
+                                        slot->frame, REC_QUALITY) && slot->jpg_len > 0;
+
+        pthread_mutex_lock(&rec->lock);
+        if (ok)
+        {
+            rec_queue_push(&rec->write_q, i);
+            pthread_cond_signal(&rec->write_ready);
+        }
+        else
+        {
+            rec_queue_push(&rec->free_q, i);
+            rec->dropped++;
+        }
+    }
+    rec->encoder_done = true;
+    pthread_cond_signal(&rec->write_ready);
+    pthread_mutex_unlock(&rec->lock);
+    return NULL;
+}
+static void *rec_writer(void *arg)
+{
+    Recorder *rec = (Recorder *)arg;
+    pthread_mutex_lock(&rec->lock);
+    for (;;)
+    {
+        while (rec->write_q.count == 0 && !rec->encoder_done)
+            pthread_cond_wait(&rec->write_ready, &rec->lock);
+        if (rec->write_q.count == 0)
+            break;
+        int i = rec_queue_pop(&rec->write_q);
+        pthread_mutex_unlock(&rec->lock);
+
+        RecSlot *slot = &rec->slots[i];
+        unsigned int size = slot->jpg_len;
+        unsigned int padded = (size + 1) & ~1u; // chunks are word aligned
+        bool written = false;
+        if (!rec->failed && rec->movi_size + 8 + padded < REC_MAX_BYTES)
+        {
+            if (rec->frames == rec->index_cap)
+            {
+                int cap = rec->index_cap ? rec->index_cap * 2 : 1024;
+                unsigned int *index = (unsigned int *)realloc(rec->index, cap * 2 * sizeof(unsigned int));
+                if (index != NULL)
+                {
+                    rec->index = index;
+                    rec->index_cap = cap;
+                }
+            }
+            if (rec->frames < rec->index_cap)
+            {
+                rec->index[rec->frames * 2] = rec->movi_size; // offset from the 'movi' fourcc
+                rec->index[rec->frames * 2 + 1] = size;
+                fwrite("00dc", 1, 4, rec->file);
+                avi_u32(rec->file, size);
+                fwrite(slot->jpg, 1, size, rec->file);
+                if (padded != size)
+                    fputc(0, rec->file);
+                if (fflush(rec->file) != 0 || ferror(rec->file))
+                {
+                    // disk full or gone, the index keeps to the frames before this one
+                    printf("Writing %s failed, recording stopped\n", REC_FILE_NAME);
+                    rec->failed = true;
+                }
+                else
+                {
+                    rec->movi_size += 8 + padded;
+                    rec->max_jpg = MAX(rec->max_jpg, size);
+                    if (rec->frames == 0)
+                        rec->first_time = slot->time;
+                    rec->last_time = slot->time;
+                    rec->frames++;
+                    written = true;
+                }
+            }
+        }
+
+        pthread_mutex_lock(&rec->lock);
+        if (!written)
+            rec->dropped++;
+        rec_queue_push(&rec->free_q, i);
+    }
+    pthread_mutex_unlock(&rec->lock);
+    return NULL;
+}
+Recorder *rec_open(const char *file_name)
+{
+    Recorder *rec = (Recorder *)calloc(1, sizeof(Recorder));
+    if (rec == NULL)
+        return NULL;
+    rec->file = fopen(file_name, "wb");
+    if (rec->file == NULL)
+    {
+        printf("Could not open %s\n", file_name);
+        free(rec);
+        return NULL;
+    }
+    for (int i = 0; i < REC_SLOTS; i++)
+    {
+        rec->slots[i].jpg_cap = g_format.width * g_format.height / 4;
+        rec->slots[i].jpg = (unsigned char *)malloc(rec->slots[i].jpg_cap);
+        rec->slots[i].frame = (Pixel *)malloc(g_format.width * g_format.height * sizeof(Pixel));
+        if (rec->slots[i].frame == NULL || rec->slots[i].jpg == NULL)
+        {
+            printf("Recorder allocation failed\n");
+            for (int j = 0; j <= i; j++)
+            {
+                free(rec->slots[j].frame);
+                free(rec->slots[j].jpg);
+            }
+            fclose(rec->file);
+            free(rec);
+            return NULL;
+        }
+        rec_queue_push(&rec->free_q, i);
+    }
+    avi_write_header(rec->file);
+    rec->movi_start = ftell(rec->file) - 4;
+    rec->movi_size = 4;
+    pthread_mutex_init(&rec->lock, NULL);
+    pthread_cond_init(&rec->encode_ready, NULL);
+    pthread_cond_init(&rec->write_ready, NULL);
+    pthread_create(&rec->encoder, NULL, rec_encoder, rec);
+    pthread_create(&rec->writer, NULL, rec_writer, rec);
+    return rec;
+}
+void rec_push(Recorder *rec, const Pixel *rgbConversion)
+{
+    // called from capture, only takes the lock for queue bookkeeping
+    if (rec->frame_counter++ % REC_EVERY_N != 0)
+        return;
+    pthread_mutex_lock(&rec->lock);
+    if (rec->free_q.count == 0)
+    {
+        rec->dropped++; // encoder or disk is behind
+        pthread_mutex_unlock(&rec->lock);
+        return;
+    }
+    int i = rec_queue_pop(&rec->free_q);
+    pthread_mutex_unlock(&rec->lock);
+
+    memcpy(rec->slots[i].frame, rgbConversion, g_format.width * g_format.height * sizeof(Pixel));
+    rec->slots[i].time = omp_get_wtime();
+
+    pthread_mutex_lock(&rec->lock);
+    rec_queue_push(&rec->encode_q, i);
+    pthread_cond_signal(&rec->encode_ready);
+    pthread_mutex_unlock(&rec->lock);
+}
+int rec_close(Recorder *rec)
+{
+    // lets the threads drain what is queued, then writes the index and patches the header
+    pthread_mutex_lock(&rec->lock);
+    rec->stopping = true;
+    pthread_cond_signal(&rec->encode_ready);
+    pthread_mutex_unlock(&rec->lock);
+    pthread_join(rec->encoder, NULL);
+    pthread_join(rec->writer, NULL);
+
+    FILE *file = rec->file;
+    if (rec->failed)
+    {
+        // the index goes over the frame that did not fit
+        clearerr(file);
+        fseek(file, rec->movi_start + rec->movi_size, SEEK_SET);
+    }
+    fwrite("idx1", 1, 4, file);
+    avi_u32(file, rec->frames * 16);
+    for (int i = 0; i < rec->frames; i++)
+    {
+        fwrite("00dc", 1, 4, file);
+        avi_u32(file, 0x10); // AVIIF_KEYFRAME
+        avi_u32(file, rec->index[i * 2]);
+        avi_u32(file, rec->index[i * 2 + 1]);
+    }
+    long end = ftell(file);
+
+    // frame rate from the capture times of the recorded frames
+    unsigned int usec = 33333;
+    if (rec->frames > 1 && rec->last_time > rec->first_time)
+        usec = (unsigned int)((rec->last_time - rec->first_time) * 1e6 / (rec->frames - 1) + 0.5);
+    avi_patch_u32(file, AVI_RIFF_SIZE, end - 8);
+    avi_patch_u32(file, AVI_USEC_PER_FRAME, usec);
+    avi_patch_u32(file, AVI_TOTAL_FRAMES, rec->frames);
+    avi_patch_u32(file, AVI_SUGGESTED_BUFFER, rec->max_jpg);
+    avi_patch_u32(file, AVI_STRH_SCALE, usec);
+    avi_patch_u32(file, AVI_STRH_RATE, 1000000);
+    avi_patch_u32(file, AVI_STRH_LENGTH, rec->frames);
+    avi_patch_u32(file, AVI_STRH_BUFFER, rec->max_jpg);
+    avi_patch_u32(file, AVI_MOVI_SIZE, rec->movi_size);
+    int ok = !rec->failed && ferror(file) == 0;
+    if (rec->failed && fflush(file) == 0 && ftruncate(fileno(file), end) < 0)
+        printf("Could not trim %s\n", REC_FILE_NAME);
+    if (fclose(file) != 0)
+        ok = false;
+
+    printf("Recorded %d frames to %s, %d dropped%s\n", rec->frames, REC_FILE_NAME, rec->dropped,
+           ok ? "" : ", the file is incomplete");
+    for (int i = 0; i < REC_SLOTS; i++)
+    {
+        free(rec->slots[i].frame);
+        free(rec->slots[i].jpg);
+    }
+    free(rec->index);
+    pthread_mutex_destroy(&rec->lock);
+    pthread_cond_destroy(&rec->encode_ready);
+    pthread_cond_destroy(&rec->write_ready);
+    free(rec);
+    return ok ? 0 : -1;
+}
+// Y4M writer
+// Y4M only has planar layouts, so frames are split into planes one row at a
+// time straight into the io_uring buffers, which go to disk as large aligned
+// writes without waiting on page cache writeback.
+typedef struct Y4MWriter
+{
+    UringWriter *out;
+    bool yuyv; // 4:2:2 from the camera, else 4:4:4 from the BGRA texture
+    int frames;
+} Y4MWriter;
+static void y4m_put(Y4MWriter *y4m, const void *data, size_t size)
+{
+    uring_write(y4m->out, (void *)data, (int)size);
+}
+Y4MWriter *y4m_open(const char *file_name, bool yuyv)
+{
+    Y4MWriter *y4m = (Y4MWriter *)calloc(1, sizeof(Y4MWriter));
+    if (y4m == NULL)
+        return NULL;
+    y4m->out = uring_open(file_name, Y4M_O_DIRECT);
+    if (y4m->out == NULL)
+    {
+        free(y4m);
+        return NULL;
+    }
+    y4m->yuyv = yuyv;
+    char header[128];
+    int len = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 %s XCOLORRANGE=LIMITED\n",
+                       g_format.width, g_format.height, Y4M_FPS, yuyv ? "C422" : "C444");
+    y4m_put(y4m, header, len);
+    return y4m;
+}
+void y4m_write_yuyv(Y4MWriter *y4m, const unsigned char *yuyv)
+{
+    // the camera samples go in unchanged, Y plane then Cb then Cr
+    unsigned char row[g_format.width];
+    y4m_put(y4m, "FRAME\n", 6);
+    for (int y = 0; y < g_format.height; y++)
+    {
+        const unsigned char *line = yuyv + y * g_format.bytesperline;
+        for (int x = 0; x < g_format.width; x++)
+            row[x] = line[x * 2];
+        y4m_put(y4m, row, g_format.width);
+    }
+    for (int plane = 1; plane <= 3; plane += 2)
+    {
+        for (int y = 0; y < g_format.height; y++)
+        {
+            const unsigned char *line = yuyv + y * g_format.bytesperline + plane;
+            for (int x = 0; x < g_format.width / 2; x++)
+                row[x] = line[x * 4];
+            y4m_put(y4m, row, g_format.width / 2);
+        }
+    }
+    y4m->frames++;
+}
+void y4m_write_bgra(Y4MWriter *y4m, const Pixel *rgbConversion)
+{
+    // BT.601 video range, the inverse of YUYVtoRGB
+    unsigned char row[g_format.width];
+    y4m_put(y4m, "FRAME\n", 6);
+    for (int plane = 0; plane < 3; plane++)
+    {
+        for (int y = 0; y < g_format.height; y++)
+        {
+            const Pixel *line = &rgbConversion[y * g_format.width];
+            for (int x = 0; x < g_format.width; x++)
+            {
+                int r = line[x].R, g = line[x].G, b = line[x].B;
+                if (plane == 0)
+                    row[x] = 16 + ((66 * r + 129 * g + 25 * b + 128) >> 8);
+                else if (plane == 1)
+                    row[x] = 128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8);
+                else
+                    row[x] = 128 + ((112 * r - 94 * g - 18 * b + 128) >> 8);
+            }
+            y4m_put(y4m, row, g_format.width);
+        }
+    }
+    y4m->frames++;
+}
+int y4m_close(Y4MWriter *y4m, const char *file_name)
+{
+    int saved = uring_close(y4m->out);
+    printf("Wrote %d frames to %s\n", y4m->frames, file_name);
+    free(y4m);
+    return saved;
+}
+// Pre-trigger ring (--pretrigger)
+// Keeps the last raw YUYV frames in memory that is allocated once. On an event
+// the frames of the last PRETRIGGER_SECONDS are pinned and a flush thread
+// writes them to a Y4M file, unpinning each slot once it is on its way.
+// Capture never waits: a frame that would overwrite a pinned slot is skipped.
+// Direction changes are debounced, a flickering detection gives one dump.
+typedef struct PreTrigger
+{
+    unsigned char *memory; // raw frames, as many as fit in PRETRIGGER_BUDGET
+    size_t frame_size;
+    int frames;
+    double *time;
+    bool *pinned; // owned by the flush thread until cleared
+    int head;  // next slot capture writes
+    int count; // frames in the ring
+    int skipped;
+    // direction debounce, capture thread only
+    int direction; // last direction that held PRETRIGGER_HOLD
+    int candidate; // latest direction seen
+    double since;  // when candidate was first seen
+    double last_event;
+    // trigger state, shared with the flush thread
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    bool flushing;
+    bool quit;
+    int first; // oldest pinned slot
+    int n;     // pinned slots
+    int events;
+} PreTrigger;
+static unsigned char *pretrigger_frame(PreTrigger *pt, int slot)
+{
+    return pt->memory + (size_t)slot * pt->frame_size;
+}
+static void *pretrigger_flush(void *arg)
+{
+    PreTrigger *pt = (PreTrigger *)arg;
+    pthread_mutex_lock(&pt->lock);
+    for (;;)
+    {
+        while (!pt->flushing && !pt->quit)
+            pthread_cond_wait(&pt->wake, &pt->lock);
+        if (!pt->flushing)
+            break;
+        int first = pt->first, n = pt->n, event = pt->events;
+        pthread_mutex_unlock(&pt->lock);
+
+        char file_name[64];
+        snprintf(file_name, sizeof(file_name), PRETRIGGER_FILE_NAME, event);
+        Y4MWriter *y4m = y4m_open(file_name, true);
+        for (int i = 0; i < n; i++)
+        {
+            int slot = (first + i) % pt->frames;
+            if (y4m != NULL)
+                y4m_write_yuyv(y4m, pretrigger_frame(pt, slot));
+            __atomic_store_n(&pt->pinned[slot], false, __ATOMIC_RELEASE);
+        }
+        if (y4m != NULL)
+            y4m_close(y4m, file_name);
+
+        pthread_mutex_lock(&pt->lock);
+        pt->flushing = false;
+    }
+    pthread_mutex_unlock(&pt->lock);
+    return NULL;
+}
+PreTrigger *pretrigger_open()
+{
+    PreTrigger *pt = (PreTrigger *)calloc(1, sizeof(PreTrigger));
+    if (pt == NULL)
+        return NULL;
+    pt->frame_size = (size_t)g_format.bytesperline * g_format.height;
+    pt->frames = PRETRIGGER_BUDGET / pt->frame_size;
+    pt->time = (double *)calloc(pt->frames, sizeof(double));
+    pt->pinned = (bool *)calloc(pt->frames, sizeof(bool));
+    if (pt->frames < 1 || pt->time == NULL || pt->pinned == NULL ||
+        posix_memalign((void **)&pt->memory, URING_ALIGN, pt->frames * pt->frame_size) != 0)
+    {
+        printf("Pre-trigger allocation failed\n");
+        free(pt->time);
+        free(pt->pinned);
+        free(pt);
+        return NULL;
+    }
+    pt->direction = -1;
+    pt->candidate = -1;
+    pt->last_event = -PRETRIGGER_INTERVAL;
+    pthread_mutex_init(&pt->lock, NULL);
+    pthread_cond_init(&pt->wake, NULL);
+    pthread_create(&pt->thread, NULL, pretrigger_flush, pt);
+    return pt;
+}
+void pretrigger_push(PreTrigger *pt, const unsigned char *yuyv, double now)
+{
+    // capture thread only, no allocation and no lock
+    int slot = pt->head;
+    if (__atomic_load_n(&pt->pinned[slot], __ATOMIC_ACQUIRE))
+    {
+        pt->skipped++; // the flush has not reached this slot yet
+        return;
+    }
+    memcpy(pretrigger_frame(pt, slot), yuyv, pt->frame_size);
+    pt->time[slot] = now;
+    pt->head = (slot + 1) % pt->frames;
+    pt->count = MIN(pt->count + 1, pt->frames);
+}
+void pretrigger_fire(PreTrigger *pt, double now)
+{
+    // capture thread only; an event during a flush is folded into that flush
+    pthread_mutex_lock(&pt->lock);
+    if (pt->flushing)
+    {
+        pthread_mutex_unlock(&pt->lock);
+        return;
+    }
+    int oldest = (pt->head - pt->count + pt->frames) % pt->frames;
+    int first = -1, n = 0;
+    for (int i = 0; i < pt->count; i++)
+    {
+        int slot = (oldest + i) % pt->frames;
+        if (pt->time[slot] < now - PRETRIGGER_SECONDS)
+            continue;
+        if (first < 0)
+            first = slot;
+        pt->pinned[slot] = true;
+        n++;
+    }
+    if (n > 0)
+    {
+        pt->first = first;
+        pt->n = n;
+        pt->events++;
+        pt->last_event = now;
+        pt->flushing = true;
+        printf("Event %d, writing %d frames\n", pt->events, n);
+        pthread_cond_signal(&pt->wake);
+    }
+    pthread_mutex_unlock(&pt->lock);
+}
+void pretrigger_direction(PreTrigger *pt, int dic, double now)
+{
+    // capture thread only; a new direction fires once it has held, and not
+    // sooner than PRETRIGGER_INTERVAL after the last dump
+    if (dic != pt->candidate)
+    {
+        pt->candidate = dic;
+        pt->since = now;
+    }
+    if (pt->candidate == pt->direction || now - pt->since < PRETRIGGER_HOLD)
+        return;
+    pt->direction = pt->candidate;
+    if (now - pt->last_event >= PRETRIGGER_INTERVAL)
+        pretrigger_fire(pt, now);
+}
+void pretrigger_close(PreTrigger *pt)
+{
+    // a flush that is under way is finished first
+    pthread_mutex_lock(&pt->lock);
+    pt->quit = true;
+    pthread_cond_signal(&pt->wake);
+    pthread_mutex_unlock(&pt->lock);
+    pthread_join(pt->thread, NULL);
+    pthread_mutex_destroy(&pt->lock);
+    pthread_cond_destroy(&pt->wake);
+    free(pt->memory);
+    free(pt->time);
+    free(pt->pinned);
+    free(pt);
+}
+// Frame bus publisher (--frame-bus)
+// Copies each camera frame once into a memfd ring that local processes map
+// read-only (see frame_bus.h). The header and the slots are separate memfds so
+// the slots can be write sealed while readers still update their cursors.
+// Connections are accepted without blocking and readers are never waited for;
+// with none attached nothing is copied.
+typedef struct FrameBus
+{
+    int memfd;     // header
+    int data_fd;   // slots
+    int reader_fd; // what readers get for the slots: data_fd once sealed, else a read-only reopen
+    int listen_fd;
+    FrameBusHeader *header;
+    unsigned char *data;
+    size_t data_size;
+    int dmabuf[FRAME_BUS_SLOTS]; // exported capture buffers handed to readers
+    int dmabuf_count;
+} FrameBus;
+FrameBus *frame_bus_open(const char *socket_path)
+{
+    FrameBus *bus = (FrameBus *)calloc(1, sizeof(FrameBus));
+    if (bus == NULL)
+        return NULL;
+    size_t frame_size = g_format.sizeimage;
+    size_t slot_size = (frame_size + FRAME_BUS_PAGE - 1) & ~(size_t)(FRAME_BUS_PAGE - 1);
+    bus->data_size = FRAME_BUS_SLOTS * slot_size;
+    bus->listen_fd = -1;
+    bus->reader_fd = -1;
+    bus->memfd = memfd_create("lab2-frames-header", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    bus->data_fd = memfd_create("lab2-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (bus->memfd < 0 || bus->data_fd < 0 || ftruncate(bus->memfd, FRAME_BUS_HEADER_SIZE) < 0 ||
+        ftruncate(bus->data_fd, bus->data_size) < 0)
+    {
+        perror("frame bus memfd");
+        goto fail;
+    }
+    // readers can rely on the size never changing under their mapping; the
+    // slots are write sealed by frame_bus_seal once the capture dmabufs exist
+    fcntl(bus->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+    fcntl(bus->data_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+    bus->header = (FrameBusHeader *)mmap(NULL, FRAME_BUS_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, bus->memfd, 0);
+    bus->data = (unsigned char *)mmap(NULL, bus->data_size, PROT_READ | PROT_WRITE, MAP_SHARED, bus->data_fd, 0);
+    if (bus->header == MAP_FAILED || bus->data == MAP_FAILED)
+    {
+        perror("frame bus mmap");
+        goto fail;
+    }
+    FrameBusHeader *h = bus->header;
+    h->version = FRAME_BUS_VERSION;
+    h->width = g_format.width;
+    h->height = g_format.height;
+    h->pixelformat = g_format.pixelformat;
+    h->stride = g_format.bytesperline;
+    h->slots = FRAME_BUS_SLOTS;
+    h->slot_size = slot_size;
+    h->data_offset = 0;
+    __atomic_store_n(&h->magic, FRAME_BUS_MAGIC, __ATOMIC_RELEASE);
+
+    bus->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    unlink(socket_path);
+    if (bus->listen_fd < 0 || bind(bus->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(bus->listen_fd, FRAME_BUS_MAX_CONSUMERS) < 0)
+    {
+        perror("frame bus socket");
+        goto fail;
+    }
+    return bus;
+fail:
+    if (bus->header != NULL && bus->header != MAP_FAILED)
+        munmap(bus->header, FRAME_BUS_HEADER_SIZE);
+    if (bus->data != NULL && bus->data != MAP_FAILED)
+        munmap(bus->data, bus->data_size);
+    if (bus->memfd >= 0)
+        close(bus->memfd);
+    if (bus->data_fd >= 0)
+        close(bus->data_fd);
+    if (bus->listen_fd >= 0)
+        close(bus->listen_fd);
+    free(bus);
+    return NULL;
+}
+int frame_bus_seal(FrameBus *bus)
+{
+    // after this only our own mapping (and the capture dmabufs) can write the
+    // slots; udmabuf refuses write sealed memfds, so it comes after their setup
+    if (fcntl(bus->data_fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) == 0)
+    {
+        bus->reader_fd = bus->data_fd;
+        return 0;
+    }
+    // kernels before 5.1: readers get a read-only file description instead
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", bus->data_fd);
+    bus->reader_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (bus->reader_fd < 0)
+    {
+        perror("frame bus seal");
+        return -1;
+    }
+    return 0;
+}
+void frame_bus_accept(FrameBus *bus)
+{
+    // hands the memfds (and exported capture buffers) to every waiting reader, never blocks
+    int conn;
+    while ((conn = accept4(bus->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        if (bus->reader_fd < 0)
+        {
+            close(conn); // not sealed, the slots are not handed out writable
+            continue;
+        }
+        char byte = 0;
+        char control[CMSG_SPACE(sizeof(int) * (2 + FRAME_BUS_SLOTS))];
+        struct iovec iov = {&byte, 1};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        memset(control, 0, sizeof(control));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (2 + bus->dmabuf_count));
+        memcpy(CMSG_DATA(cmsg), &bus->memfd, sizeof(int));
+        memcpy(CMSG_DATA(cmsg) + sizeof(int), &bus->reader_fd, sizeof(int));
+        memcpy(CMSG_DATA(cmsg) + 2 * sizeof(int), bus->dmabuf, sizeof(int) * bus->dmabuf_count);
+        msg.msg_controllen = cmsg->cmsg_len;
+        sendmsg(conn, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(conn);
+    }
+}
+int frame_bus_readers(FrameBus *bus)
+{
+    // readers holding a consumer entry; entries of readers that died are freed
+    int readers = 0;
+    for (int i = 0; i < FRAME_BUS_MAX_CONSUMERS; i++)
+    {
+        int32_t pid = __atomic_load_n(&bus->header->consumers[i].pid, __ATOMIC_ACQUIRE);
+        if (pid == 0)
+            continue;
+        if (kill(pid, 0) == 0 || errno != ESRCH)
+            readers++;
+        else
+            __atomic_compare_exchange_n(&bus->header->consumers[i].pid, &pid, 0, false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED);
+    }
+    return readers;
+}
+unsigned char *frame_bus_slot(FrameBus *bus, int slot)
+{
+    return bus->data + (size_t)slot * bus->header->slot_size;
+}
+void frame_bus_begin(FrameBus *bus, int slot)
+{
+    // seqlock write: the sequence stays odd while the slot data changes
+    FrameBusSlot *s = &bus->header->slot[slot];
+    __atomic_store_n(&s->seq, s->seq | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+int frame_bus_commit(FrameBus *bus, int slot, int bytes, double timestamp, int buffer)
+{
+    // makes the slot the next frame; frames have to fill the slots in ring order
+    FrameBusHeader *h = bus->header;
+    uint32_t n = h->head;
+    if ((uint32_t)slot != n % FRAME_BUS_SLOTS)
+        return -1;
+    FrameBusSlot *s = &h->slot[slot];
+    s->bytes = bytes;
+    s->timestamp = timestamp;
+    s->buffer = buffer;
+    __atomic_store_n(&s->seq, 2 * (n + 1), __ATOMIC_RELEASE);
+    __atomic_store_n(&h->head, n + 1, __ATOMIC_RELEASE);
+    frame_bus_futex(&h->head, FUTEX_WAKE, INT32_MAX, NULL);
+    return 0;
+}
+void frame_bus_publish(FrameBus *bus, const unsigned char *frame, int bytes, double timestamp, int buffer)
+{
+    int slot = bus->header->head % FRAME_BUS_SLOTS;
+    frame_bus_begin(bus, slot);
+    memcpy(frame_bus_slot(bus, slot), frame, MIN(bytes, (int)bus->header->slot_size));
+    frame_bus_commit(bus, slot, bytes, timestamp, buffer);
+}
+void frame_bus_set_capture_dmabufs(FrameBus *bus, const int *fds, int count)
+{
+    // readers connecting from now on get these after the memfds
+    bus->dmabuf_count = MIN(count, FRAME_BUS_SLOTS);
+    memcpy(bus->dmabuf, fds, sizeof(int) * bus->dmabuf_count);
+    bus->header->capture_buffers = bus->dmabuf_count;
+}
+int frame_bus_slot_dmabuf(FrameBus *bus, int slot)
+{
+    // a dmabuf over one slot of the memfd, so the camera can capture into it
+    int dev = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+    if (dev < 0)
+        return -1;
+    struct udmabuf_create create;
+    memset(&create, 0, sizeof(create));
+    create.memfd = bus->data_fd;
+    create.flags = UDMABUF_FLAGS_CLOEXEC;
+    create.offset = frame_bus_slot(bus, slot) - bus->data;
+    create.size = bus->header->slot_size;
+    int fd = ioctl(dev, UDMABUF_CREATE, &create);
+    close(dev);
+    return fd;
+}
+void frame_bus_close(FrameBus *bus, const char *socket_path)
+{
+    close(bus->listen_fd);
+    unlink(socket_path);
+    munmap(bus->header, FRAME_BUS_HEADER_SIZE);
+    munmap(bus->data, bus->data_size);
+    if (bus->reader_fd >= 0 && bus->reader_fd != bus->data_fd)
+        close(bus->reader_fd);
+    close(bus->memfd); // readers keep their own mappings
+    close(bus->data_fd);
+    free(bus);
+}
+// Detection result channel
+// Results go out as one SOCK_SEQPACKET packet per frame to every connected
+// consumer (see detection.h). Sends never block: a consumer whose socket
+// buffer is full misses that result, one that hung up is dropped.
+typedef struct DetectionChannel
+{
+    int listen_fd;
+    int clients[DETECTION_MAX_CLIENTS];
+    int client_count;
+    int missed;
+} DetectionChannel;
+DetectionChannel *detection_open(const char *socket_path)
+{
+    DetectionChannel *ch = (DetectionChannel *)calloc(1, sizeof(DetectionChannel));
+    if (ch == NULL)
+        return NULL;
+    ch->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    unlink(socket_path);
+    if (ch->listen_fd < 0 || bind(ch->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(ch->listen_fd, DETECTION_MAX_CLIENTS) < 0)
+    {
+        perror("detection socket");
+        if (ch->listen_fd >= 0)
+            close(ch->listen_fd);
+        free(ch);
+        return NULL;
+    }
+    return ch;
+}
+int detection_accept(DetectionChannel *ch)
+{
+    // takes new consumers, returns how many there are
+    int conn;
+    while (ch->client_count < DETECTION_MAX_CLIENTS &&
+           (conn = accept4(ch->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+        ch->clients[ch->client_count++] = conn;
+    return ch->client_count;
+}
+void detection_publish(DetectionChannel *ch, const DetectionResult *result)
+{
+    detection_accept(ch);
+    for (int i = 0; i < ch->client_count; i++)
+    {
+        if (send(ch->clients[i], result, sizeof(*result), MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(*result))
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            ch->missed++; // consumer is behind
+            continue;
+        }
+        close(ch->clients[i]);
+        ch->clients[i--] = ch->clients[--ch->client_count];
+    }
+}
+void detection_close(DetectionChannel *ch, const char *socket_path)
+{
+    for (int i = 0; i < ch->client_count; i++)
+        close(ch->clients[i]);
+    close(ch->listen_fd);
+    unlink(socket_path);
+    free(ch);
+}
+// Converters
+// Every converter turns one frame of its V4L2 format into BGRA pixels through
+// YUYVtoRGB (MJPEG through libjpeg); the format is picked by negotiate_format.
+void ConvertYUYV(const CameraFormat *fmt, const unsigned char *_yuv, int _size, Pixel *rgbConversion)
+{
+    (void)_size;
+    fmt->kernels->convert_yuyv(fmt, _yuv, rgbConversion);
+}
+void ConvertUYVY(const CameraFormat *fmt, const unsigned char *_uyvy, int _size, Pixel *rgbConversion)
+{
+    (void)_size;
+#pragma omp parallel for num_threads(img_threads)
+    for (int y = 0; y < fmt->height; y++)
+    {
+        const unsigned char *line = _uyvy + y * fmt->bytesperline;
+        Pixel *out = &rgbConversion[y * fmt->width];
+        for (int x = 0; x < fmt->width; x += 2, line += 4)
+        {
+            YUYVtoRGB(line[1], line[0], line[2], &out[x]);
+            YUYVtoRGB(line[3], line[0], line[2], &out[x + 1]);
+        }
+    }
+}
+static void Convert420(const CameraFormat *fmt, const unsigned char *luma, const unsigned char *cb, const unsigned char *cr,
+                       int chroma_stride, int chroma_step, Pixel *rgbConversion)
+{
+    // shared by NV12 (interleaved CbCr, step 2) and I420 (separate planes, step 1)
+#pragma omp parallel for num_threads(img_threads)
+    for (int y = 0; y < fmt->height; y++)
+    {
+        const unsigned char *line = luma + y * fmt->bytesperline;
+        const unsigned char *u = cb + (y / 2) * chroma_stride;
+        const unsigned char *v = cr + (y / 2) * chroma_stride;
+        Pixel *out = &rgbConversion[y * fmt->width];
+        for (int x = 0; x < fmt->width; x += 2, u += chroma_step, v += chroma_step)
+        {
+            YUYVtoRGB(line[x], *u, *v, &out[x]);
+            YUYVtoRGB(line[x + 1], *u, *v, &out[x + 1]);
+        }
+    }
+}
+void ConvertNV12(const CameraFormat *fmt, const unsigned char *_nv12, int _size, Pixel *rgbConversion)
+{
+    (void)_size;
+    const unsigned char *uv = _nv12 + fmt->bytesperline * fmt->height;
+    Convert420(fmt, _nv12, uv, uv + 1, fmt->bytesperline, 2, rgbConversion);
+}
+void ConvertI420(const CameraFormat *fmt, const unsigned char *_i420, int _size, Pixel *rgbConversion)
+{
+    (void)_size;
+    int chroma_stride = fmt->bytesperline / 2;
+    const unsigned char *u = _i420 + fmt->bytesperline * fmt->height;
+    const unsigned char *v = u + chroma_stride * (fmt->height / 2);
+    Convert420(fmt, _i420, u, v, chroma_stride, 1, rgbConversion);
+}
+typedef struct MJPEGError
+{
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+} MJPEGError;
+static void mjpeg_error_exit(j_common_ptr cinfo)
+{
+    // a corrupt frame must not take the process down
+    longjmp(((MJPEGError *)cinfo->err)->jump, 1);
+}
+void ConvertMJPEG(const CameraFormat *fmt, const unsigned char *_jpeg, int _size, Pixel *rgbConversion)
+{
+    // one decompressor per capture thread for the whole run; libjpeg-turbo
+    // supplies the Huffman tables UVC cameras leave out of their frames
+    static __thread struct jpeg_decompress_struct cinfo;
+    static __thread MJPEGError jerr;
+    static __thread bool created = false;
+    if (!created)
+    {
+        cinfo.err = jpeg_std_error(&jerr.mgr);
+        jerr.mgr.error_exit = mjpeg_error_exit;
+        jpeg_create_decompress(&cinfo);
+        created = true;
+    }
+    if (setjmp(jerr.jump))
+    {
+        jpeg_abort_decompress(&cinfo);
+        return; // keeps the previous picture
+    }
+    jpeg_mem_src(&cinfo, _jpeg, _size);
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK)
+        return;
+    if ((int)cinfo.image_width != fmt->width || (int)cinfo.image_height != fmt->height)
+    {
+        jpeg_abort_decompress(&cinfo);
+        return;
+    }
+    cinfo.out_color_space = JCS_EXT_BGRA; // same byte order as Pixel
+    cinfo.dct_method = JDCT_IFAST;
+    jpeg_start_decompress(&cinfo);
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        JSAMPROW row = (JSAMPROW)&rgbConversion[cinfo.output_scanline * fmt->width];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+}
+typedef struct Converter
+{
+    unsigned int pixelformat;
+    int cost; // relative conversion cost, the cheapest usable format wins
+    void (*convert)(const CameraFormat *fmt, const unsigned char *src, int size, Pixel *rgbConversion);
+} Converter;
+static const Converter converters[] = {
+    {V4L2_PIX_FMT_YUYV, 1, ConvertYUYV},
+    {V4L2_PIX_FMT_UYVY, 1, ConvertUYVY},
+    {V4L2_PIX_FMT_NV12, 2, ConvertNV12},
+    {V4L2_PIX_FMT_YUV420, 2, ConvertI420},
+    {V4L2_PIX_FMT_MJPEG, 10, ConvertMJPEG},
+};
+#define CONVERTER_COUNT ((int)(sizeof(converters) / sizeof(converters[0])))
+const Converter *find_converter(unsigned int pixelformat)
+{
+    for (int i = 0; i < CONVERTER_COUNT; i++)
+        if (converters[i].pixelformat == pixelformat)
+            return &converters[i];
+    return NULL;
+}
+void ConvertImage(const CameraFormat *fmt, const unsigned char *_src, int _size, Pixel *rgbConversion)
+{
+    fmt->converter->convert(fmt, _src, _size, rgbConversion);
+}
+static int detect_spots(const CameraFormat *fmt, const unsigned char *src, Pixel *rgbConversion, bool converted,
+                        Detector *det, LaserSpot *spots)
+{
+    // spots in the mask window, brightest first
+    if (converted)
+        laser_mask(fmt, rgbConversion, &det->mask);
+    else
+        laser_mask_yuyv(fmt, src, rgbConversion, &det->mask);
+    if (det->background.average != NULL)
+        background_filter(fmt, src, rgbConversion, &det->background, &det->mask);
+    if (det->mask.total == 0)
+        return 0;
+    if (det->all_spots)
+        return label_spots(fmt, rgbConversion, det, spots, DETECTION_MAX_SPOTS);
+    int pos_x = -1;
+    int pos_y = -1;
+    int brightest_red = 0;
+    find_laser(fmt, rgbConversion, &det->mask, &pos_x, &pos_y, &brightest_red);
+    if (pos_x == -1 || pos_y == -1)
+        return 0;
+    // the spot's centre instead of one of its pixels
+    spot_measure(fmt, rgbConversion, &det->mask, pos_x, pos_y, &spots[0]);
+    return 1;
+}
+int ProcessImage(const CameraFormat *fmt, const unsigned char *_yuv, int _size, Pixel *rgbConversion, Detector *det,
+                 DetectionResult *result, bool convert)
+{
+    // printf("Processing image! \n");
+    // without convert (YUYV only) the frame is not wanted in RGB: the mask is
+    // made from the camera frame and no markers are drawn
+    convert = convert || fmt->pixelformat != V4L2_PIX_FMT_YUYV;
+    if (convert)
+        ConvertImage(fmt, _yuv, _size, rgbConversion);
+
+    // Find circle and set circle
+    Tracker *track = &det->tracker;
+    LaserSpot spots[DETECTION_MAX_SPOTS];
+    int count = 0;
+    track_predict(track);
+    if (!det->all_spots && track->state != DETECTION_TRACK_LOST)
+    {
+        // look where the spot should be first
+        int x = lroundf(track->x);
+        int y = lroundf(track->y);
+        mask_window(&det->mask, fmt->height, x - TRACK_WINDOW / 2, y - TRACK_WINDOW / 2, x + TRACK_WINDOW / 2, y + TRACK_WINDOW / 2);
+        count = detect_spots(fmt, _yuv, rgbConversion, convert, det, spots);
+    }
+    if (count == 0)
+    {
+        mask_window(&det->mask, fmt->height, 0, 0, fmt->width - 1, fmt->height - 1);
+        count = detect_spots(fmt, _yuv, rgbConversion, convert, det, spots);
+    }
+    track_update(track, fmt, count > 0 ? &spots[0] : NULL);
+    if (det->background.average != NULL)
+        background_update(fmt, _yuv, rgbConversion, &det->background, &det->mask);
+    bool tracked = track->state != DETECTION_TRACK_LOST;
+    int pos_x = tracked ? lroundf(track->x) : -1;
+    int pos_y = tracked ? lroundf(track->y) : -1;
+    int last_dic = direction(fmt, pos_x, pos_y);
+    result->pos_x = pos_x;
+    result->pos_y = pos_y;
+    result->velocity_x = tracked ? track->vx : 0;
+    result->velocity_y = tracked ? track->vy : 0;
+    result->track = track->state;
+    result->brightness = count > 0 ? spots[0].peak : 0;
+    result->direction = last_dic;
+    result->spot_x = count > 0 ? spots[0].x : -1;
+    result->spot_y = count > 0 ? spots[0].y : -1;
+    result->spot_area = count > 0 ? spots[0].area : 0;
+    result->spot_count = count;
+    result->laser_pixels = det->mask.total;
+    for (int i = 0; i < count; i++)
+    {
+        DetectionSpot *out = &result->spots[i];
+        out->x = spots[i].x;
+        out->y = spots[i].y;
+        out->left = spots[i].left;
+        out->top = spots[i].top;
+        out->right = spots[i].right;
+        out->bottom = spots[i].bottom;
+        out->area = spots[i].area;
+        out->intensity = spots[i].intensity;
+        if (!convert)
+            continue;
+        int x = lroundf(spots[i].x);
+        int y = lroundf(spots[i].y);
+        set_circle(fmt, rgbConversion, &x, &y);
+    }
+    return last_dic;
+}
+static double max_fps(int cameraHandle, unsigned int pixelformat, int width, int height)
+{
+    // highest frame rate the driver lists for this format and size
+    struct v4l2_frmivalenum ival;
+    memset(&ival, 0, sizeof(ival));
+    ival.pixel_format = pixelformat;
+    ival.width = width;
+    ival.height = height;
+    double best = 0;
+    for (ival.index = 0; ioctl(cameraHandle, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0; ival.index++)
+    {
+        struct v4l2_fract f = ival.type == V4L2_FRMIVAL_TYPE_DISCRETE ? ival.discrete : ival.stepwise.min;
+        if (f.numerator > 0)
+            best = MAX(best, (double)f.denominator / f.numerator);
+        if (ival.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+            break;
+    }
+    return ival.index == 0 ? CAM_FPS : best; // drivers without the ioctl are taken at their word
+}
+static bool has_frame_size(int cameraHandle, unsigned int pixelformat, int width, int height)
+{
+    struct v4l2_frmsizeenum size;
+    memset(&size, 0, sizeof(size));
+    size.pixel_format = pixelformat;
+    for (size.index = 0; ioctl(cameraHandle, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++)
+    {
+        if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE)
+        {
+            if ((int)size.discrete.width == width && (int)size.discrete.height == height)
+                return true;
+            continue;
+        }
+        struct v4l2_frmsize_stepwise *sw = &size.stepwise;
+        return width >= (int)sw->min_width && width <= (int)sw->max_width &&
+               height >= (int)sw->min_height && height <= (int)sw->max_height &&
+               (width - sw->min_width) % MAX(sw->step_width, 1u) == 0 &&
+               (height - sw->min_height) % MAX(sw->step_height, 1u) == 0;
+    }
+    return size.index == 0; // no size list, let S_FMT decide
+}
+int negotiate_format(int cameraHandle, int width, int height, int fps, CameraFormat *chosen)
+{
+    // cheapest converter that reaches fps at width x height, else the fastest one
+    const Converter *best = NULL;
+    double best_fps = 0;
+    struct v4l2_fmtdesc desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    for (desc.index = 0; ioctl(cameraHandle, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++)
+    {
+        const Converter *conv = find_converter(desc.pixelformat);
+        bool usable = conv != NULL && has_frame_size(cameraHandle, desc.pixelformat, width, height);
+        double rate = usable ? max_fps(cameraHandle, desc.pixelformat, width, height) : 0;
+        printf("Format %.4s (%s)%s, %.0f fps\n", (char *)&desc.pixelformat, desc.description,
+               conv == NULL ? " no converter" : usable ? "" : " no frame size", rate);
+        if (!usable)
+            continue;
+        bool fast_enough = rate >= fps;
+        bool best_fast_enough = best_fps >= fps;
+        if (best == NULL || (fast_enough && !best_fast_enough) ||
+            (fast_enough == best_fast_enough && (fast_enough ? conv->cost < best->cost : rate > best_fps)))
+        {
+            best = conv;
+            best_fps = rate;
+        }
+    }
+    if (best == NULL)
+        return -1;
+    chosen->pixelformat = best->pixelformat;
+    chosen->width = width;
+    chosen->height = height;
+    chosen->fps = MIN(best_fps, fps);
+    return 0;
+}
+int setup_camera(
+    const char *device,
+    const int cam_width,
+    const int cam_height,
+    const int cam_fps,
+    CameraFormat *camera_format)
+{
+    // setting up camera settings
+    int cameraHandle = open(device, O_RDWR, 0);
+    if (cameraHandle < 0)
+    {
+        perror(device);
+        return -1;
+    }
+    CameraFormat wanted;
+    if (negotiate_format(cameraHandle, cam_width, cam_height, cam_fps, &wanted) < 0)
+    {
+        printf("No supported format at %dx%d\n", cam_width, cam_height);
+        close(cameraHandle);
+        return -1;
+    }
+    struct v4l2_format format;
+    memset(&format, 0, sizeof(format));
+    format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    format.fmt.pix.width = cam_width;
+    format.fmt.pix.height = cam_height;
+    format.fmt.pix.pixelformat = wanted.pixelformat;
+    format.fmt.pix.field = V4L2_FIELD_ANY;
+    if (ioctl(cameraHandle, VIDIOC_S_FMT, &format) < 0)
+    {
+        printf("VIDIOC_S_FMT Video format set fail\n");
+        close(cameraHandle);
+        return -1;
+    }
+    // the driver may have adjusted any of it
+    const Converter *conv = find_converter(format.fmt.pix.pixelformat);
+    if (conv == NULL || format.fmt.pix.pixelformat != wanted.pixelformat || (int)format.fmt.pix.width != cam_width ||
+        (int)format.fmt.pix.height != cam_height)
+    {
+        printf("Driver gave %.4s %ux%u instead of %.4s %dx%d\n", (char *)&format.fmt.pix.pixelformat,
+               format.fmt.pix.width, format.fmt.pix.height, (char *)&wanted.pixelformat, cam_width, cam_height);
+        close(cameraHandle);
+        return -1;
+    }
+    struct v4l2_streamparm parm;
+    memset(&parm, 0, sizeof(parm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parm.parm.capture.timeperframe.numerator = 1;
+    parm.parm.capture.timeperframe.denominator = (unsigned int)(wanted.fps + 0.5);
+    if (ioctl(cameraHandle, VIDIOC_S_PARM, &parm) == 0 && parm.parm.capture.timeperframe.numerator > 0)
+        wanted.fps = (double)parm.parm.capture.timeperframe.denominator / parm.parm.capture.timeperframe.numerator;
+    wanted.bytesperline = format.fmt.pix.bytesperline;
+    wanted.sizeimage = format.fmt.pix.sizeimage;
+    if (wanted.bytesperline == 0) // compressed formats have no lines
+        wanted.bytesperline = format.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV || format.fmt.pix.pixelformat == V4L2_PIX_FMT_UYVY
+                                  ? cam_width * 2
+                                  : cam_width;
+    wanted.converter = conv;
+    wanted.kernels = select_kernels(wanted.width, wanted.height);
+    *camera_format = wanted;
+    printf("Camera %s set up done! %.4s %dx%d at %.1f fps\n", device, (char *)&wanted.pixelformat,
+           wanted.width, wanted.height, wanted.fps);
+    return cameraHandle;
+}
+int setup_req_buffer(
+    const int cameraHandle,
+    const int memory,
+    const int count)
+{
+    // Setting up buffer structure
+    // requesting buffer
+    struct v4l2_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+    req.count = count;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = memory;
+    if (ioctl(cameraHandle, VIDIOC_REQBUFS, &req) < 0)
+    {
+        printf("VIDIOC_REQBUFS failed!\n");
+        return -1;
+    }
+    return req.count;
+}
+#if USE_SDL
+static int setup_marker()
+{
+    // the ring set_circle draws, on a transparent square
+    int size = 2 * CIRCLE_RADIUS;
+    g_markerTexture = SDL_CreateTexture(g_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, size, size);
+    Pixel *ring = (Pixel *)calloc(size * size, sizeof(Pixel));
+    if (g_markerTexture == NULL || ring == NULL)
+    {
+        free(ring);
+        return -1;
+    }
+    CameraFormat square = {0};
+    square.width = size;
+    square.height = size;
+    int centre = CIRCLE_RADIUS;
+    set_circle(&square, ring, &centre, &centre);
+    SDL_UpdateTexture(g_markerTexture, NULL, ring, size * sizeof(Pixel));
+    SDL_SetTextureBlendMode(g_markerTexture, SDL_BLENDMODE_BLEND);
+    free(ring);
+    return 0;
+}
+int setup_SDL(int width, int height, bool yuy2)
+{
+    // width x height is the frame shown, smaller than the camera's for a scaled preview
+    // init SDL
+    SDL_Init(SDL_INIT_VIDEO);
+    // Create window
+    g_window = SDL_CreateWindow("SDL Window", SDL_WINDOWPOS_CENTERED,
+                                SDL_WINDOWPOS_CENTERED, width, height, SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN);
+    if (g_window == NULL)
+    {
+        printf("G-window error \n");
+        return -1;
+    }
+
+    // Create render window
+    // vsync only paces the render thread, capture never waits for it
+    g_renderer = SDL_CreateRenderer(g_window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    if (g_renderer == NULL)
+    {
+        printf("G-renderer error \n");
+        return -1;
+    }
+    // Create a texture we can stream to
+    // a YUY2 texture takes the camera frame as it is, the renderer converts it
+    g_streamTexture = SDL_CreateTexture(g_renderer, yuy2 ? SDL_PIXELFORMAT_YUY2 : SDL_PIXELFORMAT_ARGB8888,
+                                        SDL_TEXTUREACCESS_STREAMING, width, height);
+    if (g_streamTexture == NULL)
+    {
+        printf("G-streamTexture error \n");
+        return -1;
+    }
+    if (setup_marker() < 0)
+    {
+        printf("G-markerTexture error \n");
+        return -1;
+    }
+    return 0;
+}
+#endif
+int set_up_dubbel_buffers(int cameraHandle, int i, struct v4l2_buffer *buffers)
+{
+    // query the created buffers
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = i;
+    if (ioctl(cameraHandle, VIDIOC_QUERYBUF, &buf) < 0)
+    {
+        printf("VIDIOC_QUERYBUF failed!\n");
+        return -1;
+    }
+    if (!buffers)
+    {
+        printf("Failed to allocate memory for buffer %d\n", i);
+        return -1;
+    }
+
+    *buffers = buf; // Copy buffer information
+    // Map the buffer to memory
+    buffers->m.userptr = 0; // Make sure the user pointer is cleared
+    buffers->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffers->memory = V4L2_MEMORY_MMAP;
+    if (ioctl(cameraHandle, VIDIOC_QBUF, buffers) < 0)
+    {
+        printf("VIDIOC_QBUF failed!\n");
+        return -1;
+    }
+    return 0;
+}
+int export_buffer(int cameraHandle, int index)
+{
+    // the MMAP buffer as a dmabuf fd other processes and devices can import
+    struct v4l2_exportbuffer exp;
+    memset(&exp, 0, sizeof(exp));
+    exp.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    exp.index = index;
+    exp.flags = O_RDONLY | O_CLOEXEC;
+    if (ioctl(cameraHandle, VIDIOC_EXPBUF, &exp) < 0)
+        return -1;
+    return exp.fd;
+}
+int queue_dmabuf(int cameraHandle, int index, int fd, int length)
+{
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_DMABUF;
+    buf.index = index;
+    buf.m.fd = fd;
+    buf.length = length;
+    if (ioctl(cameraHandle, VIDIOC_QBUF, &buf) < 0)
+    {
+        printf("VIDIOC_QBUF (dmabuf) failed!\n");
+        return -1;
+    }
+    return 0;
+}
+void dmabuf_sync(int fd, unsigned long flags)
+{
+    // brackets cpu reads of a dmabuf the device writes into
+    struct dma_buf_sync sync = {flags};
+    ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+int setup_dmabuf_buffers(int cameraHandle, FrameBus *bus, int count, unsigned char **ImageMemory, int *dmabuf_fds)
+{
+    // every frame bus slot becomes a capture buffer, the first DMABUF_QUEUED go to the driver
+    for (int i = 0; i < count; i++)
+    {
+        dmabuf_fds[i] = frame_bus_slot_dmabuf(bus, i);
+        if (dmabuf_fds[i] < 0)
+        {
+            printf("udmabuf for slot %d failed\n", i);
+            return -1;
+        }
+        ImageMemory[i] = frame_bus_slot(bus, i);
+    }
+    for (int i = 0; i < DMABUF_QUEUED; i++)
+    {
+        frame_bus_begin(bus, i);
+        if (queue_dmabuf(cameraHandle, i, dmabuf_fds[i], bus->header->slot_size) < 0)
+            return -1;
+    }
+    return 0;
+}
+// Capture buffer pool
+// USERPTR buffers from one 2 MB hugepage mapping, or transparent hugepages if
+// none are reserved; cached memory the conversion can read at full speed.
+typedef struct BufferPool
+{
+    unsigned char *memory;
+    size_t size;
+    size_t stride; // distance between buffers
+    int count;
+    bool hugetlb; // MAP_HUGETLB mapping, else posix_memalign + MADV_HUGEPAGE
+} BufferPool;
+BufferPool *pool_alloc(int count, size_t buffer_size)
+{
+    BufferPool *pool = (BufferPool *)calloc(1, sizeof(BufferPool));
+    if (pool == NULL)
+        return NULL;
+    pool->count = count;
+    pool->stride = (buffer_size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    pool->size = (pool->stride * count + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+    void *memory = mmap(NULL, pool->size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+    if (memory != MAP_FAILED)
+        pool->hugetlb = true;
+    else if (posix_memalign(&memory, HUGE_PAGE, pool->size) == 0)
+        madvise(memory, pool->size, MADV_HUGEPAGE);
+    else
+    {
+        free(pool);
+        return NULL;
+    }
+    pool->memory = (unsigned char *)memory;
+    memset(pool->memory, 0, pool->size); // fault the pages in now, not during capture
+    return pool;
+}
+unsigned char *pool_buffer(BufferPool *pool, int i)
+{
+    return pool->memory + (size_t)i * pool->stride;
+}
+void pool_free(BufferPool *pool)
+{
+    if (pool->hugetlb)
+        munmap(pool->memory, pool->size);
+    else
+        free(pool->memory);
+    free(pool);
+}
+int queue_userptr(int cameraHandle, int index, unsigned char *memory, int length)
+{
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_USERPTR;
+    buf.index = index;
+    buf.m.userptr = (unsigned long)memory;
+    buf.length = length;
+    if (ioctl(cameraHandle, VIDIOC_QBUF, &buf) < 0)
+    {
+        printf("VIDIOC_QBUF (userptr) failed!\n");
+        return -1;
+    }
+    return 0;
+}
+int setup_userptr_buffers(int cameraHandle, int count, unsigned char **ImageMemory, BufferPool **pool)
+{
+    *pool = pool_alloc(count, g_format.sizeimage);
+    if (*pool == NULL)
+        return -1;
+    printf("USERPTR pool of %d buffers, %s\n", count, (*pool)->hugetlb ? "2 MB hugepages" : "transparent hugepages");
+    for (int i = 0; i < count; i++)
+    {
+        ImageMemory[i] = pool_buffer(*pool, i);
+        if (queue_userptr(cameraHandle, i, ImageMemory[i], (*pool)->stride) < 0)
+            return -1;
+    }
+    return 0;
+}
+// Display
+// SDL runs on a render thread of its own (window, renderer and events all
+// belong to the thread that set them up), so a slow SDL_RenderPresent cannot
+// hold up capture and detection. Frames go over a triple buffered mailbox:
+// capture fills one frame, the render thread shows another and the third is
+// the newest finished one. Publishing replaces a frame that was not shown yet,
+// so it is the display that drops frames, never the detector. Keys come back
+// to the capture loop through a small ring.
+// With --preview the mailbox carries the raw YUYV frame instead, shown through
+// a YUY2 texture with the marker on a small overlay texture, and the frame is
+// only converted when something needs the pixels (detection consumers,
+// recordings, snapshots). --preview=2 and --preview=4 carry a 1/2 or 1/4 size
+// BGRA frame made by preview_yuyv, for displays at the end of a slow link.
+// Headless (--headless, USE_SDL=0 or no display) frames go into an aligned
+// frame from a BufferPool, nothing is shown, and the keys are read from stdin.
+#define MAILBOX_FRESH 4 // on the middle index until the render thread takes it
+typedef struct Renderer
+{
+    BufferPool *frames; // the three mailbox frames
+    int write;          // capture thread only
+    int read;           // render thread only
+    uint32_t middle;    // newest finished frame | MAILBOX_FRESH, futex word
+    int width;
+    int height;
+    int pitch;          // bytes per frame row, the camera's bytesperline for YUYV
+    bool yuy2;          // frames are camera YUYV, not BGRA
+    int scale;          // frames are 1/scale of the camera frame
+    int marker_x[3];    // laser position drawn over each frame, -1 for none
+    int marker_y[3];
+    int shown;
+    int dropped; // frames replaced before they were shown
+    int keys[RENDER_KEYS];
+    uint32_t key_head; // render thread writes
+    uint32_t key_tail; // capture thread reads
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t started;
+    int state; // 0 starting, 1 running, -1 SDL failed
+    bool quit;
+} Renderer;
+#if USE_SDL
+void DisplayImg(Renderer *r, int frame)
+{
+    SDL_UpdateTexture(g_streamTexture, NULL, pool_buffer(r->frames, frame), r->pitch);
+    SDL_RenderCopy(g_renderer, g_streamTexture, NULL, NULL); // Kommer från lab ins
+    if (r->marker_x[frame] >= 0)
     {
-        // FORWARD
-        return 3;
+        // the position is in camera pixels
+        SDL_Rect ring = {(r->marker_x[frame] - CIRCLE_RADIUS) / r->scale, (r->marker_y[frame] - CIRCLE_RADIUS) / r->scale,
+                         2 * CIRCLE_RADIUS / r->scale, 2 * CIRCLE_RADIUS / r->scale};
+        SDL_RenderCopy(g_renderer, g_markerTexture, NULL, &ring);
     }
+    SDL_RenderPresent(g_renderer); // lab inst
 }
-void set_circle(Pixel *rgbConversion, int *pos_x, int *pos_y)
+static void render_push_key(Renderer *r, int key)
 {
-    int k = CAM_HEIGHT / 2;
-    int h = CAM_WIDTH / 2;
-
-    for (int y = 0; y < CAM_HEIGHT; y++)
+    uint32_t head = r->key_head;
+    if (head - __atomic_load_n(&r->key_tail, __ATOMIC_ACQUIRE) == RENDER_KEYS)
+        return; // capture is not reading keys
+    r->keys[head % RENDER_KEYS] = key;
+    __atomic_store_n(&r->key_head, head + 1, __ATOMIC_RELEASE);
+}
+static void *render_thread(void *arg)
+{
+    Renderer *r = (Renderer *)arg;
+    int state = setup_SDL(r->width, r->height, r->yuy2) < 0 ? -1 : 1;
+    pthread_mutex_lock(&r->lock);
+    r->state = state;
+    pthread_cond_signal(&r->started);
+    pthread_mutex_unlock(&r->lock);
+    if (state < 0)
+    {
+        SDL_Quit();
+        return NULL;
+    }
+    while (!__atomic_load_n(&r->quit, __ATOMIC_ACQUIRE))
     {
-        for (int x = 0; x < CAM_WIDTH; x++)
+        SDL_Event event;
+        while (SDL_PollEvent(&event))
         {
-            double r = sqrt(pow(x - *pos_x, 2) + pow(y - *pos_y, 2));
-            if (r < CIRCLE_RADIUS && r > CIRCLE_RADIUS - CIRCLE_WIDTH)
-            {
-                int px = (y) * (CAM_WIDTH) + (x);
-                rgbConversion[px].R = 0;
-                rgbConversion[px].G = 0;
-                rgbConversion[px].B = 255;
-                rgbConversion[px].A = 255;
-            }
+            if (event.type == SDL_QUIT)
+                render_push_key(r, KEY_ESCAPE);
+            else if (event.type == SDL_KEYDOWN && event.key.keysym.sym < 128)
+                render_push_key(r, event.key.keysym.sym);
         }
+        uint32_t middle = __atomic_load_n(&r->middle, __ATOMIC_ACQUIRE);
+        if (!(middle & MAILBOX_FRESH))
+        {
+            // nothing new, sleep until capture publishes (or look at the events again)
+            struct timespec timeout = {0, 20 * 1000000L};
+            frame_bus_futex(&r->middle, FUTEX_WAIT_PRIVATE, middle, &timeout);
+            continue;
+        }
+        r->read = __atomic_exchange_n(&r->middle, r->read, __ATOMIC_ACQ_REL) & ~MAILBOX_FRESH;
+        DisplayImg(r, r->read);
+        r->shown++;
     }
+    SDL_DestroyWindow(g_window);
+    SDL_Quit();
+    return NULL;
 }
-void PrintImageData(double ProcessImage_timer, int last_dic)
+Renderer *render_open(int width, int height, int stride, int scale, bool yuy2)
 {
-    switch (last_dic)
+    // NULL when there is no display to open a window on; stride is the camera
+    // frame's bytesperline, YUY2 frames are kept with their padding
+    Renderer *r = (Renderer *)calloc(1, sizeof(Renderer));
+    if (r == NULL)
+        return NULL;
+    r->width = width / scale;
+    r->height = height / scale;
+    r->pitch = yuy2 ? stride : r->width * (int)sizeof(Pixel);
+    r->frames = pool_alloc(3, (size_t)r->pitch * r->height);
+    if (r->frames == NULL)
     {
-    case 0:
-        printf("Thread Time avg: %.2f ms and direction back \n",
-               ProcessImage_timer);
-        break;
-    case 1:
-        printf("Thread Time avg: %.2f ms and direction left \n",
-               ProcessImage_timer);
-        break;
-    case 2:
-        printf("Thread Time avg: %.2f ms and direction right \n",
-               ProcessImage_timer);
-        break;
-    case 3:
-        printf("Thread Time avg: %.2f ms and direction forward \n",
-               ProcessImage_timer);
-        break;
-    default:
-        printf("Thread Time avg: %.2f ms and direction not deteced\n",
-               ProcessImage_timer);
+        free(r);
+        return NULL;
+    }
+    r->yuy2 = yuy2;
+    r->scale = scale;
+    r->write = 0;
+    r->middle = 1;
+    r->read = 2;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->started, NULL);
+    pthread_create(&r->thread, NULL, render_thread, r);
+    pthread_mutex_lock(&r->lock);
+    while (r->state == 0)
+        pthread_cond_wait(&r->started, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+    if (r->state < 0)
+    {
+        pthread_join(r->thread, NULL);
+        pool_free(r->frames);
+        free(r);
+        return NULL;
     }
+    return r;
 }
-void DisplayImg()
+Pixel *render_frame(Renderer *r)
 {
-    SDL_UnlockTexture(g_streamTexture);                      // lab inst
-    SDL_RenderCopy(g_renderer, g_streamTexture, NULL, NULL); // Kommer från lab ins
-    SDL_RenderPresent(g_renderer);                           // lab inst
+    // the frame capture fills next, only capture touches it
+    return (Pixel *)pool_buffer(r->frames, r->write);
 }
-int ProcessImage(const unsigned char *_yuv, int _size, Pixel *rgbConversion)
+void render_publish(Renderer *r, int marker_x, int marker_y)
 {
-    // printf("Processing image! \n");
-    // Multi threading setting
-    ImageParts parts[IMG_THREADS]; // array to store parts using our local struct
-    // split image into parts
-    int part_size = _size / IMG_THREADS;
-    for (int i = 0; i < IMG_THREADS; i++)
+    r->marker_x[r->write] = marker_x;
+    r->marker_y[r->write] = marker_y;
+    uint32_t old = __atomic_exchange_n(&r->middle, r->write | MAILBOX_FRESH, __ATOMIC_ACQ_REL);
+    if (old & MAILBOX_FRESH)
+        r->dropped++; // the render thread never saw it
+    r->write = old & ~MAILBOX_FRESH;
+    frame_bus_futex(&r->middle, FUTEX_WAKE_PRIVATE, 1, NULL);
+}
+void render_close(Renderer *r)
+{
+    __atomic_store_n(&r->quit, true, __ATOMIC_RELEASE);
+    frame_bus_futex(&r->middle, FUTEX_WAKE_PRIVATE, 1, NULL);
+    pthread_join(r->thread, NULL);
+    printf("Displayed %d frames, %d dropped by the display\n", r->shown, r->dropped);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->started);
+    pool_free(r->frames);
+    free(r);
+}
+#endif
+int next_key(Renderer *render)
+{
+    // next key pressed since the last call, -1 when there is none
+    if (render != NULL)
     {
-        parts[i].start = part_size * i;
-        parts[i].end = (i + 1) * part_size - 1;
-        parts[i].rgb_index = part_size * i / 2;
+        uint32_t tail = render->key_tail;
+        if (tail == __atomic_load_n(&render->key_head, __ATOMIC_ACQUIRE))
+            return -1;
+        int key = render->keys[tail % RENDER_KEYS];
+        __atomic_store_n(&render->key_tail, tail + 1, __ATOMIC_RELEASE);
+        return key;
     }
-    // printf("Starting multithread of image\n");
-
-#pragma omp parallel num_threads(IMG_THREADS)
+    struct pollfd in = {STDIN_FILENO, POLLIN, 0};
+    unsigned char key;
+    while (poll(&in, 1, 0) == 1 && (in.revents & POLLIN) && read(STDIN_FILENO, &key, 1) == 1)
     {
-        // Get ID of the current thread:
-        int id = omp_get_thread_num();
-        ImageParts part = parts[id];
-        // printf("This is the part from %d [start:%d, end:%d and rgbindex: %d]\n",id, part.start, part.end, part.rgb_index);
-        for (int i = part.start; i < part.end; i += 4)
-        {
-            unsigned char y1 = _yuv[i + 0];
-            unsigned char u = _yuv[i + 1];
-            unsigned char y2 = _yuv[i + 2];
-            unsigned char v = _yuv[i + 3];
-            YUYVtoRGB(y1, u, v, &rgbConversion[part.rgb_index++]);
-            YUYVtoRGB(y2, u, v, &rgbConversion[part.rgb_index++]);
-        }
+        if (key == 'q')
+            return KEY_ESCAPE;
+        if (key != '\n')
+            return key;
     }
-
-    // Find circle and set circle
-    int pos_x = -1;
-    int pos_y = -1;
-    int brightest_red = 0;
-    find_laser(rgbConversion, &pos_x, &pos_y, &brightest_red);
-    int last_dic = direction(pos_x, pos_y);
-    if (pos_x == -1 || pos_y == -1)
-        return last_dic;
-    set_circle(rgbConversion, &pos_x, &pos_y);
-    return last_dic;
+    return -1;
 }
-int setup_camera(
-    const int cam_width,
-    const int cam_height,
-    const int cam_format)
+void benchmark_conversion(const unsigned char *capture, int size, const char *capture_type)
 {
-    // setting up camera settings
-    int cameraHandle = open(VIDEO_FILE_PATH, O_RDWR, 0);
-    struct v4l2_format format;
-    memset(&format, 0, sizeof(format));
-    format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    format.fmt.pix.width = cam_width;
-    format.fmt.pix.height = cam_height;
-    format.fmt.pix.pixelformat = cam_format;
-    format.fmt.pix.field = V4L2_FIELD_ANY;
-    if (ioctl(cameraHandle, VIDIOC_S_FMT, &format) < 0)
+    // conversion to RGBA throughput reading from the capture buffer and from cached copies of it
+    Pixel *rgb = (Pixel *)malloc(g_format.width * g_format.height * sizeof(Pixel));
+    unsigned char *heap = (unsigned char *)malloc(size);
+    BufferPool *pool = pool_alloc(1, size);
+    if (rgb == NULL || heap == NULL || pool == NULL)
     {
-        printf("VIDIOC_S_FMT Video format set fail\n");
-        return -1;
+        printf("Benchmark allocation failed\n");
+        free(rgb);
+        free(heap);
+        if (pool != NULL)
+            pool_free(pool);
+        return;
     }
-    printf("Camera Set up done!\n");
-    return cameraHandle;
+    memcpy(heap, capture, size);
+    memcpy(pool_buffer(pool, 0), capture, size);
+    const unsigned char *sources[3] = {capture, heap, pool_buffer(pool, 0)};
+    const char *names[3] = {capture_type, "malloc", pool->hugetlb ? "hugetlb pool" : "THP pool"};
+    for (int s = 0; s < 3; s++)
+    {
+        ConvertImage(&g_format, sources[s], size, rgb); // warm up
+        double t0 = omp_get_wtime();
+        for (int i = 0; i < BENCHMARK_RUNS; i++)
+            ConvertImage(&g_format, sources[s], size, rgb);
+        double t = omp_get_wtime() - t0;
+        printf("Conversion from %-14s %7.2f ms/frame %8.1f MB/s\n", names[s],
+               t * 1000 / BENCHMARK_RUNS, size * (double)BENCHMARK_RUNS / t / 1e6);
+    }
+    free(rgb);
+    free(heap);
+    pool_free(pool);
 }
-int setup_req_buffer(
-    const int cameraHandle)
+// Multi-camera capture
+// "./lab2 /dev/video0 /dev/video2 ..." gives every device its own capture
+// context: format, MMAP buffers, an aligned frame to convert into and a worker
+// thread that waits on it and processes its frames. The workers split the
+// IMG_THREADS OpenMP threads between them, so cameras are processed side by
+// side without oversubscribing the cores. There is no window; results go to the
+// detection socket with the camera's index, the main thread only reports. It
+// can be tried without hardware on the vivid driver:
+//   modprobe vivid n_devs=2 node_types=0x1,0x1
+typedef struct Camera
 {
-    // Setting up buffer structure
-    // requesting buffer
-    struct v4l2_requestbuffers req;
-    memset(&req, 0, sizeof(req));
-    req.count = 2;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
-    if (ioctl(cameraHandle, VIDIOC_REQBUFS, &req) < 0)
+    const char *device;
+    int index; // position on the command line, DetectionResult.camera
+    int handle;
+    CameraFormat format;
+    int buffer_count;
+    unsigned char *memory[VIDEO_MAX_FRAME];
+    size_t length[VIDEO_MAX_FRAME];
+    Pixel *rgb;
+    Detector *detector;
+    // worker
+    pthread_t thread;
+    int threads; // OpenMP team size
+    bool failed;
+    DetectionChannel *detection;
+    pthread_mutex_t *publish_lock; // the detection channel is shared by all workers
+    bool started;
+    uint32_t next_sequence;
+    // since the last report, under lock
+    pthread_mutex_t lock;
+    DetectionResult last;
+    int frames;
+    int dropped; // sequence numbers the driver skipped
+    int timed;   // frames with a CLOCK_MONOTONIC timestamp, the only ones latency is known for
+    double latency_sum;
+    double latency_max;
+} Camera;
+void camera_close(Camera *cam)
+{
+    if (cam->handle >= 0)
     {
-        printf("VIDIOC_REQBUFS failed!\n");
-        return -1;
+        enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        ioctl(cam->handle, VIDIOC_STREAMOFF, &type);
     }
-    return req.count;
+    for (int i = 0; i < cam->buffer_count; i++)
+        if (cam->memory[i] != NULL)
+            munmap(cam->memory[i], cam->length[i]);
+    if (cam->handle >= 0)
+        close(cam->handle);
+    free(cam->rgb);
+    if (cam->detector != NULL)
+        detector_close(cam->detector);
+    pthread_mutex_destroy(&cam->lock);
+    cam->handle = -1;
+    cam->buffer_count = 0;
+    cam->rgb = NULL;
+    cam->detector = NULL;
 }
-int setup_SDL()
+int camera_open(Camera *cam, const char *device, int index, int width, int height, bool all_spots, bool background)
 {
-    // init SDL
-    SDL_Init(SDL_INIT_VIDEO);
-    // Create window
-    g_window = SDL_CreateWindow("SDL Window", SDL_WINDOWPOS_CENTERED,
-                                SDL_WINDOWPOS_CENTERED, CAM_WIDTH, CAM_HEIGHT, SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN);
-    if (g_window == NULL)
+    memset(cam, 0, sizeof(*cam));
+    cam->device = device;
+    cam->index = index;
+    pthread_mutex_init(&cam->lock, NULL);
+    cam->handle = setup_camera(device, width, height, CAM_FPS, &cam->format);
+    if (cam->handle < 0)
+        return -1;
+    int count = setup_req_buffer(cam->handle, V4L2_MEMORY_MMAP, MULTI_CAM_BUFFERS);
+    if (count < 0)
+        return -1;
+    for (int i = 0; i < count; i++)
     {
-        printf("G-window error \n");
+        struct v4l2_buffer buf;
+        if (set_up_dubbel_buffers(cam->handle, i, &buf) < 0)
+            return -1;
+        cam->memory[i] = (unsigned char *)mmap(NULL, buf.length, PROT_READ, MAP_SHARED, cam->handle, buf.m.offset);
+        if (cam->memory[i] == MAP_FAILED)
+        {
+            cam->memory[i] = NULL;
+            perror("camera mmap");
+            return -1;
+        }
+        cam->length[i] = buf.length;
+        cam->buffer_count = i + 1;
+    }
+    if (posix_memalign((void **)&cam->rgb, POOL_ALIGN, (size_t)cam->format.width * cam->format.height * sizeof(Pixel)) != 0)
+    {
+        cam->rgb = NULL;
+        printf("Frame allocation failed for %s\n", device);
         return -1;
     }
-
-    // Create render window
-    g_renderer = SDL_CreateRenderer(g_window, -1, SDL_RENDERER_ACCELERATED);
-    if (g_renderer == NULL)
+    cam->detector = detector_open(&cam->format, all_spots, background);
+    if (cam->detector == NULL)
     {
-        printf("G-renderer error \n");
+        printf("Detector allocation failed for %s\n", device);
         return -1;
     }
-    // Create a texture we can stream to
-    g_streamTexture = SDL_CreateTexture(g_renderer, SDL_PIXELFORMAT_ARGB8888,
-                                        SDL_TEXTUREACCESS_STREAMING, CAM_WIDTH, CAM_HEIGHT);
-    if (g_streamTexture == NULL)
+    // the worker polls with a timeout so it notices when capture stops
+    fcntl(cam->handle, F_SETFL, fcntl(cam->handle, F_GETFL) | O_NONBLOCK);
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (ioctl(cam->handle, VIDIOC_STREAMON, &type) < 0)
     {
-        printf("G-streamTexture error \n");
+        printf("VIDIOC_STREAMON failed on %s\n", device);
         return -1;
     }
     return 0;
 }
-int set_up_dubbel_buffers(int cameraHandle, int i, struct v4l2_buffer *buffers)
+int camera_frame(Camera *cam)
 {
-    // query the created buffers
+    // one frame from a camera poll() reported ready; 0 if there was none after all
     struct v4l2_buffer buf;
     memset(&buf, 0, sizeof(buf));
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     buf.memory = V4L2_MEMORY_MMAP;
-    buf.index = i;
-    if (ioctl(cameraHandle, VIDIOC_QUERYBUF, &buf) < 0)
+    if (ioctl(cam->handle, VIDIOC_DQBUF, &buf) < 0)
+        return errno == EAGAIN ? 0 : -1;
+    DetectionResult result;
+    memset(&result, 0, sizeof(result));
+    ProcessImage(&cam->format, cam->memory[buf.index], buf.bytesused, cam->rgb, cam->detector, &result, true);
+    // time since the frame was taken, only when the driver stamps with CLOCK_MONOTONIC
+    bool monotonic = (buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    double latency = 0;
+    if (monotonic)
     {
-        printf("VIDIOC_QUERYBUF failed!\n");
-        return -1;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        latency = (now.tv_sec - buf.timestamp.tv_sec) + (now.tv_nsec / 1000 - buf.timestamp.tv_usec) * 1e-6;
     }
-    if (!buffers)
+    result.version = DETECTION_VERSION;
+    result.sequence = buf.sequence;
+    result.timestamp_ns = buf.timestamp.tv_sec * 1000000000ull + buf.timestamp.tv_usec * 1000ull;
+    result.camera = cam->index;
+
+    pthread_mutex_lock(&cam->lock);
+    if (cam->started && buf.sequence != cam->next_sequence)
+        cam->dropped += buf.sequence - cam->next_sequence;
+    cam->started = true;
+    cam->next_sequence = buf.sequence + 1;
+    cam->frames++;
+    if (monotonic)
     {
-        printf("Failed to allocate memory for buffer %d\n", i);
-        return -1;
+        cam->timed++;
+        cam->latency_sum += latency;
+        cam->latency_max = MAX(cam->latency_max, latency);
     }
+    cam->last = result;
+    pthread_mutex_unlock(&cam->lock);
 
-    *buffers = buf; // Copy buffer information
-    // Map the buffer to memory
-    buffers->m.userptr = 0; // Make sure the user pointer is cleared
-    buffers->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buffers->memory = V4L2_MEMORY_MMAP;
-    if (ioctl(cameraHandle, VIDIOC_QBUF, buffers) < 0)
+    if (cam->detection != NULL)
     {
-        printf("VIDIOC_QBUF failed!\n");
+        pthread_mutex_lock(cam->publish_lock);
+        detection_publish(cam->detection, &result);
+        pthread_mutex_unlock(cam->publish_lock);
+    }
+    if (ioctl(cam->handle, VIDIOC_QBUF, &buf) < 0)
         return -1;
+    return 1;
+}
+void camera_report(Camera *cameras, int count, double elapsed)
+{
+    for (int i = 0; i < count; i++)
+    {
+        Camera *cam = &cameras[i];
+        pthread_mutex_lock(&cam->lock);
+        if (cam->timed > 0)
+            printf("%-12s %5.1f fps %4d dropped latency avg %6.2f ms max %6.2f ms direction %d\n", cam->device,
+                   cam->frames / elapsed, cam->dropped, cam->latency_sum / cam->timed * 1000, cam->latency_max * 1000,
+                   cam->last.direction);
+        else
+            printf("%-12s %5.1f fps %4d dropped latency unknown (no monotonic timestamps) direction %d\n",
+                   cam->device, cam->frames / elapsed, cam->dropped, cam->last.direction);
+        cam->frames = 0;
+        cam->dropped = 0;
+        cam->timed = 0;
+        cam->latency_sum = 0;
+        cam->latency_max = 0;
+        pthread_mutex_unlock(&cam->lock);
     }
-    return 0;
 }
-int main()
+static volatile sig_atomic_t g_stop = 0; // ctrl-c when there is no window to close
+static void stop_capture(int sig)
+{
+    (void)sig;
+    g_stop = 1;
+}
+static void *camera_thread(void *arg)
+{
+    // one per camera, a failure stops all of them
+    Camera *cam = (Camera *)arg;
+    img_threads = cam->threads;
+    struct pollfd fd = {cam->handle, POLLIN, 0};
+    while (!g_stop)
+    {
+        int ready = poll(&fd, 1, CAMERA_POLL_MS);
+        if (ready < 0 && errno != EINTR)
+        {
+            perror("poll");
+            cam->failed = true;
+        }
+        else if (ready > 0 && (fd.revents & (POLLIN | POLLERR)) && camera_frame(cam) < 0)
+        {
+            printf("Capture failed on %s\n", cam->device);
+            cam->failed = true;
+        }
+        if (cam->failed)
+            g_stop = 1;
+    }
+    return NULL;
+}
+int run_cameras(const char **devices, int count, int width, int height, bool all_spots, bool background)
+{
+    Camera cameras[MAX_CAMERAS];
+    int opened = 0;
+    int started = 0;
+    int status = 0;
+    while (opened < count)
+    {
+        Camera *cam = &cameras[opened++];
+        if (camera_open(cam, devices[opened - 1], opened - 1, width, height, all_spots, background) < 0)
+        {
+            status = -1;
+            break;
+        }
+    }
+    DetectionChannel *detection = status == 0 ? detection_open(DETECTION_SOCKET) : NULL;
+    pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+    signal(SIGINT, stop_capture);
+    for (int i = 0; i < count && status == 0; i++)
+    {
+        cameras[i].threads = MAX(1, IMG_THREADS / count);
+        cameras[i].detection = detection;
+        cameras[i].publish_lock = &publish_lock;
+        if (pthread_create(&cameras[i].thread, NULL, camera_thread, &cameras[i]) != 0)
+        {
+            printf("No capture thread for %s\n", cameras[i].device);
+            status = -1;
+            g_stop = 1;
+            break;
+        }
+        started++;
+    }
+    double last_report = omp_get_wtime();
+    while (status == 0 && !g_stop)
+    {
+        struct timespec nap = {0, CAMERA_POLL_MS * 1000000L};
+        nanosleep(&nap, NULL);
+        double now = omp_get_wtime();
+        if (now - last_report >= CAMERA_REPORT_SECONDS)
+        {
+            camera_report(cameras, count, now - last_report);
+            last_report = now;
+        }
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(cameras[i].thread, NULL);
+        if (cameras[i].failed)
+            status = -1;
+    }
+    if (detection != NULL)
+        detection_close(detection, DETECTION_SOCKET);
+    for (int i = 0; i < opened; i++)
+        camera_close(&cameras[i]);
+    return status;
+}
+int main(int argc, char **argv)
 {
-    int cameraHandle = setup_camera(CAM_WIDTH, CAM_HEIGHT, CAM_FORMAT);
+    // ./lab2 [--headless] [--preview[=2|4]] [--spots] [--background] [--pretrigger] [--frame-bus] [WIDTHxHEIGHT]
+    // [device...], without a size the cameras are asked for CAM_WIDTH x CAM_HEIGHT, more than one device runs
+    // multi-camera capture, which is always headless and takes neither a preview, the pre-trigger nor the frame bus
+    int width = CAM_WIDTH;
+    int height = CAM_HEIGHT;
+    const char *devices[MAX_CAMERAS];
+    int device_count = 0;
+    bool headless = !USE_SDL;
+    bool preview = false;
+    int preview_scale = 1;
+    bool all_spots = false;
+    bool background = false;
+    bool use_pretrigger = false;
+    bool use_frame_bus = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--headless") == 0)
+        {
+            headless = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--spots") == 0)
+        {
+            all_spots = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--background") == 0)
+        {
+            background = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--pretrigger") == 0)
+        {
+            use_pretrigger = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--frame-bus") == 0)
+        {
+            use_frame_bus = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--preview") == 0)
+        {
+            preview = true;
+            continue;
+        }
+        int scale = 0;
+        if (sscanf(argv[i], "--preview=%d", &scale) == 1 && (scale == 2 || scale == 4))
+        {
+            preview = true;
+            preview_scale = scale;
+            continue;
+        }
+        bool size = sscanf(argv[i], "%dx%d", &width, &height) == 2;
+        if (size && width > 0 && height > 0 && width % 2 == 0)
+            continue;
+        if (size || scale != 0 || device_count == MAX_CAMERAS)
+        {
+            device_count = -1;
+            break;
+        }
+        devices[device_count++] = argv[i];
+    }
+    if (device_count < 0 || (device_count > 1 && (preview || use_pretrigger || use_frame_bus)))
+    {
+        printf("Usage: %s [--headless] [--preview[=2|4]] [--spots] [--background] [--pretrigger] [--frame-bus] [WIDTHxHEIGHT] [device...] (at most %d devices, several devices only with --headless, --spots and --background)\n",
+               argv[0], MAX_CAMERAS);
+        return -1;
+    }
+    if (device_count == 0)
+        devices[device_count++] = VIDEO_FILE_PATH;
+    stbi_write_jpg_restart_rows = JPG_RESTART_ROWS;
+    if (device_count > 1)
+        return run_cameras(devices, device_count, width, height, all_spots, background) == 0 ? 0 : -1;
+    int cameraHandle = setup_camera(devices[0], width, height, CAM_FPS, &g_format);
     if (cameraHandle < 0)
     {
         printf("Camera failed to start\n");
         return -1;
     }
-    int request_buffers_count = setup_req_buffer(cameraHandle);
+    FrameBus *frame_bus = use_frame_bus ? frame_bus_open(FRAME_BUS_SOCKET) : NULL;
+    // DMABUF capture writes into the frame bus slots and needs one buffer per slot
+    int memory = CAM_MEMORY;
+    if (memory == V4L2_MEMORY_DMABUF && frame_bus == NULL)
+    {
+        printf("DMABUF capture needs the frame bus, using MMAP\n");
+        memory = V4L2_MEMORY_MMAP;
+    }
+    int request_buffers_count = setup_req_buffer(cameraHandle, memory,
+                                                 memory == V4L2_MEMORY_DMABUF ? FRAME_BUS_SLOTS : CAM_BUFFERS);
+    if (memory == V4L2_MEMORY_USERPTR && request_buffers_count < 0)
+    {
+        printf("USERPTR capture refused, using MMAP\n");
+        memory = V4L2_MEMORY_MMAP;
+        request_buffers_count = setup_req_buffer(cameraHandle, memory, CAM_BUFFERS);
+    }
+    if (memory == V4L2_MEMORY_DMABUF && request_buffers_count != FRAME_BUS_SLOTS)
+    {
+        printf("DMABUF capture unavailable, using MMAP\n");
+        if (request_buffers_count > 0)
+            setup_req_buffer(cameraHandle, memory, 0);
+        memory = V4L2_MEMORY_MMAP;
+        request_buffers_count = setup_req_buffer(cameraHandle, memory, CAM_BUFFERS);
+    }
     if (request_buffers_count == -1)
     {
         return -1;
     }
-    struct v4l2_buffer *buffers[2];
-    for (int i = 0; i < request_buffers_count; i++)
+    // sized for any count the driver may hand out, also after a fallback
+    struct v4l2_buffer **buffers = (struct v4l2_buffer **)calloc(VIDEO_MAX_FRAME, sizeof(struct v4l2_buffer *));
+    unsigned char **ImageMemory = (unsigned char **)malloc(sizeof(unsigned char *) * VIDEO_MAX_FRAME);
+    int *dmabuf_fds = (int *)malloc(sizeof(int) * VIDEO_MAX_FRAME);
+    BufferPool *pool = NULL;
+    for (int i = 0; i < VIDEO_MAX_FRAME; i++)
+        dmabuf_fds[i] = -1;
+    if (memory == V4L2_MEMORY_USERPTR && setup_userptr_buffers(cameraHandle, request_buffers_count, ImageMemory, &pool) < 0)
     {
-        buffers[i] = (struct v4l2_buffer *)malloc(sizeof(struct v4l2_buffer)); // Allocate memory for buffer
-        int buffers_set_up = set_up_dubbel_buffers(cameraHandle, i, buffers[i]);
-        if (buffers_set_up < 0)
+        printf("USERPTR capture refused, using MMAP\n");
+        if (pool != NULL)
+            pool_free(pool);
+        pool = NULL;
+        setup_req_buffer(cameraHandle, memory, 0);
+        memory = V4L2_MEMORY_MMAP;
+        request_buffers_count = setup_req_buffer(cameraHandle, memory, CAM_BUFFERS);
+        if (request_buffers_count == -1)
         {
-            printf("Setup buffer failed!\n");
             return -1;
         }
     }
-    // Image memory
-    unsigned char **ImageMemory = (unsigned char **)malloc(sizeof(unsigned char *) *
-                                                           request_buffers_count);
-    for (int i = 0; i < request_buffers_count; i++)
+    if (memory == V4L2_MEMORY_DMABUF)
     {
-        ImageMemory[i] = (unsigned char *)mmap(NULL, buffers[i]->length, PROT_READ,
-                                               MAP_SHARED, cameraHandle, buffers[i]->m.offset); // Fix me free mmap
-        if (ImageMemory[i] == NULL)
+        if (setup_dmabuf_buffers(cameraHandle, frame_bus, request_buffers_count, ImageMemory, dmabuf_fds) < 0)
         {
-            printf("Image memory allocation failed!\n");
+            printf("Setup buffer failed!\n");
             return -1;
         }
     }
+    else if (memory == V4L2_MEMORY_MMAP)
+    {
+        for (int i = 0; i < request_buffers_count; i++)
+        {
+            buffers[i] = (struct v4l2_buffer *)malloc(sizeof(struct v4l2_buffer)); // Allocate memory for buffer
+            int buffers_set_up = set_up_dubbel_buffers(cameraHandle, i, buffers[i]);
+            if (buffers_set_up < 0)
+            {
+                printf("Setup buffer failed!\n");
+                return -1;
+            }
+        }
+        // Image memory
+        int exported = 0;
+        for (int i = 0; i < request_buffers_count; i++)
+        {
+            ImageMemory[i] = (unsigned char *)mmap(NULL, buffers[i]->length, PROT_READ,
+                                                   MAP_SHARED, cameraHandle, buffers[i]->m.offset); // Fix me free mmap
+            if (ImageMemory[i] == NULL)
+            {
+                printf("Image memory allocation failed!\n");
+                return -1;
+            }
+            dmabuf_fds[i] = export_buffer(cameraHandle, i); // -1 if the driver can't export
+            exported += dmabuf_fds[i] >= 0;
+        }
+        if (frame_bus != NULL && exported == request_buffers_count)
+            frame_bus_set_capture_dmabufs(frame_bus, dmabuf_fds, request_buffers_count);
+    }
+    if (frame_bus != NULL && frame_bus_seal(frame_bus) < 0)
+        printf("Frame bus readers are refused, its slots could not be made read-only\n");
 
     // Setup for streaming
     enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -347,71 +3440,246 @@ int main()
         printf("VIDIOC_STREAMON failed!\n");
         return -1;
     }
+    // the raw frame features store the camera's own YUYV bytes
+    bool raw_yuyv = g_format.pixelformat == V4L2_PIX_FMT_YUYV;
+    if (preview && !raw_yuyv)
+    {
+        printf("The preview needs YUYV capture\n");
+        preview = false;
+    }
+    Renderer *render = NULL;
+#if USE_SDL
     // Setup SDL
-    int SDL_state = setup_SDL();
-    if (SDL_state < 0)
+    if (!headless && (render = render_open(g_format.width, g_format.height, g_format.bytesperline,
+                                           preview ? preview_scale : 1, preview && preview_scale == 1)) == NULL)
+    {
+        printf("Setup SDL failed, running headless\n");
+        headless = true;
+    }
+#else
+    (void)preview_scale; // nothing to preview on
+#endif
+    preview = preview && render != NULL;
+    BufferPool *frame_pool = NULL;
+    if (headless || preview)
     {
-        printf("Setup SDL failed\n");
+        // the converted frame is not what is shown
+        frame_pool = pool_alloc(1, (size_t)g_format.width * g_format.height * sizeof(Pixel));
+        if (frame_pool == NULL)
+        {
+            printf("Frame allocation failed\n");
+            return -1;
+        }
+    }
+    Detector *detector = detector_open(&g_format, all_spots, background);
+    if (detector == NULL)
+    {
+        printf("Detector allocation failed\n");
         return -1;
     }
+    if (headless)
+    {
+        signal(SIGINT, stop_capture);
+        printf("Headless, keys are read from stdin (q quits)\n");
+    }
     printf("starting stream \n");
     bool quit = false;
-    SDL_Event event;
+    bool save_jpg = false;
+    bool save_png = false;
+    Recorder *recorder = NULL;
+    Y4MWriter *y4m_raw = NULL;
+    Y4MWriter *y4m_overlay = NULL;
+    if (use_pretrigger && !raw_yuyv)
+        printf("The pre-trigger needs YUYV capture\n");
+    PreTrigger *pretrigger = use_pretrigger && raw_yuyv ? pretrigger_open() : NULL;
+    DetectionChannel *detection = detection_open(DETECTION_SOCKET);
     // START STREAMING
-    while (!quit)
+    while (!quit && !g_stop)
     {
         // CAPTURE IMAGE
         struct v4l2_buffer buf;
         memset(&buf, 0, sizeof(buf));
         buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
+        buf.memory = memory;
         if (ioctl(cameraHandle, VIDIOC_DQBUF, &buf) < 0)
         {
             return errno;
         }
-        void *pixels;
-        int pitch;
-        SDL_LockTexture(g_streamTexture, NULL, &pixels, &pitch);
-        Pixel *rgbConversion = (Pixel *)pixels;
+        double timestamp = buf.timestamp.tv_sec + buf.timestamp.tv_usec * 1e-6;
+        if (memory == V4L2_MEMORY_DMABUF)
+        {
+            // the frame is already in its frame bus slot
+            dmabuf_sync(dmabuf_fds[buf.index], DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+            frame_bus_accept(frame_bus);
+            frame_bus_commit(frame_bus, buf.index, buf.bytesused, timestamp, -1);
+        }
+        else if (frame_bus != NULL)
+        {
+            frame_bus_accept(frame_bus);
+            if (frame_bus_readers(frame_bus) > 0)
+                frame_bus_publish(frame_bus, ImageMemory[buf.index], buf.bytesused, timestamp, buf.index);
+        }
+#if USE_SDL
+        Pixel *rgbConversion = frame_pool != NULL ? (Pixel *)pool_buffer(frame_pool, 0) : render_frame(render);
+#else
+        Pixel *rgbConversion = (Pixel *)pool_buffer(frame_pool, 0);
+#endif
+        // the preview is made from the camera frame, so it is only converted for
+        // what needs the pixels; detection runs on every frame either way
+        bool convert = !preview || recorder != NULL || y4m_overlay != NULL || save_png;
         double t0 = omp_get_wtime();
-        int last_dic = ProcessImage(ImageMemory[buf.index], buf.bytesused, rgbConversion);
+        DetectionResult result;
+        memset(&result, 0, sizeof(result));
+        int last_dic = ProcessImage(&g_format, ImageMemory[buf.index], buf.bytesused, rgbConversion, detector, &result,
+                                    convert);
         double ProcessImage_timer = (omp_get_wtime() - t0) * 1000;
-        DisplayImg();
+        if (detection != NULL)
+        {
+            result.version = DETECTION_VERSION;
+            result.sequence = buf.sequence;
+            result.timestamp_ns = buf.timestamp.tv_sec * 1000000000ull + buf.timestamp.tv_usec * 1000ull;
+            detection_publish(detection, &result);
+        }
+        if (recorder != NULL)
+            rec_push(recorder, rgbConversion);
+        if (y4m_overlay != NULL)
+            y4m_write_bgra(y4m_overlay, rgbConversion);
+#if USE_SDL
+        if (preview)
+        {
+            if (preview_scale == 1)
+                memcpy(render_frame(render), ImageMemory[buf.index], (size_t)g_format.bytesperline * g_format.height);
+            else
+                preview_yuyv(&g_format, ImageMemory[buf.index], preview_scale, render_frame(render));
+            render_publish(render, result.pos_x, result.pos_y);
+        }
+        else if (!headless)
+            render_publish(render, -1, -1); // rgbConversion stays ours until the next render_frame
+#endif
         PrintImageData(ProcessImage_timer, last_dic);
-        if (ioctl(cameraHandle, VIDIOC_QBUF, &buf) < 0)
+        if (save_png)
+        {
+            if (save_snapshot(FILE_NAME, rgbConversion) == 0)
+                printf("Photo saved as test.png\n");
+            save_png = false;
+        }
+        if (save_jpg)
+        {
+            // Encoded straight from the camera buffer, before it goes back to the driver
+            UringWriter *file = uring_open(JPG_FILE_NAME, false);
+            if (file != NULL)
+            {
+                int saved = stbi_write_jpg_yuyv_to_func(uring_write, file, g_format.width, g_format.height, ImageMemory[buf.index],
+                                                        g_format.bytesperline, JPG_QUALITY, JPG_SUBSAMPLE);
+                if (uring_close(file) == 0 && saved)
+                    printf("Photo saved as test.jpg\n");
+            }
+            save_jpg = false;
+        }
+        if (y4m_raw != NULL)
+            y4m_write_yuyv(y4m_raw, ImageMemory[buf.index]);
+        if (pretrigger != NULL)
+        {
+            double now = omp_get_wtime();
+            pretrigger_push(pretrigger, ImageMemory[buf.index], now);
+            pretrigger_direction(pretrigger, last_dic, now);
+        }
+        if (memory == V4L2_MEMORY_DMABUF)
+        {
+            // requeue ahead in ring order, this frame stays readable on the bus
+            dmabuf_sync(dmabuf_fds[buf.index], DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+            int next = (buf.index + DMABUF_QUEUED) % request_buffers_count;
+            frame_bus_begin(frame_bus, next);
+            if (queue_dmabuf(cameraHandle, next, dmabuf_fds[next], frame_bus->header->slot_size) < 0)
+            {
+                return -1;
+            }
+        }
+        else if (ioctl(cameraHandle, VIDIOC_QBUF, &buf) < 0)
         {
             return -1;
         }
-        while (SDL_PollEvent(&event))
+        for (int key = next_key(render); key >= 0; key = next_key(render))
         {
-            if (event.type == SDL_KEYDOWN)
+            if (key == KEY_ESCAPE)
+            {
+                quit = true;
+            }
+            if (key == 'c')
+            {
+                save_png = true; // next frame, with markers
+                if (pretrigger != NULL)
+                    pretrigger_fire(pretrigger, omp_get_wtime());
+            }
+            if (key == 'b')
             {
-                if (event.key.keysym.sym == SDLK_ESCAPE)
+                benchmark_conversion(ImageMemory[buf.index], buf.bytesused, memory == V4L2_MEMORY_USERPTR ? "USERPTR pool"
+                                                             : memory == V4L2_MEMORY_DMABUF ? "DMABUF slot"
+                                                                                             : "MMAP buffer");
+            }
+            if (key == 'j')
+            {
+                save_jpg = raw_yuyv; // raw camera frame, without markers
+                if (!raw_yuyv)
+                    printf("JPEG snapshots need YUYV capture\n");
+            }
+            if (key == 'y')
+            {
+                if (!raw_yuyv)
+                    printf("Raw recording needs YUYV capture\n");
+                else if (y4m_raw == NULL)
+                    y4m_raw = y4m_open(Y4M_RAW_FILE_NAME, true);
+                else
+                {
+                    y4m_close(y4m_raw, Y4M_RAW_FILE_NAME);
+                    y4m_raw = NULL;
+                }
+            }
+            if (key == 'v')
+            {
+                if (y4m_overlay == NULL)
+                    y4m_overlay = y4m_open(Y4M_OVERLAY_FILE_NAME, false);
+                else
                 {
-                    quit = true;
+                    y4m_close(y4m_overlay, Y4M_OVERLAY_FILE_NAME);
+                    y4m_overlay = NULL;
                 }
-                if (event.key.keysym.sym == SDLK_c)
+            }
+            if (key == 'r')
+            {
+                if (recorder == NULL)
+                {
+                    recorder = rec_open(REC_FILE_NAME);
+                    if (recorder != NULL)
+                        printf("Recording to %s\n", REC_FILE_NAME);
+                }
+                else
                 {
-                    Pixel *capture_pixels = malloc(CAM_WIDTH * CAM_HEIGHT *
-                                                   sizeof(Pixel));
-                    memcpy(capture_pixels, rgbConversion, CAM_WIDTH * CAM_HEIGHT * sizeof(Pixel));
-                    for (int i = 0; i < CAM_HEIGHT * CAM_WIDTH; i++)
-                    {
-                        int r = capture_pixels[i].B;
-                        int b = capture_pixels[i].R;
-                        capture_pixels[i].R = r;
-                        capture_pixels[i].B = b;
-                    }
-                    printf("Photo saved as test.png\n");
-                    stbi_write_png(FILE_NAME, CAM_WIDTH, CAM_HEIGHT,
-                                   CHANNEL_NUM, capture_pixels, CAM_WIDTH * CHANNEL_NUM);
+                    rec_close(recorder);
+                    recorder = NULL;
                 }
             }
         }
     }
+    if (recorder != NULL)
+        rec_close(recorder);
+    if (y4m_raw != NULL)
+        y4m_close(y4m_raw, Y4M_RAW_FILE_NAME);
+    if (y4m_overlay != NULL)
+        y4m_close(y4m_overlay, Y4M_OVERLAY_FILE_NAME);
+    if (pretrigger != NULL)
+        pretrigger_close(pretrigger);
+    if (frame_bus != NULL)
+        frame_bus_close(frame_bus, FRAME_BUS_SOCKET);
+    if (detection != NULL)
+        detection_close(detection, DETECTION_SOCKET);
     // Free up used space
     for (int i = 0; i < request_buffers_count; i++)
     {
+        if (dmabuf_fds[i] >= 0)
+            close(dmabuf_fds[i]);
+        if (memory != V4L2_MEMORY_MMAP)
+            continue; // slots belong to the frame bus or the pool
         if (munmap(ImageMemory[i], buffers[i]->length) < 0)
         {
             perror("munmap failed");
@@ -422,10 +3690,20 @@ int main()
     {
         free(buffers[i]);
     }
+    free(buffers);
+    free(dmabuf_fds);
+    if (pool != NULL)
+        pool_free(pool);
     free(ImageMemory);
-    printf("closing window \n");
-    // closeing SDL window down
-    SDL_DestroyWindow(g_window);
-    SDL_Quit();
+    if (frame_pool != NULL)
+        pool_free(frame_pool);
+    detector_close(detector);
+#if USE_SDL
+    if (!headless)
+    {
+        printf("closing window \n");
+        render_close(render);
+    }
+#endif
     close(cameraHandle);
 }
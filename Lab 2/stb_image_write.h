@@ -31,6 +31,10 @@ BUILDING:
    unsigned char * my_compress(unsigned char *data, int data_len, int *out_len, int quality);
    The returned data will be freed with STBIW_FREE() (free() by default),
    so it must be heap allocated with STBIW_MALLOC() (malloc() by default),
+   On x86 with GCC/clang the PNG CRC-32 and Adler-32 checksums use PCLMULQDQ
+   and SSSE3 when cpuid reports them, otherwise a portable slice-by-8 CRC.
+   The JPEG DCT and quantization likewise use an SSSE3 fixed point path.
+   You can #define STBIW_NO_SIMD to compile only the portable versions.
 
 UNICODE:
 
@@ -68,8 +72,25 @@ USAGE:
       int stbi_write_tga_with_rle;             // defaults to true; set to 0 to disable RLE
       int stbi_write_png_compression_level;    // defaults to 8; set to higher for more compression
       int stbi_write_force_png_filter;         // defaults to -1; set to 0..5 to force a filter mode
+      int stbi_write_jpg_restart_rows;         // defaults to 0; set to N for a JPEG restart marker every N MCU rows
 
 
+   PNG can also be written one row at a time, so the whole image never has to
+   be in memory (not available with STBIW_ZLIB_COMPRESS):
+
+     stbi_png_stream *stbi_write_png_stream_begin(stbi_write_func *func, void *context, int w, int h, int comp);
+     int stbi_write_png_stream_row(stbi_png_stream *ps, const void *row);
+     int stbi_write_png_stream_end(stbi_png_stream *ps);
+
+   Rows are passed top to bottom and copied, so 'row' may be reused as soon as
+   the call returns. IDAT chunks of STBIW_PNG_STREAM_IDAT bytes are emitted
+   through 'func' as compressed data accumulates. end() writes the trailer and
+   frees the stream; it must be called even after an error. The stream
+   ignores stbi_flip_vertically_on_write and never falls back to stored blocks.
+   The result is a valid PNG that decodes to the same pixels as stbi_write_png,
+   but it is not byte-identical: matches are only searched in the last 64K of
+   input and the data is split over several IDAT chunks.
+
    You can define STBI_WRITE_NO_STDIO to disable the file variant of these
    functions, so the library will not use stdio.h at all. However, this will
    also disable HDR writing, because it requires stdio for formatted output.
@@ -110,6 +131,20 @@ USAGE:
    Higher quality looks better but results in a bigger image.
    JPEG baseline (no JPEG progressive).
 
+   JPEG can also be written straight from packed YCbCr 4:2:2 (YUYV) camera
+   frames, skipping the RGB conversion on both sides:
+
+     int stbi_write_jpg_yuyv(char const *filename, int w, int h, const void *data, int stride_in_bytes, int quality, int subsample);
+     int stbi_write_jpg_yuyv_to_func(stbi_write_func *func, void *context, int w, int h, const void *data, int stride_in_bytes, int quality, int subsample);
+
+   subsample=0 keeps the 4:2:2 chroma, subsample=1 writes 4:2:0. A stride of 0
+   means w*2 bytes.
+
+   With stbi_write_jpg_restart_rows set, JPEG output gets DRI/RSTn restart
+   markers every that many MCU rows (an MCU row is 8 or 16 pixel rows). The
+   intervals are independent, so when the including file is compiled with
+   OpenMP they are entropy coded in parallel and then concatenated.
+
 CREDITS:
 
 
@@ -170,6 +205,7 @@ LICENSE
 STBIWDEF int stbi_write_tga_with_rle;
 STBIWDEF int stbi_write_png_compression_level;
 STBIWDEF int stbi_write_force_png_filter;
+STBIWDEF int stbi_write_jpg_restart_rows;
 #endif
 
 #ifndef STBI_WRITE_NO_STDIO
@@ -178,6 +214,7 @@ STBIWDEF int stbi_write_bmp(char const *filename, int w, int h, int comp, const
 STBIWDEF int stbi_write_tga(char const *filename, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_hdr(char const *filename, int w, int h, int comp, const float *data);
 STBIWDEF int stbi_write_jpg(char const *filename, int x, int y, int comp, const void  *data, int quality);
+STBIWDEF int stbi_write_jpg_yuyv(char const *filename, int w, int h, const void *data, int stride_in_bytes, int quality, int subsample);
 
 #ifdef STBIW_WINDOWS_UTF8
 STBIWDEF int stbiw_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const wchar_t* input);
@@ -191,9 +228,18 @@ STBIWDEF int stbi_write_bmp_to_func(stbi_write_func *func, void *context, int w,
 STBIWDEF int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const float *data);
 STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void  *data, int quality);
+STBIWDEF int stbi_write_jpg_yuyv_to_func(stbi_write_func *func, void *context, int w, int h, const void *data, int stride_in_bytes, int quality, int subsample);
 
 STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
+#ifndef STBIW_ZLIB_COMPRESS
+typedef struct stbi_png_stream stbi_png_stream;
+
+STBIWDEF stbi_png_stream *stbi_write_png_stream_begin(stbi_write_func *func, void *context, int w, int h, int comp);
+STBIWDEF int stbi_write_png_stream_row(stbi_png_stream *ps, const void *row);
+STBIWDEF int stbi_write_png_stream_end(stbi_png_stream *ps);
+#endif
+
 #endif//INCLUDE_STB_IMAGE_WRITE_H
 
 #ifdef STB_IMAGE_WRITE_IMPLEMENTATION
@@ -247,14 +293,52 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
 #define STBIW_UCHAR(x) (unsigned char) ((x) & 0xff)
 
+// x86 SIMD paths are compiled with per-function target attributes and chosen
+// at runtime from cpuid, so the baseline build flags don't have to change
+#if !defined(STBIW_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STBIW__X86_SIMD
+#include <cpuid.h>
+#include <immintrin.h>
+
+static int stbiw__cpuid_ecx(void)
+{
+   unsigned int a, b, c, d;
+   if (!__get_cpuid(1, &a, &b, &c, &d))
+      return 0;
+   return (int) c;
+}
+
+// the checksums ask once per PNG row, so cpuid only runs on the first call;
+// racing threads all store the same 0 or 1. Setting one to 0 beforehand forces
+// the scalar code (the tests do this)
+static int stbiw__has_pclmul = -1;
+static int stbiw__has_ssse3 = -1;
+
+static int stbiw__cpu_has_pclmul(void)
+{
+   if (stbiw__has_pclmul < 0)
+      stbiw__has_pclmul = (stbiw__cpuid_ecx() & bit_PCLMUL) != 0;
+   return stbiw__has_pclmul;
+}
+
+static int stbiw__cpu_has_ssse3(void)
+{
+   if (stbiw__has_ssse3 < 0)
+      stbiw__has_ssse3 = (stbiw__cpuid_ecx() & bit_SSSE3) != 0;
+   return stbiw__has_ssse3;
+}
+#endif
+
 #ifdef STB_IMAGE_WRITE_STATIC
 static int stbi_write_png_compression_level = 8;
 static int stbi_write_tga_with_rle = 1;
 static int stbi_write_force_png_filter = -1;
+static int stbi_write_jpg_restart_rows = 0;
 #else
 int stbi_write_png_compression_level = 8;
 int stbi_write_tga_with_rle = 1;
 int stbi_write_force_png_filter = -1;
+int stbi_write_jpg_restart_rows = 0;
 #endif
 
 static int stbi__flip_vertically_on_write = 0;
@@ -270,6 +354,7 @@ typedef struct
    void *context;
    unsigned char buffer[64];
    int buf_used;
+   int simd;      // SIMD paths detected for this call (JPEG only)
 } stbi__write_context;
 
 // initialize a callback-based context
@@ -890,6 +975,85 @@ static unsigned int stbiw__zhash(unsigned char *data)
 
 #define stbiw__ZHASH   16384
 
+// adler32 sums can be deferred this many bytes before s2 overflows 32 bits
+#define stbiw__ADLER_NMAX  5552
+#define stbiw__ADLER_BASE  65521
+
+static void stbiw__adler32_scalar(unsigned int *s1p, unsigned int *s2p, unsigned char *data, int data_len)
+{
+   unsigned int s1 = *s1p, s2 = *s2p;
+   int i, j = 0;
+   int blocklen = (int) (data_len % stbiw__ADLER_NMAX);
+   while (j < data_len) {
+      for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
+      s1 %= stbiw__ADLER_BASE; s2 %= stbiw__ADLER_BASE;
+      j += blocklen;
+      blocklen = stbiw__ADLER_NMAX;
+   }
+   *s1p = s1;
+   *s2p = s2;
+}
+
+#ifdef STBIW__X86_SIMD
+// 32 bytes per step: psadbw gives the byte sums for s1, pmaddubsw weights
+// each byte by its distance to the end of the step for s2
+__attribute__((target("ssse3")))
+static int stbiw__adler32_ssse3(unsigned int *s1p, unsigned int *s2p, unsigned char *data, int data_len)
+{
+   const __m128i tap1 = _mm_setr_epi8(32,31,30,29,28,27,26,25,24,23,22,21,20,19,18,17);
+   const __m128i tap2 = _mm_setr_epi8(16,15,14,13,12,11,10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i ones = _mm_set1_epi16(1);
+   unsigned int s1 = *s1p, s2 = *s2p;
+   int blocks = data_len / 32;
+
+   while (blocks) {
+      int n = blocks < stbiw__ADLER_NMAX/32 ? blocks : stbiw__ADLER_NMAX/32;
+      __m128i v_ps = _mm_set_epi32(0, 0, 0, (int) (s1 * n));
+      __m128i v_s2 = _mm_set_epi32(0, 0, 0, (int) s2);
+      __m128i v_s1 = zero;
+      blocks -= n;
+      do {
+         __m128i b1 = _mm_loadu_si128((const __m128i *) data);
+         __m128i b2 = _mm_loadu_si128((const __m128i *) (data + 16));
+         v_ps = _mm_add_epi32(v_ps, v_s1);
+         v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(b1, zero));
+         v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(b1, tap1), ones));
+         v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(b2, zero));
+         v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(b2, tap2), ones));
+         data += 32;
+      } while (--n);
+      v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+      v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1,0,3,2)));
+      s1 += (unsigned int) _mm_cvtsi128_si32(v_s1);
+      v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2,3,0,1)));
+      v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1,0,3,2)));
+      s2 = (unsigned int) _mm_cvtsi128_si32(v_s2);
+      s1 %= stbiw__ADLER_BASE;
+      s2 %= stbiw__ADLER_BASE;
+   }
+   *s1p = s1;
+   *s2p = s2;
+   return data_len & ~31;
+}
+#endif
+
+// pass 1 as the initial adler to start a new stream
+static unsigned int stbiw__adler32(unsigned int adler, unsigned char *data, int data_len)
+{
+   unsigned int s1 = adler & 0xffff, s2 = adler >> 16;
+#ifdef STBIW__X86_SIMD
+   if (data_len >= 32 && stbiw__cpu_has_ssse3()) {
+      int done = stbiw__adler32_ssse3(&s1, &s2, data, data_len);
+      data += done;
+      data_len -= done;
+   }
+#endif
+   stbiw__adler32_scalar(&s1, &s2, data, data_len);
+   return (s2 << 16) | s1;
+}
+
 #endif // STBIW_ZLIB_COMPRESS
 
 STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
@@ -1000,19 +1164,11 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
 
    {
       // compute adler32 on input
-      unsigned int s1=1, s2=0;
-      int blocklen = (int) (data_len % 5552);
-      j=0;
-      while (j < data_len) {
-         for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
-         s1 %= 65521; s2 %= 65521;
-         j += blocklen;
-         blocklen = 5552;
-      }
-      stbiw__sbpush(out, STBIW_UCHAR(s2 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s2));
-      stbiw__sbpush(out, STBIW_UCHAR(s1 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s1));
+      unsigned int adler = stbiw__adler32(1, data, data_len);
+      stbiw__sbpush(out, STBIW_UCHAR(adler >> 24));
+      stbiw__sbpush(out, STBIW_UCHAR(adler >> 16));
+      stbiw__sbpush(out, STBIW_UCHAR(adler >> 8));
+      stbiw__sbpush(out, STBIW_UCHAR(adler));
    }
    *out_len = stbiw__sbn(out);
    // make returned pointer freeable
@@ -1021,15 +1177,14 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
 #endif // STBIW_ZLIB_COMPRESS
 }
 
-static unsigned int stbiw__crc32(unsigned char *buffer, int len)
+#ifndef STBIW_CRC32
+// stbiw__crc_table[k][n] is the crc of byte n followed by k zero bytes, which
+// lets the portable path consume 8 bytes per step ("slice-by-8")
+static const unsigned int stbiw__crc_table[8][256] =
 {
-#ifdef STBIW_CRC32
-    return STBIW_CRC32(buffer, len);
-#else
-   static unsigned int crc_table[256] =
    {
       0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
-      0x0eDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
+      0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
       0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
       0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
       0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
@@ -1060,13 +1215,357 @@ static unsigned int stbiw__crc32(unsigned char *buffer, int len)
       0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
       0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
       0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
-   };
+   },
+   {
+      0x00000000, 0x191B3141, 0x32366282, 0x2B2D53C3, 0x646CC504, 0x7D77F445, 0x565AA786, 0x4F4196C7,
+      0xC8D98A08, 0xD1C2BB49, 0xFAEFE88A, 0xE3F4D9CB, 0xACB54F0C, 0xB5AE7E4D, 0x9E832D8E, 0x87981CCF,
+      0x4AC21251, 0x53D92310, 0x78F470D3, 0x61EF4192, 0x2EAED755, 0x37B5E614, 0x1C98B5D7, 0x05838496,
+      0x821B9859, 0x9B00A918, 0xB02DFADB, 0xA936CB9A, 0xE6775D5D, 0xFF6C6C1C, 0xD4413FDF, 0xCD5A0E9E,
+      0x958424A2, 0x8C9F15E3, 0xA7B24620, 0xBEA97761, 0xF1E8E1A6, 0xE8F3D0E7, 0xC3DE8324, 0xDAC5B265,
+      0x5D5DAEAA, 0x44469FEB, 0x6F6BCC28, 0x7670FD69, 0x39316BAE, 0x202A5AEF, 0x0B07092C, 0x121C386D,
+      0xDF4636F3, 0xC65D07B2, 0xED705471, 0xF46B6530, 0xBB2AF3F7, 0xA231C2B6, 0x891C9175, 0x9007A034,
+      0x179FBCFB, 0x0E848DBA, 0x25A9DE79, 0x3CB2EF38, 0x73F379FF, 0x6AE848BE, 0x41C51B7D, 0x58DE2A3C,
+      0xF0794F05, 0xE9627E44, 0xC24F2D87, 0xDB541CC6, 0x94158A01, 0x8D0EBB40, 0xA623E883, 0xBF38D9C2,
+      0x38A0C50D, 0x21BBF44C, 0x0A96A78F, 0x138D96CE, 0x5CCC0009, 0x45D73148, 0x6EFA628B, 0x77E153CA,
+      0xBABB5D54, 0xA3A06C15, 0x888D3FD6, 0x91960E97, 0xDED79850, 0xC7CCA911, 0xECE1FAD2, 0xF5FACB93,
+      0x7262D75C, 0x6B79E61D, 0x4054B5DE, 0x594F849F, 0x160E1258, 0x0F152319, 0x243870DA, 0x3D23419B,
+      0x65FD6BA7, 0x7CE65AE6, 0x57CB0925, 0x4ED03864, 0x0191AEA3, 0x188A9FE2, 0x33A7CC21, 0x2ABCFD60,
+      0xAD24E1AF, 0xB43FD0EE, 0x9F12832D, 0x8609B26C, 0xC94824AB, 0xD05315EA, 0xFB7E4629, 0xE2657768,
+      0x2F3F79F6, 0x362448B7, 0x1D091B74, 0x04122A35, 0x4B53BCF2, 0x52488DB3, 0x7965DE70, 0x607EEF31,
+      0xE7E6F3FE, 0xFEFDC2BF, 0xD5D0917C, 0xCCCBA03D, 0x838A36FA, 0x9A9107BB, 0xB1BC5478, 0xA8A76539,
+      0x3B83984B, 0x2298A90A, 0x09B5FAC9, 0x10AECB88, 0x5FEF5D4F, 0x46F46C0E, 0x6DD93FCD, 0x74C20E8C,
+      0xF35A1243, 0xEA412302, 0xC16C70C1, 0xD8774180, 0x9736D747, 0x8E2DE606, 0xA500B5C5, 0xBC1B8484,
+      0x71418A1A, 0x685ABB5B, 0x4377E898, 0x5A6CD9D9, 0x152D4F1E, 0x0C367E5F, 0x271B2D9C, 0x3E001CDD,
+      0xB9980012, 0xA0833153, 0x8BAE6290, 0x92B553D1, 0xDDF4C516, 0xC4EFF457, 0xEFC2A794, 0xF6D996D5,
+      0xAE07BCE9, 0xB71C8DA8, 0x9C31DE6B, 0x852AEF2A, 0xCA6B79ED, 0xD37048AC, 0xF85D1B6F, 0xE1462A2E,
+      0x66DE36E1, 0x7FC507A0, 0x54E85463, 0x4DF36522, 0x02B2F3E5, 0x1BA9C2A4, 0x30849167, 0x299FA026,
+      0xE4C5AEB8, 0xFDDE9FF9, 0xD6F3CC3A, 0xCFE8FD7B, 0x80A96BBC, 0x99B25AFD, 0xB29F093E, 0xAB84387F,
+      0x2C1C24B0, 0x350715F1, 0x1E2A4632, 0x07317773, 0x4870E1B4, 0x516BD0F5, 0x7A468336, 0x635DB277,
+      0xCBFAD74E, 0xD2E1E60F, 0xF9CCB5CC, 0xE0D7848D, 0xAF96124A, 0xB68D230B, 0x9DA070C8, 0x84BB4189,
+      0x03235D46, 0x1A386C07, 0x31153FC4, 0x280E0E85, 0x674F9842, 0x7E54A903, 0x5579FAC0, 0x4C62CB81,
+      0x8138C51F, 0x9823F45E, 0xB30EA79D, 0xAA1596DC, 0xE554001B, 0xFC4F315A, 0xD7626299, 0xCE7953D8,
+      0x49E14F17, 0x50FA7E56, 0x7BD72D95, 0x62CC1CD4, 0x2D8D8A13, 0x3496BB52, 0x1FBBE891, 0x06A0D9D0,
+      0x5E7EF3EC, 0x4765C2AD, 0x6C48916E, 0x7553A02F, 0x3A1236E8, 0x230907A9, 0x0824546A, 0x113F652B,
+      0x96A779E4, 0x8FBC48A5, 0xA4911B66, 0xBD8A2A27, 0xF2CBBCE0, 0xEBD08DA1, 0xC0FDDE62, 0xD9E6EF23,
+      0x14BCE1BD, 0x0DA7D0FC, 0x268A833F, 0x3F91B27E, 0x70D024B9, 0x69CB15F8, 0x42E6463B, 0x5BFD777A,
+      0xDC656BB5, 0xC57E5AF4, 0xEE530937, 0xF7483876, 0xB809AEB1, 0xA1129FF0, 0x8A3FCC33, 0x9324FD72
+   },
+   {
+      0x00000000, 0x01C26A37, 0x0384D46E, 0x0246BE59, 0x0709A8DC, 0x06CBC2EB, 0x048D7CB2, 0x054F1685,
+      0x0E1351B8, 0x0FD13B8F, 0x0D9785D6, 0x0C55EFE1, 0x091AF964, 0x08D89353, 0x0A9E2D0A, 0x0B5C473D,
+      0x1C26A370, 0x1DE4C947, 0x1FA2771E, 0x1E601D29, 0x1B2F0BAC, 0x1AED619B, 0x18ABDFC2, 0x1969B5F5,
+      0x1235F2C8, 0x13F798FF, 0x11B126A6, 0x10734C91, 0x153C5A14, 0x14FE3023, 0x16B88E7A, 0x177AE44D,
+      0x384D46E0, 0x398F2CD7, 0x3BC9928E, 0x3A0BF8B9, 0x3F44EE3C, 0x3E86840B, 0x3CC03A52, 0x3D025065,
+      0x365E1758, 0x379C7D6F, 0x35DAC336, 0x3418A901, 0x3157BF84, 0x3095D5B3, 0x32D36BEA, 0x331101DD,
+      0x246BE590, 0x25A98FA7, 0x27EF31FE, 0x262D5BC9, 0x23624D4C, 0x22A0277B, 0x20E69922, 0x2124F315,
+      0x2A78B428, 0x2BBADE1F, 0x29FC6046, 0x283E0A71, 0x2D711CF4, 0x2CB376C3, 0x2EF5C89A, 0x2F37A2AD,
+      0x709A8DC0, 0x7158E7F7, 0x731E59AE, 0x72DC3399, 0x7793251C, 0x76514F2B, 0x7417F172, 0x75D59B45,
+      0x7E89DC78, 0x7F4BB64F, 0x7D0D0816, 0x7CCF6221, 0x798074A4, 0x78421E93, 0x7A04A0CA, 0x7BC6CAFD,
+      0x6CBC2EB0, 0x6D7E4487, 0x6F38FADE, 0x6EFA90E9, 0x6BB5866C, 0x6A77EC5B, 0x68315202, 0x69F33835,
+      0x62AF7F08, 0x636D153F, 0x612BAB66, 0x60E9C151, 0x65A6D7D4, 0x6464BDE3, 0x662203BA, 0x67E0698D,
+      0x48D7CB20, 0x4915A117, 0x4B531F4E, 0x4A917579, 0x4FDE63FC, 0x4E1C09CB, 0x4C5AB792, 0x4D98DDA5,
+      0x46C49A98, 0x4706F0AF, 0x45404EF6, 0x448224C1, 0x41CD3244, 0x400F5873, 0x4249E62A, 0x438B8C1D,
+      0x54F16850, 0x55330267, 0x5775BC3E, 0x56B7D609, 0x53F8C08C, 0x523AAABB, 0x507C14E2, 0x51BE7ED5,
+      0x5AE239E8, 0x5B2053DF, 0x5966ED86, 0x58A487B1, 0x5DEB9134, 0x5C29FB03, 0x5E6F455A, 0x5FAD2F6D,
+      0xE1351B80, 0xE0F771B7, 0xE2B1CFEE, 0xE373A5D9, 0xE63CB35C, 0xE7FED96B, 0xE5B86732, 0xE47A0D05,
+      0xEF264A38, 0xEEE4200F, 0xECA29E56, 0xED60F461, 0xE82FE2E4, 0xE9ED88D3, 0xEBAB368A, 0xEA695CBD,
+      0xFD13B8F0, 0xFCD1D2C7, 0xFE976C9E, 0xFF5506A9, 0xFA1A102C, 0xFBD87A1B, 0xF99EC442, 0xF85CAE75,
+      0xF300E948, 0xF2C2837F, 0xF0843D26, 0xF1465711, 0xF4094194, 0xF5CB2BA3, 0xF78D95FA, 0xF64FFFCD,
+      0xD9785D60, 0xD8BA3757, 0xDAFC890E, 0xDB3EE339, 0xDE71F5BC, 0xDFB39F8B, 0xDDF521D2, 0xDC374BE5,
+      0xD76B0CD8, 0xD6A966EF, 0xD4EFD8B6, 0xD52DB281, 0xD062A404, 0xD1A0CE33, 0xD3E6706A, 0xD2241A5D,
+      0xC55EFE10, 0xC49C9427, 0xC6DA2A7E, 0xC7184049, 0xC25756CC, 0xC3953CFB, 0xC1D382A2, 0xC011E895,
+      0xCB4DAFA8, 0xCA8FC59F, 0xC8C97BC6, 0xC90B11F1, 0xCC440774, 0xCD866D43, 0xCFC0D31A, 0xCE02B92D,
+      0x91AF9640, 0x906DFC77, 0x922B422E, 0x93E92819, 0x96A63E9C, 0x976454AB, 0x9522EAF2, 0x94E080C5,
+      0x9FBCC7F8, 0x9E7EADCF, 0x9C381396, 0x9DFA79A1, 0x98B56F24, 0x99770513, 0x9B31BB4A, 0x9AF3D17D,
+      0x8D893530, 0x8C4B5F07, 0x8E0DE15E, 0x8FCF8B69, 0x8A809DEC, 0x8B42F7DB, 0x89044982, 0x88C623B5,
+      0x839A6488, 0x82580EBF, 0x801EB0E6, 0x81DCDAD1, 0x8493CC54, 0x8551A663, 0x8717183A, 0x86D5720D,
+      0xA9E2D0A0, 0xA820BA97, 0xAA6604CE, 0xABA46EF9, 0xAEEB787C, 0xAF29124B, 0xAD6FAC12, 0xACADC625,
+      0xA7F18118, 0xA633EB2F, 0xA4755576, 0xA5B73F41, 0xA0F829C4, 0xA13A43F3, 0xA37CFDAA, 0xA2BE979D,
+      0xB5C473D0, 0xB40619E7, 0xB640A7BE, 0xB782CD89, 0xB2CDDB0C, 0xB30FB13B, 0xB1490F62, 0xB08B6555,
+      0xBBD72268, 0xBA15485F, 0xB853F606, 0xB9919C31, 0xBCDE8AB4, 0xBD1CE083, 0xBF5A5EDA, 0xBE9834ED
+   },
+   {
+      0x00000000, 0xB8BC6765, 0xAA09C88B, 0x12B5AFEE, 0x8F629757, 0x37DEF032, 0x256B5FDC, 0x9DD738B9,
+      0xC5B428EF, 0x7D084F8A, 0x6FBDE064, 0xD7018701, 0x4AD6BFB8, 0xF26AD8DD, 0xE0DF7733, 0x58631056,
+      0x5019579F, 0xE8A530FA, 0xFA109F14, 0x42ACF871, 0xDF7BC0C8, 0x67C7A7AD, 0x75720843, 0xCDCE6F26,
+      0x95AD7F70, 0x2D111815, 0x3FA4B7FB, 0x8718D09E, 0x1ACFE827, 0xA2738F42, 0xB0C620AC, 0x087A47C9,
+      0xA032AF3E, 0x188EC85B, 0x0A3B67B5, 0xB28700D0, 0x2F503869, 0x97EC5F0C, 0x8559F0E2, 0x3DE59787,
+      0x658687D1, 0xDD3AE0B4, 0xCF8F4F5A, 0x7733283F, 0xEAE41086, 0x525877E3, 0x40EDD80D, 0xF851BF68,
+      0xF02BF8A1, 0x48979FC4, 0x5A22302A, 0xE29E574F, 0x7F496FF6, 0xC7F50893, 0xD540A77D, 0x6DFCC018,
+      0x359FD04E, 0x8D23B72B, 0x9F9618C5, 0x272A7FA0, 0xBAFD4719, 0x0241207C, 0x10F48F92, 0xA848E8F7,
+      0x9B14583D, 0x23A83F58, 0x311D90B6, 0x89A1F7D3, 0x1476CF6A, 0xACCAA80F, 0xBE7F07E1, 0x06C36084,
+      0x5EA070D2, 0xE61C17B7, 0xF4A9B859, 0x4C15DF3C, 0xD1C2E785, 0x697E80E0, 0x7BCB2F0E, 0xC377486B,
+      0xCB0D0FA2, 0x73B168C7, 0x6104C729, 0xD9B8A04C, 0x446F98F5, 0xFCD3FF90, 0xEE66507E, 0x56DA371B,
+      0x0EB9274D, 0xB6054028, 0xA4B0EFC6, 0x1C0C88A3, 0x81DBB01A, 0x3967D77F, 0x2BD27891, 0x936E1FF4,
+      0x3B26F703, 0x839A9066, 0x912F3F88, 0x299358ED, 0xB4446054, 0x0CF80731, 0x1E4DA8DF, 0xA6F1CFBA,
+      0xFE92DFEC, 0x462EB889, 0x549B1767, 0xEC277002, 0x71F048BB, 0xC94C2FDE, 0xDBF98030, 0x6345E755,
+      0x6B3FA09C, 0xD383C7F9, 0xC1366817, 0x798A0F72, 0xE45D37CB, 0x5CE150AE, 0x4E54FF40, 0xF6E89825,
+      0xAE8B8873, 0x1637EF16, 0x048240F8, 0xBC3E279D, 0x21E91F24, 0x99557841, 0x8BE0D7AF, 0x335CB0CA,
+      0xED59B63B, 0x55E5D15E, 0x47507EB0, 0xFFEC19D5, 0x623B216C, 0xDA874609, 0xC832E9E7, 0x708E8E82,
+      0x28ED9ED4, 0x9051F9B1, 0x82E4565F, 0x3A58313A, 0xA78F0983, 0x1F336EE6, 0x0D86C108, 0xB53AA66D,
+      0xBD40E1A4, 0x05FC86C1, 0x1749292F, 0xAFF54E4A, 0x322276F3, 0x8A9E1196, 0x982BBE78, 0x2097D91D,
+      0x78F4C94B, 0xC048AE2E, 0xD2FD01C0, 0x6A4166A5, 0xF7965E1C, 0x4F2A3979, 0x5D9F9697, 0xE523F1F2,
+      0x4D6B1905, 0xF5D77E60, 0xE762D18E, 0x5FDEB6EB, 0xC2098E52, 0x7AB5E937, 0x680046D9, 0xD0BC21BC,
+      0x88DF31EA, 0x3063568F, 0x22D6F961, 0x9A6A9E04, 0x07BDA6BD, 0xBF01C1D8, 0xADB46E36, 0x15080953,
+      0x1D724E9A, 0xA5CE29FF, 0xB77B8611, 0x0FC7E174, 0x9210D9CD, 0x2AACBEA8, 0x38191146, 0x80A57623,
+      0xD8C66675, 0x607A0110, 0x72CFAEFE, 0xCA73C99B, 0x57A4F122, 0xEF189647, 0xFDAD39A9, 0x45115ECC,
+      0x764DEE06, 0xCEF18963, 0xDC44268D, 0x64F841E8, 0xF92F7951, 0x41931E34, 0x5326B1DA, 0xEB9AD6BF,
+      0xB3F9C6E9, 0x0B45A18C, 0x19F00E62, 0xA14C6907, 0x3C9B51BE, 0x842736DB, 0x96929935, 0x2E2EFE50,
+      0x2654B999, 0x9EE8DEFC, 0x8C5D7112, 0x34E11677, 0xA9362ECE, 0x118A49AB, 0x033FE645, 0xBB838120,
+      0xE3E09176, 0x5B5CF613, 0x49E959FD, 0xF1553E98, 0x6C820621, 0xD43E6144, 0xC68BCEAA, 0x7E37A9CF,
+      0xD67F4138, 0x6EC3265D, 0x7C7689B3, 0xC4CAEED6, 0x591DD66F, 0xE1A1B10A, 0xF3141EE4, 0x4BA87981,
+      0x13CB69D7, 0xAB770EB2, 0xB9C2A15C, 0x017EC639, 0x9CA9FE80, 0x241599E5, 0x36A0360B, 0x8E1C516E,
+      0x866616A7, 0x3EDA71C2, 0x2C6FDE2C, 0x94D3B949, 0x090481F0, 0xB1B8E695, 0xA30D497B, 0x1BB12E1E,
+      0x43D23E48, 0xFB6E592D, 0xE9DBF6C3, 0x516791A6, 0xCCB0A91F, 0x740CCE7A, 0x66B96194, 0xDE0506F1
+   },
+   {
+      0x00000000, 0x3D6029B0, 0x7AC05360, 0x47A07AD0, 0xF580A6C0, 0xC8E08F70, 0x8F40F5A0, 0xB220DC10,
+      0x30704BC1, 0x0D106271, 0x4AB018A1, 0x77D03111, 0xC5F0ED01, 0xF890C4B1, 0xBF30BE61, 0x825097D1,
+      0x60E09782, 0x5D80BE32, 0x1A20C4E2, 0x2740ED52, 0x95603142, 0xA80018F2, 0xEFA06222, 0xD2C04B92,
+      0x5090DC43, 0x6DF0F5F3, 0x2A508F23, 0x1730A693, 0xA5107A83, 0x98705333, 0xDFD029E3, 0xE2B00053,
+      0xC1C12F04, 0xFCA106B4, 0xBB017C64, 0x866155D4, 0x344189C4, 0x0921A074, 0x4E81DAA4, 0x73E1F314,
+      0xF1B164C5, 0xCCD14D75, 0x8B7137A5, 0xB6111E15, 0x0431C205, 0x3951EBB5, 0x7EF19165, 0x4391B8D5,
+      0xA121B886, 0x9C419136, 0xDBE1EBE6, 0xE681C256, 0x54A11E46, 0x69C137F6, 0x2E614D26, 0x13016496,
+      0x9151F347, 0xAC31DAF7, 0xEB91A027, 0xD6F18997, 0x64D15587, 0x59B17C37, 0x1E1106E7, 0x23712F57,
+      0x58F35849, 0x659371F9, 0x22330B29, 0x1F532299, 0xAD73FE89, 0x9013D739, 0xD7B3ADE9, 0xEAD38459,
+      0x68831388, 0x55E33A38, 0x124340E8, 0x2F236958, 0x9D03B548, 0xA0639CF8, 0xE7C3E628, 0xDAA3CF98,
+      0x3813CFCB, 0x0573E67B, 0x42D39CAB, 0x7FB3B51B, 0xCD93690B, 0xF0F340BB, 0xB7533A6B, 0x8A3313DB,
+      0x0863840A, 0x3503ADBA, 0x72A3D76A, 0x4FC3FEDA, 0xFDE322CA, 0xC0830B7A, 0x872371AA, 0xBA43581A,
+      0x9932774D, 0xA4525EFD, 0xE3F2242D, 0xDE920D9D, 0x6CB2D18D, 0x51D2F83D, 0x167282ED, 0x2B12AB5D,
+      0xA9423C8C, 0x9422153C, 0xD3826FEC, 0xEEE2465C, 0x5CC29A4C, 0x61A2B3FC, 0x2602C92C, 0x1B62E09C,
+      0xF9D2E0CF, 0xC4B2C97F, 0x8312B3AF, 0xBE729A1F, 0x0C52460F, 0x31326FBF, 0x7692156F, 0x4BF23CDF,
+      0xC9A2AB0E, 0xF4C282BE, 0xB362F86E, 0x8E02D1DE, 0x3C220DCE, 0x0142247E, 0x46E25EAE, 0x7B82771E,
+      0xB1E6B092, 0x8C869922, 0xCB26E3F2, 0xF646CA42, 0x44661652, 0x79063FE2, 0x3EA64532, 0x03C66C82,
+      0x8196FB53, 0xBCF6D2E3, 0xFB56A833, 0xC6368183, 0x74165D93, 0x49767423, 0x0ED60EF3, 0x33B62743,
+      0xD1062710, 0xEC660EA0, 0xABC67470, 0x96A65DC0, 0x248681D0, 0x19E6A860, 0x5E46D2B0, 0x6326FB00,
+      0xE1766CD1, 0xDC164561, 0x9BB63FB1, 0xA6D61601, 0x14F6CA11, 0x2996E3A1, 0x6E369971, 0x5356B0C1,
+      0x70279F96, 0x4D47B626, 0x0AE7CCF6, 0x3787E546, 0x85A73956, 0xB8C710E6, 0xFF676A36, 0xC2074386,
+      0x4057D457, 0x7D37FDE7, 0x3A978737, 0x07F7AE87, 0xB5D77297, 0x88B75B27, 0xCF1721F7, 0xF2770847,
+      0x10C70814, 0x2DA721A4, 0x6A075B74, 0x576772C4, 0xE547AED4, 0xD8278764, 0x9F87FDB4, 0xA2E7D404,
+      0x20B743D5, 0x1DD76A65, 0x5A7710B5, 0x67173905, 0xD537E515, 0xE857CCA5, 0xAFF7B675, 0x92979FC5,
+      0xE915E8DB, 0xD475C16B, 0x93D5BBBB, 0xAEB5920B, 0x1C954E1B, 0x21F567AB, 0x66551D7B, 0x5B3534CB,
+      0xD965A31A, 0xE4058AAA, 0xA3A5F07A, 0x9EC5D9CA, 0x2CE505DA, 0x11852C6A, 0x562556BA, 0x6B457F0A,
+      0x89F57F59, 0xB49556E9, 0xF3352C39, 0xCE550589, 0x7C75D999, 0x4115F029, 0x06B58AF9, 0x3BD5A349,
+      0xB9853498, 0x84E51D28, 0xC34567F8, 0xFE254E48, 0x4C059258, 0x7165BBE8, 0x36C5C138, 0x0BA5E888,
+      0x28D4C7DF, 0x15B4EE6F, 0x521494BF, 0x6F74BD0F, 0xDD54611F, 0xE03448AF, 0xA794327F, 0x9AF41BCF,
+      0x18A48C1E, 0x25C4A5AE, 0x6264DF7E, 0x5F04F6CE, 0xED242ADE, 0xD044036E, 0x97E479BE, 0xAA84500E,
+      0x4834505D, 0x755479ED, 0x32F4033D, 0x0F942A8D, 0xBDB4F69D, 0x80D4DF2D, 0xC774A5FD, 0xFA148C4D,
+      0x78441B9C, 0x4524322C, 0x028448FC, 0x3FE4614C, 0x8DC4BD5C, 0xB0A494EC, 0xF704EE3C, 0xCA64C78C
+   },
+   {
+      0x00000000, 0xCB5CD3A5, 0x4DC8A10B, 0x869472AE, 0x9B914216, 0x50CD91B3, 0xD659E31D, 0x1D0530B8,
+      0xEC53826D, 0x270F51C8, 0xA19B2366, 0x6AC7F0C3, 0x77C2C07B, 0xBC9E13DE, 0x3A0A6170, 0xF156B2D5,
+      0x03D6029B, 0xC88AD13E, 0x4E1EA390, 0x85427035, 0x9847408D, 0x531B9328, 0xD58FE186, 0x1ED33223,
+      0xEF8580F6, 0x24D95353, 0xA24D21FD, 0x6911F258, 0x7414C2E0, 0xBF481145, 0x39DC63EB, 0xF280B04E,
+      0x07AC0536, 0xCCF0D693, 0x4A64A43D, 0x81387798, 0x9C3D4720, 0x57619485, 0xD1F5E62B, 0x1AA9358E,
+      0xEBFF875B, 0x20A354FE, 0xA6372650, 0x6D6BF5F5, 0x706EC54D, 0xBB3216E8, 0x3DA66446, 0xF6FAB7E3,
+      0x047A07AD, 0xCF26D408, 0x49B2A6A6, 0x82EE7503, 0x9FEB45BB, 0x54B7961E, 0xD223E4B0, 0x197F3715,
+      0xE82985C0, 0x23755665, 0xA5E124CB, 0x6EBDF76E, 0x73B8C7D6, 0xB8E41473, 0x3E7066DD, 0xF52CB578,
+      0x0F580A6C, 0xC404D9C9, 0x4290AB67, 0x89CC78C2, 0x94C9487A, 0x5F959BDF, 0xD901E971, 0x125D3AD4,
+      0xE30B8801, 0x28575BA4, 0xAEC3290A, 0x659FFAAF, 0x789ACA17, 0xB3C619B2, 0x35526B1C, 0xFE0EB8B9,
+      0x0C8E08F7, 0xC7D2DB52, 0x4146A9FC, 0x8A1A7A59, 0x971F4AE1, 0x5C439944, 0xDAD7EBEA, 0x118B384F,
+      0xE0DD8A9A, 0x2B81593F, 0xAD152B91, 0x6649F834, 0x7B4CC88C, 0xB0101B29, 0x36846987, 0xFDD8BA22,
+      0x08F40F5A, 0xC3A8DCFF, 0x453CAE51, 0x8E607DF4, 0x93654D4C, 0x58399EE9, 0xDEADEC47, 0x15F13FE2,
+      0xE4A78D37, 0x2FFB5E92, 0xA96F2C3C, 0x6233FF99, 0x7F36CF21, 0xB46A1C84, 0x32FE6E2A, 0xF9A2BD8F,
+      0x0B220DC1, 0xC07EDE64, 0x46EAACCA, 0x8DB67F6F, 0x90B34FD7, 0x5BEF9C72, 0xDD7BEEDC, 0x16273D79,
+      0xE7718FAC, 0x2C2D5C09, 0xAAB92EA7, 0x61E5FD02, 0x7CE0CDBA, 0xB7BC1E1F, 0x31286CB1, 0xFA74BF14,
+      0x1EB014D8, 0xD5ECC77D, 0x5378B5D3, 0x98246676, 0x852156CE, 0x4E7D856B, 0xC8E9F7C5, 0x03B52460,
+      0xF2E396B5, 0x39BF4510, 0xBF2B37BE, 0x7477E41B, 0x6972D4A3, 0xA22E0706, 0x24BA75A8, 0xEFE6A60D,
+      0x1D661643, 0xD63AC5E6, 0x50AEB748, 0x9BF264ED, 0x86F75455, 0x4DAB87F0, 0xCB3FF55E, 0x006326FB,
+      0xF135942E, 0x3A69478B, 0xBCFD3525, 0x77A1E680, 0x6AA4D638, 0xA1F8059D, 0x276C7733, 0xEC30A496,
+      0x191C11EE, 0xD240C24B, 0x54D4B0E5, 0x9F886340, 0x828D53F8, 0x49D1805D, 0xCF45F2F3, 0x04192156,
+      0xF54F9383, 0x3E134026, 0xB8873288, 0x73DBE12D, 0x6EDED195, 0xA5820230, 0x2316709E, 0xE84AA33B,
+      0x1ACA1375, 0xD196C0D0, 0x5702B27E, 0x9C5E61DB, 0x815B5163, 0x4A0782C6, 0xCC93F068, 0x07CF23CD,
+      0xF6999118, 0x3DC542BD, 0xBB513013, 0x700DE3B6, 0x6D08D30E, 0xA65400AB, 0x20C07205, 0xEB9CA1A0,
+      0x11E81EB4, 0xDAB4CD11, 0x5C20BFBF, 0x977C6C1A, 0x8A795CA2, 0x41258F07, 0xC7B1FDA9, 0x0CED2E0C,
+      0xFDBB9CD9, 0x36E74F7C, 0xB0733DD2, 0x7B2FEE77, 0x662ADECF, 0xAD760D6A, 0x2BE27FC4, 0xE0BEAC61,
+      0x123E1C2F, 0xD962CF8A, 0x5FF6BD24, 0x94AA6E81, 0x89AF5E39, 0x42F38D9C, 0xC467FF32, 0x0F3B2C97,
+      0xFE6D9E42, 0x35314DE7, 0xB3A53F49, 0x78F9ECEC, 0x65FCDC54, 0xAEA00FF1, 0x28347D5F, 0xE368AEFA,
+      0x16441B82, 0xDD18C827, 0x5B8CBA89, 0x90D0692C, 0x8DD55994, 0x46898A31, 0xC01DF89F, 0x0B412B3A,
+      0xFA1799EF, 0x314B4A4A, 0xB7DF38E4, 0x7C83EB41, 0x6186DBF9, 0xAADA085C, 0x2C4E7AF2, 0xE712A957,
+      0x15921919, 0xDECECABC, 0x585AB812, 0x93066BB7, 0x8E035B0F, 0x455F88AA, 0xC3CBFA04, 0x089729A1,
+      0xF9C19B74, 0x329D48D1, 0xB4093A7F, 0x7F55E9DA, 0x6250D962, 0xA90C0AC7, 0x2F987869, 0xE4C4ABCC
+   },
+   {
+      0x00000000, 0xA6770BB4, 0x979F1129, 0x31E81A9D, 0xF44F2413, 0x52382FA7, 0x63D0353A, 0xC5A73E8E,
+      0x33EF4E67, 0x959845D3, 0xA4705F4E, 0x020754FA, 0xC7A06A74, 0x61D761C0, 0x503F7B5D, 0xF64870E9,
+      0x67DE9CCE, 0xC1A9977A, 0xF0418DE7, 0x56368653, 0x9391B8DD, 0x35E6B369, 0x040EA9F4, 0xA279A240,
+      0x5431D2A9, 0xF246D91D, 0xC3AEC380, 0x65D9C834, 0xA07EF6BA, 0x0609FD0E, 0x37E1E793, 0x9196EC27,
+      0xCFBD399C, 0x69CA3228, 0x582228B5, 0xFE552301, 0x3BF21D8F, 0x9D85163B, 0xAC6D0CA6, 0x0A1A0712,
+      0xFC5277FB, 0x5A257C4F, 0x6BCD66D2, 0xCDBA6D66, 0x081D53E8, 0xAE6A585C, 0x9F8242C1, 0x39F54975,
+      0xA863A552, 0x0E14AEE6, 0x3FFCB47B, 0x998BBFCF, 0x5C2C8141, 0xFA5B8AF5, 0xCBB39068, 0x6DC49BDC,
+      0x9B8CEB35, 0x3DFBE081, 0x0C13FA1C, 0xAA64F1A8, 0x6FC3CF26, 0xC9B4C492, 0xF85CDE0F, 0x5E2BD5BB,
+      0x440B7579, 0xE27C7ECD, 0xD3946450, 0x75E36FE4, 0xB044516A, 0x16335ADE, 0x27DB4043, 0x81AC4BF7,
+      0x77E43B1E, 0xD19330AA, 0xE07B2A37, 0x460C2183, 0x83AB1F0D, 0x25DC14B9, 0x14340E24, 0xB2430590,
+      0x23D5E9B7, 0x85A2E203, 0xB44AF89E, 0x123DF32A, 0xD79ACDA4, 0x71EDC610, 0x4005DC8D, 0xE672D739,
+      0x103AA7D0, 0xB64DAC64, 0x87A5B6F9, 0x21D2BD4D, 0xE47583C3, 0x42028877, 0x73EA92EA, 0xD59D995E,
+      0x8BB64CE5, 0x2DC14751, 0x1C295DCC, 0xBA5E5678, 0x7FF968F6, 0xD98E6342, 0xE86679DF, 0x4E11726B,
+      0xB8590282, 0x1E2E0936, 0x2FC613AB, 0x89B1181F, 0x4C162691, 0xEA612D25, 0xDB8937B8, 0x7DFE3C0C,
+      0xEC68D02B, 0x4A1FDB9F, 0x7BF7C102, 0xDD80CAB6, 0x1827F438, 0xBE50FF8C, 0x8FB8E511, 0x29CFEEA5,
+      0xDF879E4C, 0x79F095F8, 0x48188F65, 0xEE6F84D1, 0x2BC8BA5F, 0x8DBFB1EB, 0xBC57AB76, 0x1A20A0C2,
+      0x8816EAF2, 0x2E61E146, 0x1F89FBDB, 0xB9FEF06F, 0x7C59CEE1, 0xDA2EC555, 0xEBC6DFC8, 0x4DB1D47C,
+      0xBBF9A495, 0x1D8EAF21, 0x2C66B5BC, 0x8A11BE08, 0x4FB68086, 0xE9C18B32, 0xD82991AF, 0x7E5E9A1B,
+      0xEFC8763C, 0x49BF7D88, 0x78576715, 0xDE206CA1, 0x1B87522F, 0xBDF0599B, 0x8C184306, 0x2A6F48B2,
+      0xDC27385B, 0x7A5033EF, 0x4BB82972, 0xEDCF22C6, 0x28681C48, 0x8E1F17FC, 0xBFF70D61, 0x198006D5,
+      0x47ABD36E, 0xE1DCD8DA, 0xD034C247, 0x7643C9F3, 0xB3E4F77D, 0x1593FCC9, 0x247BE654, 0x820CEDE0,
+      0x74449D09, 0xD23396BD, 0xE3DB8C20, 0x45AC8794, 0x800BB91A, 0x267CB2AE, 0x1794A833, 0xB1E3A387,
+      0x20754FA0, 0x86024414, 0xB7EA5E89, 0x119D553D, 0xD43A6BB3, 0x724D6007, 0x43A57A9A, 0xE5D2712E,
+      0x139A01C7, 0xB5ED0A73, 0x840510EE, 0x22721B5A, 0xE7D525D4, 0x41A22E60, 0x704A34FD, 0xD63D3F49,
+      0xCC1D9F8B, 0x6A6A943F, 0x5B828EA2, 0xFDF58516, 0x3852BB98, 0x9E25B02C, 0xAFCDAAB1, 0x09BAA105,
+      0xFFF2D1EC, 0x5985DA58, 0x686DC0C5, 0xCE1ACB71, 0x0BBDF5FF, 0xADCAFE4B, 0x9C22E4D6, 0x3A55EF62,
+      0xABC30345, 0x0DB408F1, 0x3C5C126C, 0x9A2B19D8, 0x5F8C2756, 0xF9FB2CE2, 0xC813367F, 0x6E643DCB,
+      0x982C4D22, 0x3E5B4696, 0x0FB35C0B, 0xA9C457BF, 0x6C636931, 0xCA146285, 0xFBFC7818, 0x5D8B73AC,
+      0x03A0A617, 0xA5D7ADA3, 0x943FB73E, 0x3248BC8A, 0xF7EF8204, 0x519889B0, 0x6070932D, 0xC6079899,
+      0x304FE870, 0x9638E3C4, 0xA7D0F959, 0x01A7F2ED, 0xC400CC63, 0x6277C7D7, 0x539FDD4A, 0xF5E8D6FE,
+      0x647E3AD9, 0xC209316D, 0xF3E12BF0, 0x55962044, 0x90311ECA, 0x3646157E, 0x07AE0FE3, 0xA1D90457,
+      0x579174BE, 0xF1E67F0A, 0xC00E6597, 0x66796E23, 0xA3DE50AD, 0x05A95B19, 0x34414184, 0x92364A30
+   },
+   {
+      0x00000000, 0xCCAA009E, 0x4225077D, 0x8E8F07E3, 0x844A0EFA, 0x48E00E64, 0xC66F0987, 0x0AC50919,
+      0xD3E51BB5, 0x1F4F1B2B, 0x91C01CC8, 0x5D6A1C56, 0x57AF154F, 0x9B0515D1, 0x158A1232, 0xD92012AC,
+      0x7CBB312B, 0xB01131B5, 0x3E9E3656, 0xF23436C8, 0xF8F13FD1, 0x345B3F4F, 0xBAD438AC, 0x767E3832,
+      0xAF5E2A9E, 0x63F42A00, 0xED7B2DE3, 0x21D12D7D, 0x2B142464, 0xE7BE24FA, 0x69312319, 0xA59B2387,
+      0xF9766256, 0x35DC62C8, 0xBB53652B, 0x77F965B5, 0x7D3C6CAC, 0xB1966C32, 0x3F196BD1, 0xF3B36B4F,
+      0x2A9379E3, 0xE639797D, 0x68B67E9E, 0xA41C7E00, 0xAED97719, 0x62737787, 0xECFC7064, 0x205670FA,
+      0x85CD537D, 0x496753E3, 0xC7E85400, 0x0B42549E, 0x01875D87, 0xCD2D5D19, 0x43A25AFA, 0x8F085A64,
+      0x562848C8, 0x9A824856, 0x140D4FB5, 0xD8A74F2B, 0xD2624632, 0x1EC846AC, 0x9047414F, 0x5CED41D1,
+      0x299DC2ED, 0xE537C273, 0x6BB8C590, 0xA712C50E, 0xADD7CC17, 0x617DCC89, 0xEFF2CB6A, 0x2358CBF4,
+      0xFA78D958, 0x36D2D9C6, 0xB85DDE25, 0x74F7DEBB, 0x7E32D7A2, 0xB298D73C, 0x3C17D0DF, 0xF0BDD041,
+      0x5526F3C6, 0x998CF358, 0x1703F4BB, 0xDBA9F425, 0xD16CFD3C, 0x1DC6FDA2, 0x9349FA41, 0x5FE3FADF,
+      0x86C3E873, 0x4A69E8ED, 0xC4E6EF0E, 0x084CEF90, 0x0289E689, 0xCE23E617, 0x40ACE1F4, 0x8C06E16A,
+      0xD0EBA0BB, 0x1C41A025, 0x92CEA7C6, 0x5E64A758, 0x54A1AE41, 0x980BAEDF, 0x1684A93C, 0xDA2EA9A2,
+      0x030EBB0E, 0xCFA4BB90, 0x412BBC73, 0x8D81BCED, 0x8744B5F4, 0x4BEEB56A, 0xC561B289, 0x09CBB217,
+      0xAC509190, 0x60FA910E, 0xEE7596ED, 0x22DF9673, 0x281A9F6A, 0xE4B09FF4, 0x6A3F9817, 0xA6959889,
+      0x7FB58A25, 0xB31F8ABB, 0x3D908D58, 0xF13A8DC6, 0xFBFF84DF, 0x37558441, 0xB9DA83A2, 0x7570833C,
+      0x533B85DA, 0x9F918544, 0x111E82A7, 0xDDB48239, 0xD7718B20, 0x1BDB8BBE, 0x95548C5D, 0x59FE8CC3,
+      0x80DE9E6F, 0x4C749EF1, 0xC2FB9912, 0x0E51998C, 0x04949095, 0xC83E900B, 0x46B197E8, 0x8A1B9776,
+      0x2F80B4F1, 0xE32AB46F, 0x6DA5B38C, 0xA10FB312, 0xABCABA0B, 0x6760BA95, 0xE9EFBD76, 0x2545BDE8,
+      0xFC65AF44, 0x30CFAFDA, 0xBE40A839, 0x72EAA8A7, 0x782FA1BE, 0xB485A120, 0x3A0AA6C3, 0xF6A0A65D,
+      0xAA4DE78C, 0x66E7E712, 0xE868E0F1, 0x24C2E06F, 0x2E07E976, 0xE2ADE9E8, 0x6C22EE0B, 0xA088EE95,
+      0x79A8FC39, 0xB502FCA7, 0x3B8DFB44, 0xF727FBDA, 0xFDE2F2C3, 0x3148F25D, 0xBFC7F5BE, 0x736DF520,
+      0xD6F6D6A7, 0x1A5CD639, 0x94D3D1DA, 0x5879D144, 0x52BCD85D, 0x9E16D8C3, 0x1099DF20, 0xDC33DFBE,
+      0x0513CD12, 0xC9B9CD8C, 0x4736CA6F, 0x8B9CCAF1, 0x8159C3E8, 0x4DF3C376, 0xC37CC495, 0x0FD6C40B,
+      0x7AA64737, 0xB60C47A9, 0x3883404A, 0xF42940D4, 0xFEEC49CD, 0x32464953, 0xBCC94EB0, 0x70634E2E,
+      0xA9435C82, 0x65E95C1C, 0xEB665BFF, 0x27CC5B61, 0x2D095278, 0xE1A352E6, 0x6F2C5505, 0xA386559B,
+      0x061D761C, 0xCAB77682, 0x44387161, 0x889271FF, 0x825778E6, 0x4EFD7878, 0xC0727F9B, 0x0CD87F05,
+      0xD5F86DA9, 0x19526D37, 0x97DD6AD4, 0x5B776A4A, 0x51B26353, 0x9D1863CD, 0x1397642E, 0xDF3D64B0,
+      0x83D02561, 0x4F7A25FF, 0xC1F5221C, 0x0D5F2282, 0x079A2B9B, 0xCB302B05, 0x45BF2CE6, 0x89152C78,
+      0x50353ED4, 0x9C9F3E4A, 0x121039A9, 0xDEBA3937, 0xD47F302E, 0x18D530B0, 0x965A3753, 0x5AF037CD,
+      0xFF6B144A, 0x33C114D4, 0xBD4E1337, 0x71E413A9, 0x7B211AB0, 0xB78B1A2E, 0x39041DCD, 0xF5AE1D53,
+      0x2C8E0FFF, 0xE0240F61, 0x6EAB0882, 0xA201081C, 0xA8C40105, 0x646E019B, 0xEAE10678, 0x264B06E6
+   }
+};
 
+static unsigned int stbiw__crc32_slice8(unsigned int crc, unsigned char *buffer, int len)
+{
+   const unsigned int (*t)[256] = stbiw__crc_table;
+   while (len >= 8) {
+      crc ^= buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((unsigned int) buffer[3] << 24);
+      crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^ t[5][(crc >> 16) & 0xff] ^ t[4][crc >> 24] ^
+            t[3][buffer[4]] ^ t[2][buffer[5]] ^ t[1][buffer[6]] ^ t[0][buffer[7]];
+      buffer += 8;
+      len -= 8;
+   }
+   while (len--)
+      crc = (crc >> 8) ^ t[0][*buffer++ ^ (crc & 0xff)];
+   return crc;
+}
+
+#ifdef STBIW__X86_SIMD
+// carry-less multiply folding, after Intel's "Fast CRC Computation for Generic
+// Polynomials Using PCLMULQDQ Instruction"; constants are for the bit-reflected
+// CRC-32 polynomial. len must be a multiple of 16 and at least 64.
+__attribute__((target("sse2,pclmul")))
+static unsigned int stbiw__crc32_pclmul(unsigned int crc, unsigned char *buffer, int len)
+{
+   const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+   const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+   const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+   const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+   const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+   __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+   x1 = _mm_loadu_si128((const __m128i *) (buffer + 0x00));
+   x2 = _mm_loadu_si128((const __m128i *) (buffer + 0x10));
+   x3 = _mm_loadu_si128((const __m128i *) (buffer + 0x20));
+   x4 = _mm_loadu_si128((const __m128i *) (buffer + 0x30));
+   x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+   buffer += 64;
+   len -= 64;
+
+   // fold 4x128 bits at a time
+   while (len >= 64) {
+      x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+      x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+      x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+      x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+      x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+      x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+      x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *) (buffer + 0x00)));
+      x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *) (buffer + 0x10)));
+      x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *) (buffer + 0x20)));
+      x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *) (buffer + 0x30)));
+      buffer += 64;
+      len -= 64;
+   }
+
+   // fold the four lanes into one
+   x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+   x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+   x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+   // remaining 16 byte blocks
+   while (len >= 16) {
+      x2 = _mm_loadu_si128((const __m128i *) buffer);
+      x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+      buffer += 16;
+      len -= 16;
+   }
+
+   // 128 -> 64 bits
+   x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+   x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+   x2 = _mm_srli_si128(x1, 4);
+   x1 = _mm_and_si128(x1, mask32);
+   x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+   x1 = _mm_xor_si128(x1, x2);
+
+   // Barrett reduction to 32 bits
+   x2 = _mm_and_si128(x1, mask32);
+   x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+   x2 = _mm_and_si128(x2, mask32);
+   x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+   x1 = _mm_xor_si128(x1, x2);
+   return (unsigned int) _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif
+#endif // STBIW_CRC32
+
+static unsigned int stbiw__crc32(unsigned char *buffer, int len)
+{
+#ifdef STBIW_CRC32
+    return STBIW_CRC32(buffer, len);
+#else
    unsigned int crc = ~0u;
-   int i;
-   for (i=0; i < len; ++i)
-      crc = (crc >> 8) ^ crc_table[buffer[i] ^ (crc & 0xff)];
-   return ~crc;
+#ifdef STBIW__X86_SIMD
+   if (len >= 64 && stbiw__cpu_has_pclmul()) {
+      int n = len & ~15;
+      crc = stbiw__crc32_pclmul(crc, buffer, n);
+      buffer += n;
+      len -= n;
+   }
+#endif
+   return ~stbiw__crc32_slice8(crc, buffer, len);
 #endif
 }
 
@@ -1089,15 +1588,14 @@ static unsigned char stbiw__paeth(int a, int b, int c)
 }
 
 // @OPTIMIZE: provide an option that always forces left-predict or paeth predict
-static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, signed char *line_buffer)
+// z points at the row to encode, z-signed_stride at the row above it
+static void stbiw__encode_png_row(unsigned char *z, int signed_stride, int width, int y, int n, int filter_type, signed char *line_buffer)
 {
    static int mapping[] = { 0,1,2,3,4 };
    static int firstmap[] = { 0,1,0,5,6 };
    int *mymap = (y != 0) ? mapping : firstmap;
    int i;
    int type = mymap[filter_type];
-   unsigned char *z = pixels + stride_bytes * (stbi__flip_vertically_on_write ? height-1-y : y);
-   int signed_stride = stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
 
    if (type==0) {
       memcpy(line_buffer, z, width*n);
@@ -1125,6 +1623,36 @@ static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int
    }
 }
 
+// filters one row into line_buffer and returns the filter type used
+static int stbiw__filter_png_row(unsigned char *z, int signed_stride, int width, int y, int n, int force_filter, signed char *line_buffer)
+{
+   int filter_type;
+   if (force_filter > -1) {
+      filter_type = force_filter;
+      stbiw__encode_png_row(z, signed_stride, width, y, n, force_filter, line_buffer);
+   } else { // Estimate the best filter by running through all of them:
+      int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
+      for (filter_type = 0; filter_type < 5; filter_type++) {
+         stbiw__encode_png_row(z, signed_stride, width, y, n, filter_type, line_buffer);
+
+         // Estimate the entropy of the line using this filter; the less, the better.
+         est = 0;
+         for (i = 0; i < width*n; ++i) {
+            est += abs((signed char) line_buffer[i]);
+         }
+         if (est < best_filter_val) {
+            best_filter_val = est;
+            best_filter = filter_type;
+         }
+      }
+      if (filter_type != best_filter) {  // If the last iteration already got us the best filter, don't redo it
+         stbiw__encode_png_row(z, signed_stride, width, y, n, best_filter, line_buffer);
+         filter_type = best_filter;
+      }
+   }
+   return filter_type;
+}
+
 STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
 {
    int force_filter = stbi_write_force_png_filter;
@@ -1144,30 +1672,9 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
    filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
    line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
    for (j=0; j < y; ++j) {
-      int filter_type;
-      if (force_filter > -1) {
-         filter_type = force_filter;
-         stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, force_filter, line_buffer);
-      } else { // Estimate the best filter by running through all of them:
-         int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
-         for (filter_type = 0; filter_type < 5; filter_type++) {
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, filter_type, line_buffer);
-
-            // Estimate the entropy of the line using this filter; the less, the better.
-            est = 0;
-            for (i = 0; i < x*n; ++i) {
-               est += abs((signed char) line_buffer[i]);
-            }
-            if (est < best_filter_val) {
-               best_filter_val = est;
-               best_filter = filter_type;
-            }
-         }
-         if (filter_type != best_filter) {  // If the last iteration already got us the best filter, don't redo it
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, best_filter, line_buffer);
-            filter_type = best_filter;
-         }
-      }
+      unsigned char *z = (unsigned char *) pixels + stride_bytes * (stbi__flip_vertically_on_write ? y-1-j : j);
+      int signed_stride = stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
+      int filter_type = stbiw__filter_png_row(z, signed_stride, x, j, n, force_filter, line_buffer);
       // when we get here, filter_type contains the filter type, and line_buffer contains the data
       filt[j*(x*n+1)] = (unsigned char) filter_type;
       STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
@@ -1238,6 +1745,255 @@ STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int x,
    return 1;
 }
 
+#ifndef STBIW_ZLIB_COMPRESS
+#ifndef STBIW_PNG_STREAM_IDAT
+#define STBIW_PNG_STREAM_IDAT  65536
+#endif
+
+// bytes of lookahead held back so a match never stops at a row boundary
+#define stbiw__ZLOOKAHEAD  (258+4)
+
+struct stbi_png_stream
+{
+   stbi_write_func *func;
+   void *context;
+   int x, y, n, row;
+   int error;
+   unsigned char *rows;        // the last two input rows, alternating
+   signed char *line_buffer;
+   // deflate window: at least 32K of history followed by the pending bytes;
+   // win[0] is stream offset win_base, zpos is the next offset to compress
+   unsigned char *win;
+   int win_len, win_cap, win_base, zpos;
+   int **hash_table;           // stbiw__sb lists of stream offsets
+   unsigned char *out;         // stbiw__sb of compressed bytes not yet emitted
+   unsigned int bitbuf;
+   int bitcount;
+   unsigned int adler;
+   unsigned char *chunk;       // length + tag + payload + crc of one chunk
+};
+
+static void stbiw__png_stream_chunk(stbi_png_stream *ps, const char *tag, const unsigned char *data, int len)
+{
+   unsigned char *o = ps->chunk;
+   stbiw__wp32(o, len);
+   stbiw__wptag(o, tag);
+   if (len) memcpy(o, data, len);
+   o += len;
+   stbiw__wpcrc(&o, len);
+   ps->func(ps->context, ps->chunk, len + 12);
+}
+
+// same LZ77 and fixed huffman coding as stbi_zlib_compress, run over the
+// part of the window that has enough lookahead (all of it when final)
+static void stbiw__png_stream_deflate(stbi_png_stream *ps, int final)
+{
+   static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
+   static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
+   static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
+   static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+   unsigned char *data = ps->win, *out = ps->out;
+   unsigned int bitbuf = ps->bitbuf;
+   int bitcount = ps->bitcount;
+   int quality = stbi_write_png_compression_level < 5 ? 5 : stbi_write_png_compression_level;
+   int data_len = ps->win_len, base = ps->win_base;
+   int end = final ? data_len-3 : data_len - stbiw__ZLOOKAHEAD;
+   int i = ps->zpos - base, j;
+
+   while (i < end) {
+      int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1), best=3;
+      int bestloc = -1;
+      int *hlist = ps->hash_table[h];
+      int n = stbiw__sbcount(hlist);
+      for (j=0; j < n; ++j) {
+         if (hlist[j] > base+i-32768) { // if entry lies within window
+            int d = stbiw__zlib_countm(data+hlist[j]-base, data+i, data_len-i);
+            if (d >= best) { best=d; bestloc=hlist[j]-base; }
+         }
+      }
+      if (ps->hash_table[h] && stbiw__sbn(ps->hash_table[h]) == 2*quality) {
+         STBIW_MEMMOVE(ps->hash_table[h], ps->hash_table[h]+quality, sizeof(ps->hash_table[h][0])*quality);
+         stbiw__sbn(ps->hash_table[h]) = quality;
+      }
+      stbiw__sbpush(ps->hash_table[h], base+i);
+
+      if (bestloc >= 0) {
+         h = stbiw__zhash(data+i+1)&(stbiw__ZHASH-1);
+         hlist = ps->hash_table[h];
+         n = stbiw__sbcount(hlist);
+         for (j=0; j < n; ++j) {
+            if (hlist[j] > base+i-32767) {
+               int e = stbiw__zlib_countm(data+hlist[j]-base, data+i+1, data_len-i-1);
+               if (e > best) {
+                  bestloc = -1;
+                  break;
+               }
+            }
+         }
+      }
+
+      if (bestloc >= 0) {
+         int d = i - bestloc;
+         STBIW_ASSERT(d <= 32767 && best <= 258);
+         for (j=0; best > lengthc[j+1]-1; ++j);
+         stbiw__zlib_huff(j+257);
+         if (lengtheb[j]) stbiw__zlib_add(best - lengthc[j], lengtheb[j]);
+         for (j=0; d > distc[j+1]-1; ++j);
+         stbiw__zlib_add(stbiw__zlib_bitrev(j,5),5);
+         if (disteb[j]) stbiw__zlib_add(d - distc[j], disteb[j]);
+         i += best;
+      } else {
+         stbiw__zlib_huffb(data[i]);
+         ++i;
+      }
+   }
+   if (final) {
+      for (;i < data_len; ++i)
+         stbiw__zlib_huffb(data[i]);
+      stbiw__zlib_huff(256); // end of block
+      while (bitcount)
+         stbiw__zlib_add(0,1);
+   }
+   ps->zpos = base + i;
+   ps->out = out;
+   ps->bitbuf = bitbuf;
+   ps->bitcount = bitcount;
+}
+
+static void stbiw__png_stream_flush(stbi_png_stream *ps, int final)
+{
+   int len = stbiw__sbcount(ps->out), done = 0;
+   while (len - done >= STBIW_PNG_STREAM_IDAT || (final && done < len)) {
+      int n = len - done < STBIW_PNG_STREAM_IDAT ? len - done : STBIW_PNG_STREAM_IDAT;
+      stbiw__png_stream_chunk(ps, "IDAT", ps->out + done, n);
+      done += n;
+   }
+   if (done) {
+      STBIW_MEMMOVE(ps->out, ps->out + done, len - done);
+      stbiw__sbn(ps->out) = len - done;
+   }
+}
+
+STBIWDEF stbi_png_stream *stbi_write_png_stream_begin(stbi_write_func *func, void *context, int x, int y, int n)
+{
+   static const unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
+   int ctype[5] = { -1, 0, 4, 2, 6 };
+   unsigned char ihdr[13], *o = ihdr;
+   stbi_png_stream *ps;
+   int i;
+
+   if (x <= 0 || y <= 0 || n < 1 || n > 4)
+      return NULL;
+   ps = (stbi_png_stream *) STBIW_MALLOC(sizeof(*ps));
+   if (!ps) return NULL;
+   memset(ps, 0, sizeof(*ps));
+   ps->func = func;
+   ps->context = context;
+   ps->x = x;
+   ps->y = y;
+   ps->n = n;
+   ps->adler = 1;
+   ps->win_cap = 2*32768 + 2*(x*n+1) + stbiw__ZLOOKAHEAD;
+   ps->rows = (unsigned char *) STBIW_MALLOC(2 * x*n);
+   ps->line_buffer = (signed char *) STBIW_MALLOC(x*n);
+   ps->win = (unsigned char *) STBIW_MALLOC(ps->win_cap);
+   ps->chunk = (unsigned char *) STBIW_MALLOC(STBIW_PNG_STREAM_IDAT + 12);
+   ps->hash_table = (int **) STBIW_MALLOC(stbiw__ZHASH * sizeof(int *));
+   if (ps->hash_table)
+      for (i=0; i < stbiw__ZHASH; ++i)
+         ps->hash_table[i] = NULL;
+   if (!ps->rows || !ps->line_buffer || !ps->win || !ps->chunk || !ps->hash_table) {
+      ps->error = 1;
+      return ps;
+   }
+
+   func(context, (void *) sig, 8);
+   stbiw__wp32(o, x);
+   stbiw__wp32(o, y);
+   *o++ = 8;
+   *o++ = STBIW_UCHAR(ctype[n]);
+   *o++ = 0;
+   *o++ = 0;
+   *o++ = 0;
+   stbiw__png_stream_chunk(ps, "IHDR", ihdr, 13);
+
+   {
+      unsigned char *out = ps->out;
+      unsigned int bitbuf = 0;
+      int bitcount = 0;
+      stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+      stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
+      stbiw__zlib_add(1,1);  // BFINAL = 1, the whole image is one block
+      stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
+      ps->out = out;
+      ps->bitbuf = bitbuf;
+      ps->bitcount = bitcount;
+   }
+   return ps;
+}
+
+STBIWDEF int stbi_write_png_stream_row(stbi_png_stream *ps, const void *row)
+{
+   int stride = ps->x * ps->n, len = stride + 1;
+   unsigned char *z;
+   unsigned char *filt;
+
+   if (ps->error || ps->row >= ps->y)
+      return 0;
+   // rows alternate between the two halves, the previous one is always at z-signed_stride
+   z = ps->rows + (ps->row & 1) * stride;
+   memcpy(z, row, stride);
+
+   // slide the window once the new row wouldn't fit, keeping 32K of history
+   if (ps->win_len + len > ps->win_cap) {
+      int drop = ps->zpos - ps->win_base - 32768;
+      STBIW_ASSERT(drop > 0);
+      STBIW_MEMMOVE(ps->win, ps->win + drop, ps->win_len - drop);
+      ps->win_len -= drop;
+      ps->win_base += drop;
+   }
+   filt = ps->win + ps->win_len;
+   filt[0] = (unsigned char) stbiw__filter_png_row(z, (ps->row & 1) ? stride : -stride, ps->x, ps->row, ps->n,
+                                                   stbi_write_force_png_filter < 5 ? stbi_write_force_png_filter : -1, ps->line_buffer);
+   memcpy(filt+1, ps->line_buffer, stride);
+   ps->win_len += len;
+   ps->adler = stbiw__adler32(ps->adler, filt, len);
+   ++ps->row;
+
+   stbiw__png_stream_deflate(ps, 0);
+   stbiw__png_stream_flush(ps, 0);
+   return 1;
+}
+
+STBIWDEF int stbi_write_png_stream_end(stbi_png_stream *ps)
+{
+   int ok, i;
+   if (!ps) return 0;
+   ok = !ps->error && ps->row == ps->y;
+   if (ok) {
+      stbiw__png_stream_deflate(ps, 1);
+      stbiw__sbpush(ps->out, STBIW_UCHAR(ps->adler >> 24));
+      stbiw__sbpush(ps->out, STBIW_UCHAR(ps->adler >> 16));
+      stbiw__sbpush(ps->out, STBIW_UCHAR(ps->adler >> 8));
+      stbiw__sbpush(ps->out, STBIW_UCHAR(ps->adler));
+      stbiw__png_stream_flush(ps, 1);
+      stbiw__png_stream_chunk(ps, "IEND", NULL, 0);
+   }
+   if (ps->hash_table) {
+      for (i=0; i < stbiw__ZHASH; ++i)
+         (void) stbiw__sbfree(ps->hash_table[i]);
+      STBIW_FREE(ps->hash_table);
+   }
+   (void) stbiw__sbfree(ps->out);
+   STBIW_FREE(ps->chunk);
+   STBIW_FREE(ps->win);
+   STBIW_FREE(ps->line_buffer);
+   STBIW_FREE(ps->rows);
+   STBIW_FREE(ps);
+   return ok;
+}
+#endif // STBIW_ZLIB_COMPRESS
+
 
 /* ***************************************************************************
  *
@@ -1254,11 +2010,12 @@ static void stbiw__jpg_writeBits(stbi__write_context *s, int *bitBufP, int *bitC
    int bitBuf = *bitBufP, bitCnt = *bitCntP;
    bitCnt += bs[1];
    bitBuf |= bs[0] << (24 - bitCnt);
+   // bytes go through the context's small buffer instead of one callback each
    while(bitCnt >= 8) {
       unsigned char c = (bitBuf >> 16) & 255;
-      stbiw__putc(s, c);
+      stbiw__write1(s, c);
       if(c == 255) {
-         stbiw__putc(s, 0);
+         stbiw__write1(s, 0);
       }
       bitBuf <<= 8;
       bitCnt -= 8;
@@ -1325,11 +2082,9 @@ static void stbiw__jpg_calcBits(int val, unsigned short bits[2]) {
    bits[0] = val & ((1<<bits[1])-1);
 }
 
-static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt, float *CDU, int du_stride, float *fdtbl, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
-   const unsigned short EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
-   const unsigned short M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
-   int dataOff, i, j, n, diff, end0pos, x, y;
-   int DU[64];
+// forward DCT, quantize and zigzag one 8x8 block of level shifted samples
+static void stbiw__jpg_fdct_quant(float *CDU, int du_stride, float *fdtbl, int DU[64]) {
+   int dataOff, i, j, n, x, y;
 
    // DCT rows
    for(dataOff=0, n=du_stride*8; dataOff<n; dataOff+=du_stride) {
@@ -1351,6 +2106,131 @@ static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt
          DU[stbiw__jpg_ZigZag[j]] = (int)(v < 0 ? v - 0.5f : v + 0.5f);
       }
    }
+}
+
+#ifdef STBIW__X86_SIMD
+// fixed point version of stbiw__jpg_DCT on eight rows of int16 at once. The
+// multipliers are Q15 fractions applied with the rounding pmulhrsw (1.30656 is
+// done as x + 0.30656x). Samples enter scaled by 4 and the first pass output is
+// halved, which keeps every intermediate under 26000 for 8 bit input. Both
+// callers produce samples in [-128, 127]; anything outside is saturated to that
+// on entry, since a larger sample would wrap the int16 lanes.
+#define stbiw__jpg_mulc(x,k)  _mm_mulhrs_epi16(x, _mm_set1_epi16(k))
+#define stbiw__jpg_c4(x)      stbiw__jpg_mulc(x, 23170)                     // 0.707106781
+#define stbiw__jpg_c6(x)      stbiw__jpg_mulc(x, 12540)                     // 0.382683433
+#define stbiw__jpg_c2mc6(x)   stbiw__jpg_mulc(x, 17734)                     // 0.541196100
+#define stbiw__jpg_c2pc6(x)   _mm_add_epi16(x, stbiw__jpg_mulc(x, 10045))   // 1.306562965
+
+__attribute__((target("ssse3")))
+static void stbiw__jpg_DCT_ssse3(__m128i *d) {
+   __m128i tmp0 = _mm_add_epi16(d[0], d[7]);
+   __m128i tmp7 = _mm_sub_epi16(d[0], d[7]);
+   __m128i tmp1 = _mm_add_epi16(d[1], d[6]);
+   __m128i tmp6 = _mm_sub_epi16(d[1], d[6]);
+   __m128i tmp2 = _mm_add_epi16(d[2], d[5]);
+   __m128i tmp5 = _mm_sub_epi16(d[2], d[5]);
+   __m128i tmp3 = _mm_add_epi16(d[3], d[4]);
+   __m128i tmp4 = _mm_sub_epi16(d[3], d[4]);
+   __m128i tmp10, tmp11, tmp12, tmp13, z1, z2, z3, z4, z5, z11, z13;
+
+   // Even part
+   tmp10 = _mm_add_epi16(tmp0, tmp3);
+   tmp13 = _mm_sub_epi16(tmp0, tmp3);
+   tmp11 = _mm_add_epi16(tmp1, tmp2);
+   tmp12 = _mm_sub_epi16(tmp1, tmp2);
+
+   d[0] = _mm_add_epi16(tmp10, tmp11);
+   d[4] = _mm_sub_epi16(tmp10, tmp11);
+
+   z1 = stbiw__jpg_c4(_mm_add_epi16(tmp12, tmp13));
+   d[2] = _mm_add_epi16(tmp13, z1);
+   d[6] = _mm_sub_epi16(tmp13, z1);
+
+   // Odd part
+   tmp10 = _mm_add_epi16(tmp4, tmp5);
+   tmp11 = _mm_add_epi16(tmp5, tmp6);
+   tmp12 = _mm_add_epi16(tmp6, tmp7);
+
+   z5 = stbiw__jpg_c6(_mm_sub_epi16(tmp10, tmp12));
+   z2 = _mm_add_epi16(stbiw__jpg_c2mc6(tmp10), z5);
+   z4 = _mm_add_epi16(stbiw__jpg_c2pc6(tmp12), z5);
+   z3 = stbiw__jpg_c4(tmp11);
+
+   z11 = _mm_add_epi16(tmp7, z3);
+   z13 = _mm_sub_epi16(tmp7, z3);
+
+   d[5] = _mm_add_epi16(z13, z2);
+   d[3] = _mm_sub_epi16(z13, z2);
+   d[1] = _mm_add_epi16(z11, z4);
+   d[7] = _mm_sub_epi16(z11, z4);
+}
+
+__attribute__((target("ssse3")))
+static void stbiw__jpg_transpose_ssse3(__m128i *r) {
+   __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]), a1 = _mm_unpackhi_epi16(r[0], r[1]);
+   __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]), a3 = _mm_unpackhi_epi16(r[2], r[3]);
+   __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]), a5 = _mm_unpackhi_epi16(r[4], r[5]);
+   __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]), a7 = _mm_unpackhi_epi16(r[6], r[7]);
+   __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+   __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+   __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+   __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+   r[0] = _mm_unpacklo_epi64(b0, b4); r[1] = _mm_unpackhi_epi64(b0, b4);
+   r[2] = _mm_unpacklo_epi64(b1, b5); r[3] = _mm_unpackhi_epi64(b1, b5);
+   r[4] = _mm_unpacklo_epi64(b2, b6); r[5] = _mm_unpackhi_epi64(b2, b6);
+   r[6] = _mm_unpacklo_epi64(b3, b7); r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+__attribute__((target("ssse3")))
+static void stbiw__jpg_fdct_quant_ssse3(float *CDU, int du_stride, float *fdtbl, int DU[64]) {
+   const __m128i one = _mm_set1_epi16(1);
+   const __m128i lowest = _mm_set1_epi16(-128), highest = _mm_set1_epi16(127);
+   const __m128 half = _mm_set1_ps(0.5f);
+   __m128i r[8];
+   int row, j;
+
+   for(row = 0; row < 8; ++row) {
+      const float *p = CDU + row*du_stride;
+      r[row] = _mm_packs_epi32(_mm_cvtps_epi32(_mm_loadu_ps(p)), _mm_cvtps_epi32(_mm_loadu_ps(p+4)));
+      r[row] = _mm_min_epi16(_mm_max_epi16(r[row], lowest), highest);
+      r[row] = _mm_slli_epi16(r[row], 2);
+   }
+   // columns, then rows, then back to row major
+   stbiw__jpg_DCT_ssse3(r);
+   for(row = 0; row < 8; ++row)
+      r[row] = _mm_srai_epi16(_mm_add_epi16(r[row], one), 1);
+   stbiw__jpg_transpose_ssse3(r);
+   stbiw__jpg_DCT_ssse3(r);
+   stbiw__jpg_transpose_ssse3(r);
+
+   // Quantize/descale with the same float tables as the scalar path, 8 at a
+   // time; the extra 0.5 removes the factor 2 left over from the input scaling
+   for(row = 0; row < 8; ++row) {
+      int q[8];
+      __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(r[row], r[row]), 16);
+      __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(r[row], r[row]), 16);
+      lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(lo), half), _mm_loadu_ps(fdtbl + row*8)));
+      hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(hi), half), _mm_loadu_ps(fdtbl + row*8 + 4)));
+      _mm_storeu_si128((__m128i *) q, lo);
+      _mm_storeu_si128((__m128i *) (q+4), hi);
+      for(j = 0; j < 8; ++j)
+         DU[stbiw__jpg_ZigZag[row*8+j]] = q[j];
+   }
+}
+#endif
+
+static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt, float *CDU, int du_stride, float *fdtbl, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
+   const unsigned short EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
+   const unsigned short M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
+   int i, diff, end0pos;
+   int DU[64];
+
+#ifdef STBIW__X86_SIMD
+   if(s->simd)
+      stbiw__jpg_fdct_quant_ssse3(CDU, du_stride, fdtbl, DU);
+   else
+#endif
+   stbiw__jpg_fdct_quant(CDU, du_stride, fdtbl, DU);
 
    // Encode DC
    diff = DU[0] - DC;
@@ -1395,7 +2275,79 @@ static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt
    return DU[0];
 }
 
-static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, int comp, const void* data, int quality) {
+// Huffman tables
+static const unsigned short stbiw__jpg_YDC_HT[256][2] = { {0,2},{2,3},{3,3},{4,3},{5,3},{6,3},{14,4},{30,5},{62,6},{126,7},{254,8},{510,9}};
+static const unsigned short stbiw__jpg_UVDC_HT[256][2] = { {0,2},{1,2},{2,2},{6,3},{14,4},{30,5},{62,6},{126,7},{254,8},{510,9},{1022,10},{2046,11}};
+static const unsigned short stbiw__jpg_YAC_HT[256][2] = {
+   {10,4},{0,2},{1,2},{4,3},{11,4},{26,5},{120,7},{248,8},{1014,10},{65410,16},{65411,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {12,4},{27,5},{121,7},{502,9},{2038,11},{65412,16},{65413,16},{65414,16},{65415,16},{65416,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {28,5},{249,8},{1015,10},{4084,12},{65417,16},{65418,16},{65419,16},{65420,16},{65421,16},{65422,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {58,6},{503,9},{4085,12},{65423,16},{65424,16},{65425,16},{65426,16},{65427,16},{65428,16},{65429,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {59,6},{1016,10},{65430,16},{65431,16},{65432,16},{65433,16},{65434,16},{65435,16},{65436,16},{65437,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {122,7},{2039,11},{65438,16},{65439,16},{65440,16},{65441,16},{65442,16},{65443,16},{65444,16},{65445,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {123,7},{4086,12},{65446,16},{65447,16},{65448,16},{65449,16},{65450,16},{65451,16},{65452,16},{65453,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {250,8},{4087,12},{65454,16},{65455,16},{65456,16},{65457,16},{65458,16},{65459,16},{65460,16},{65461,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {504,9},{32704,15},{65462,16},{65463,16},{65464,16},{65465,16},{65466,16},{65467,16},{65468,16},{65469,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {505,9},{65470,16},{65471,16},{65472,16},{65473,16},{65474,16},{65475,16},{65476,16},{65477,16},{65478,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {506,9},{65479,16},{65480,16},{65481,16},{65482,16},{65483,16},{65484,16},{65485,16},{65486,16},{65487,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {1017,10},{65488,16},{65489,16},{65490,16},{65491,16},{65492,16},{65493,16},{65494,16},{65495,16},{65496,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {1018,10},{65497,16},{65498,16},{65499,16},{65500,16},{65501,16},{65502,16},{65503,16},{65504,16},{65505,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {2040,11},{65506,16},{65507,16},{65508,16},{65509,16},{65510,16},{65511,16},{65512,16},{65513,16},{65514,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {65515,16},{65516,16},{65517,16},{65518,16},{65519,16},{65520,16},{65521,16},{65522,16},{65523,16},{65524,16},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {2041,11},{65525,16},{65526,16},{65527,16},{65528,16},{65529,16},{65530,16},{65531,16},{65532,16},{65533,16},{65534,16},{0,0},{0,0},{0,0},{0,0},{0,0}
+};
+static const unsigned short stbiw__jpg_UVAC_HT[256][2] = {
+   {0,2},{1,2},{4,3},{10,4},{24,5},{25,5},{56,6},{120,7},{500,9},{1014,10},{4084,12},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {11,4},{57,6},{246,8},{501,9},{2038,11},{4085,12},{65416,16},{65417,16},{65418,16},{65419,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {26,5},{247,8},{1015,10},{4086,12},{32706,15},{65420,16},{65421,16},{65422,16},{65423,16},{65424,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {27,5},{248,8},{1016,10},{4087,12},{65425,16},{65426,16},{65427,16},{65428,16},{65429,16},{65430,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {58,6},{502,9},{65431,16},{65432,16},{65433,16},{65434,16},{65435,16},{65436,16},{65437,16},{65438,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {59,6},{1017,10},{65439,16},{65440,16},{65441,16},{65442,16},{65443,16},{65444,16},{65445,16},{65446,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {121,7},{2039,11},{65447,16},{65448,16},{65449,16},{65450,16},{65451,16},{65452,16},{65453,16},{65454,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {122,7},{2040,11},{65455,16},{65456,16},{65457,16},{65458,16},{65459,16},{65460,16},{65461,16},{65462,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {249,8},{65463,16},{65464,16},{65465,16},{65466,16},{65467,16},{65468,16},{65469,16},{65470,16},{65471,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {503,9},{65472,16},{65473,16},{65474,16},{65475,16},{65476,16},{65477,16},{65478,16},{65479,16},{65480,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {504,9},{65481,16},{65482,16},{65483,16},{65484,16},{65485,16},{65486,16},{65487,16},{65488,16},{65489,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {505,9},{65490,16},{65491,16},{65492,16},{65493,16},{65494,16},{65495,16},{65496,16},{65497,16},{65498,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {506,9},{65499,16},{65500,16},{65501,16},{65502,16},{65503,16},{65504,16},{65505,16},{65506,16},{65507,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {2041,11},{65508,16},{65509,16},{65510,16},{65511,16},{65512,16},{65513,16},{65514,16},{65515,16},{65516,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {16352,14},{65517,16},{65518,16},{65519,16},{65520,16},{65521,16},{65522,16},{65523,16},{65524,16},{65525,16},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {1018,10},{32707,15},{65526,16},{65527,16},{65528,16},{65529,16},{65530,16},{65531,16},{65532,16},{65533,16},{65534,16},{0,0},{0,0},{0,0},{0,0},{0,0}
+};
+
+// builds the zigzagged quantization tables written to the header and the
+// float descale tables used by stbiw__jpg_processDU; quality is 1..100
+static void stbiw__jpg_quant_tables(int quality, unsigned char YTable[64], unsigned char UVTable[64], float fdtbl_Y[64], float fdtbl_UV[64]) {
+   static const int YQT[] = {16,11,10,16,24,40,51,61,12,12,14,19,26,58,60,55,14,13,16,24,40,57,69,56,14,17,22,29,51,87,80,62,18,22,
+                             37,56,68,109,103,77,24,35,55,64,81,104,113,92,49,64,78,87,103,121,120,101,72,92,95,98,112,100,103,99};
+   static const int UVQT[] = {17,18,24,47,99,99,99,99,18,21,26,66,99,99,99,99,24,26,56,99,99,99,99,99,47,66,99,99,99,99,99,99,
+                              99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99};
+   static const float aasf[] = { 1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
+                                 1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f };
+
+   int row, col, i, k;
+
+   quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+   for(i = 0; i < 64; ++i) {
+      int uvti, yti = (YQT[i]*quality+50)/100;
+      YTable[stbiw__jpg_ZigZag[i]] = (unsigned char) (yti < 1 ? 1 : yti > 255 ? 255 : yti);
+      uvti = (UVQT[i]*quality+50)/100;
+      UVTable[stbiw__jpg_ZigZag[i]] = (unsigned char) (uvti < 1 ? 1 : uvti > 255 ? 255 : uvti);
+   }
+
+   for(row = 0, k = 0; row < 8; ++row) {
+      for(col = 0; col < 8; ++col, ++k) {
+         fdtbl_Y[k]  = 1 / (YTable [stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
+         fdtbl_UV[k] = 1 / (UVTable[stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
+      }
+   }
+}
+
+// y_sampling is the luma sampling factor byte of the frame header:
+// 0x11 for 4:4:4, 0x21 for 4:2:2 (H2V1) and 0x22 for 4:2:0 (H2V2).
+// A nonzero restart_interval (in MCUs) adds a DRI segment.
+static void stbiw__jpg_write_headers(stbi__write_context *s, int width, int height, int y_sampling, int restart_interval, unsigned char YTable[64], unsigned char UVTable[64]) {
    // Constants that don't pollute global namespace
    static const unsigned char std_dc_luminance_nrcodes[] = {0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
    static const unsigned char std_dc_luminance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
@@ -1421,189 +2373,319 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
       0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
       0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
    };
-   // Huffman tables
-   static const unsigned short YDC_HT[256][2] = { {0,2},{2,3},{3,3},{4,3},{5,3},{6,3},{14,4},{30,5},{62,6},{126,7},{254,8},{510,9}};
-   static const unsigned short UVDC_HT[256][2] = { {0,2},{1,2},{2,2},{6,3},{14,4},{30,5},{62,6},{126,7},{254,8},{510,9},{1022,10},{2046,11}};
-   static const unsigned short YAC_HT[256][2] = {
-      {10,4},{0,2},{1,2},{4,3},{11,4},{26,5},{120,7},{248,8},{1014,10},{65410,16},{65411,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {12,4},{27,5},{121,7},{502,9},{2038,11},{65412,16},{65413,16},{65414,16},{65415,16},{65416,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {28,5},{249,8},{1015,10},{4084,12},{65417,16},{65418,16},{65419,16},{65420,16},{65421,16},{65422,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {58,6},{503,9},{4085,12},{65423,16},{65424,16},{65425,16},{65426,16},{65427,16},{65428,16},{65429,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {59,6},{1016,10},{65430,16},{65431,16},{65432,16},{65433,16},{65434,16},{65435,16},{65436,16},{65437,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {122,7},{2039,11},{65438,16},{65439,16},{65440,16},{65441,16},{65442,16},{65443,16},{65444,16},{65445,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {123,7},{4086,12},{65446,16},{65447,16},{65448,16},{65449,16},{65450,16},{65451,16},{65452,16},{65453,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {250,8},{4087,12},{65454,16},{65455,16},{65456,16},{65457,16},{65458,16},{65459,16},{65460,16},{65461,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {504,9},{32704,15},{65462,16},{65463,16},{65464,16},{65465,16},{65466,16},{65467,16},{65468,16},{65469,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {505,9},{65470,16},{65471,16},{65472,16},{65473,16},{65474,16},{65475,16},{65476,16},{65477,16},{65478,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {506,9},{65479,16},{65480,16},{65481,16},{65482,16},{65483,16},{65484,16},{65485,16},{65486,16},{65487,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {1017,10},{65488,16},{65489,16},{65490,16},{65491,16},{65492,16},{65493,16},{65494,16},{65495,16},{65496,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {1018,10},{65497,16},{65498,16},{65499,16},{65500,16},{65501,16},{65502,16},{65503,16},{65504,16},{65505,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {2040,11},{65506,16},{65507,16},{65508,16},{65509,16},{65510,16},{65511,16},{65512,16},{65513,16},{65514,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {65515,16},{65516,16},{65517,16},{65518,16},{65519,16},{65520,16},{65521,16},{65522,16},{65523,16},{65524,16},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {2041,11},{65525,16},{65526,16},{65527,16},{65528,16},{65529,16},{65530,16},{65531,16},{65532,16},{65533,16},{65534,16},{0,0},{0,0},{0,0},{0,0},{0,0}
-   };
-   static const unsigned short UVAC_HT[256][2] = {
-      {0,2},{1,2},{4,3},{10,4},{24,5},{25,5},{56,6},{120,7},{500,9},{1014,10},{4084,12},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {11,4},{57,6},{246,8},{501,9},{2038,11},{4085,12},{65416,16},{65417,16},{65418,16},{65419,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {26,5},{247,8},{1015,10},{4086,12},{32706,15},{65420,16},{65421,16},{65422,16},{65423,16},{65424,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {27,5},{248,8},{1016,10},{4087,12},{65425,16},{65426,16},{65427,16},{65428,16},{65429,16},{65430,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {58,6},{502,9},{65431,16},{65432,16},{65433,16},{65434,16},{65435,16},{65436,16},{65437,16},{65438,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {59,6},{1017,10},{65439,16},{65440,16},{65441,16},{65442,16},{65443,16},{65444,16},{65445,16},{65446,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {121,7},{2039,11},{65447,16},{65448,16},{65449,16},{65450,16},{65451,16},{65452,16},{65453,16},{65454,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {122,7},{2040,11},{65455,16},{65456,16},{65457,16},{65458,16},{65459,16},{65460,16},{65461,16},{65462,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {249,8},{65463,16},{65464,16},{65465,16},{65466,16},{65467,16},{65468,16},{65469,16},{65470,16},{65471,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {503,9},{65472,16},{65473,16},{65474,16},{65475,16},{65476,16},{65477,16},{65478,16},{65479,16},{65480,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {504,9},{65481,16},{65482,16},{65483,16},{65484,16},{65485,16},{65486,16},{65487,16},{65488,16},{65489,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {505,9},{65490,16},{65491,16},{65492,16},{65493,16},{65494,16},{65495,16},{65496,16},{65497,16},{65498,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {506,9},{65499,16},{65500,16},{65501,16},{65502,16},{65503,16},{65504,16},{65505,16},{65506,16},{65507,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {2041,11},{65508,16},{65509,16},{65510,16},{65511,16},{65512,16},{65513,16},{65514,16},{65515,16},{65516,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {16352,14},{65517,16},{65518,16},{65519,16},{65520,16},{65521,16},{65522,16},{65523,16},{65524,16},{65525,16},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {1018,10},{32707,15},{65526,16},{65527,16},{65528,16},{65529,16},{65530,16},{65531,16},{65532,16},{65533,16},{65534,16},{0,0},{0,0},{0,0},{0,0},{0,0}
-   };
-   static const int YQT[] = {16,11,10,16,24,40,51,61,12,12,14,19,26,58,60,55,14,13,16,24,40,57,69,56,14,17,22,29,51,87,80,62,18,22,
-                             37,56,68,109,103,77,24,35,55,64,81,104,113,92,49,64,78,87,103,121,120,101,72,92,95,98,112,100,103,99};
-   static const int UVQT[] = {17,18,24,47,99,99,99,99,18,21,26,66,99,99,99,99,24,26,56,99,99,99,99,99,47,66,99,99,99,99,99,99,
-                              99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99};
-   static const float aasf[] = { 1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
-                                 1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f };
 
-   int row, col, i, k, subsample;
+   static const unsigned char head0[] = { 0xFF,0xD8,0xFF,0xE0,0,0x10,'J','F','I','F',0,1,1,0,0,1,0,1,0,0,0xFF,0xDB,0,0x84,0 };
+   static const unsigned char head2[] = { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 };
+   const unsigned char head1[] = { 0xFF,0xC0,0,0x11,8,(unsigned char)(height>>8),STBIW_UCHAR(height),(unsigned char)(width>>8),STBIW_UCHAR(width),
+                                   3,1,(unsigned char)y_sampling,0,2,0x11,1,3,0x11,1,0xFF,0xC4,0x01,0xA2,0 };
+   s->func(s->context, (void*)head0, sizeof(head0));
+   s->func(s->context, (void*)YTable, 64);
+   stbiw__putc(s, 1);
+   s->func(s->context, UVTable, 64);
+   s->func(s->context, (void*)head1, sizeof(head1));
+   s->func(s->context, (void*)(std_dc_luminance_nrcodes+1), sizeof(std_dc_luminance_nrcodes)-1);
+   s->func(s->context, (void*)std_dc_luminance_values, sizeof(std_dc_luminance_values));
+   stbiw__putc(s, 0x10); // HTYACinfo
+   s->func(s->context, (void*)(std_ac_luminance_nrcodes+1), sizeof(std_ac_luminance_nrcodes)-1);
+   s->func(s->context, (void*)std_ac_luminance_values, sizeof(std_ac_luminance_values));
+   stbiw__putc(s, 1); // HTUDCinfo
+   s->func(s->context, (void*)(std_dc_chrominance_nrcodes+1), sizeof(std_dc_chrominance_nrcodes)-1);
+   s->func(s->context, (void*)std_dc_chrominance_values, sizeof(std_dc_chrominance_values));
+   stbiw__putc(s, 0x11); // HTUACinfo
+   s->func(s->context, (void*)(std_ac_chrominance_nrcodes+1), sizeof(std_ac_chrominance_nrcodes)-1);
+   s->func(s->context, (void*)std_ac_chrominance_values, sizeof(std_ac_chrominance_values));
+   if (restart_interval) {
+      const unsigned char dri[] = { 0xFF,0xDD,0,4,STBIW_UCHAR(restart_interval>>8),STBIW_UCHAR(restart_interval) };
+      s->func(s->context, (void*)dri, sizeof(dri));
+   }
+   s->func(s->context, (void*)head2, sizeof(head2));
+}
+
+// everything the MCU loops read; shared by all restart intervals of an image
+typedef struct
+{
+   const unsigned char *data;
+   int width, height, comp, stride;
+   int yuyv;        // data is packed YCbCr 4:2:2 instead of 'comp' channel pixels
+   int subsample;   // chroma is 2x2 (4:2:0) subsampled
+   int mcu_w, mcu_h;
    float fdtbl_Y[64], fdtbl_UV[64];
-   unsigned char YTable[64], UVTable[64];
+} stbiw__jpg_image;
+
+// interleaved Y/YA/RGB/RGBA pixels, converted to YCbCr per MCU
+static void stbiw__jpg_mcu_rgb(stbi__write_context *s, const stbiw__jpg_image *im, int x, int y, int *bitBuf, int *bitCnt, int *DCY, int *DCU, int *DCV) {
+   int width = im->width, height = im->height, comp = im->comp;
+   // comp == 2 is grey+alpha (alpha is ignored)
+   int ofsG = comp > 2 ? 1 : 0, ofsB = comp > 2 ? 2 : 0;
+   const unsigned char *dataR = im->data;
+   const unsigned char *dataG = dataR + ofsG;
+   const unsigned char *dataB = dataR + ofsB;
+   int row, col, pos;
+   if(im->subsample) {
+      float Y[256], U[256], V[256];
+      for(row = y, pos = 0; row < y+16; ++row) {
+         // row >= height => use last input row
+         int clamped_row = (row < height) ? row : height - 1;
+         int base_p = (stbi__flip_vertically_on_write ? (height-1-clamped_row) : clamped_row)*width*comp;
+         for(col = x; col < x+16; ++col, ++pos) {
+            // if col >= width => use pixel from last input column
+            int p = base_p + ((col < width) ? col : (width-1))*comp;
+            float r = dataR[p], g = dataG[p], b = dataB[p];
+            Y[pos]= +0.29900f*r + 0.58700f*g + 0.11400f*b - 128;
+            U[pos]= -0.16874f*r - 0.33126f*g + 0.50000f*b;
+            V[pos]= +0.50000f*r - 0.41869f*g - 0.08131f*b;
+         }
+      }
+      *DCY = stbiw__jpg_processDU(s, bitBuf, bitCnt, Y+0,   16, (float *) im->fdtbl_Y, *DCY, stbiw__jpg_YDC_HT, stbiw__jpg_YAC_HT);
+      *DCY = stbiw__jpg_processDU(s, bitBuf, bitCnt, Y+8,   16, (float *) im->fdtbl_Y, *DCY, stbiw__jpg_YDC_HT, stbiw__jpg_YAC_HT);
+      *DCY = stbiw__jpg_processDU(s, bitBuf, bitCnt, Y+128, 16, (float *) im->fdtbl_Y, *DCY, stbiw__jpg_YDC_HT, stbiw__jpg_YAC_HT);
+      *DCY = stbiw__jpg_processDU(s, bitBuf, bitCnt, Y+136, 16, (float *) im->fdtbl_Y, *DCY, stbiw__jpg_YDC_HT, stbiw__jpg_YAC_HT);
+
+      // subsample U,V
+      {
+         float subU[64], subV[64];
+         int yy, xx;
+         for(yy = 0, pos = 0; yy < 8; ++yy) {
+            for(xx = 0; xx < 8; ++xx, ++pos) {
+               int j = yy*32+xx*2;
+               subU[pos] = (U[j+0] + U[j+1] + U[j+16] + U[j+17]) * 0.25f;
+               subV[pos] = (V[j+0] + V[j+1] + V[j+16] + V[j+17]) * 0.25f;
+            }
+         }
+         *DCU = stbiw__jpg_processDU(s, bitBuf, bitCnt, subU, 8, (float *) im->fdtbl_UV, *DCU, stbiw__jpg_UVDC_HT, stbiw__jpg_UVAC_HT);
+         *DCV = stbiw__jpg_processDU(s, bitBuf, bitCnt, subV, 8, (float *) im->fdtbl_UV, *DCV, stbiw__jpg_UVDC_HT, stbiw__jpg_UVAC_HT);
+      }
+   } else {
+      float Y[64], U[64], V[64];
+      for(row = y, pos = 0; row < y+8; ++row) {
+         // row >= height => use last input row
+         int clamped_row = (row < height) ? row : height - 1;
+         int base_p = (stbi__flip_vertically_on_write ? (height-1-clamped_row) : clamped_row)*width*comp;
+         for(col = x; col < x+8; ++col, ++pos) {
+            // if col >= width => use pixel from last input column
+            int p = base_p + ((col < width) ? col : (width-1))*comp;
+            float r = dataR[p], g = dataG[p], b = dataB[p];
+            Y[pos]= +0.29900f*r + 0.58700f*g + 0.11400f*b - 128;
+            U[pos]= -0.16874f*r - 0.33126f*g + 0.50000f*b;
+            V[pos]= +0.50000f*r - 0.41869f*g - 0.08131f*b;
+         }
+      }
 
-   if(!data || !width || !height || comp > 4 || comp < 1) {
-      return 0;
+      *DCY = stbiw__jpg_processDU(s, bitBuf, bitCnt, Y, 8, (float *) im->fdtbl_Y,  *DCY, stbiw__jpg_YDC_HT, stbiw__jpg_YAC_HT);
+      *DCU = stbiw__jpg_processDU(s, bitBuf, bitCnt, U, 8, (float *) im->fdtbl_UV, *DCU, stbiw__jpg_UVDC_HT, stbiw__jpg_UVAC_HT);
+      *DCV = stbiw__jpg_processDU(s, bitBuf, bitCnt, V, 8, (float *) im->fdtbl_UV, *DCV, stbiw__jpg_UVDC_HT, stbiw__jpg_UVAC_HT);
    }
+}
 
-   quality = quality ? quality : 90;
-   subsample = quality <= 90 ? 1 : 0;
-   quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
-   quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
+// video range bytes outside 16..235 (16..240 for chroma) expand past the
+// +-128 the DCT and Huffman tables are sized for, so they are clamped
+static float stbiw__jpg_clamp128(float v) {
+   return v < -128.0f ? -128.0f : v > 127.0f ? 127.0f : v;
+}
 
-   for(i = 0; i < 64; ++i) {
-      int uvti, yti = (YQT[i]*quality+50)/100;
-      YTable[stbiw__jpg_ZigZag[i]] = (unsigned char) (yti < 1 ? 1 : yti > 255 ? 255 : yti);
-      uvti = (UVQT[i]*quality+50)/100;
-      UVTable[stbiw__jpg_ZigZag[i]] = (unsigned char) (uvti < 1 ? 1 : uvti > 255 ? 255 : uvti);
+// packed Y0 Cb Y1 Cr, taken as BT.601 video range and expanded to the full
+// range JFIF expects; chroma is used as is (4:2:2) or vertically averaged (4:2:0)
+static void stbiw__jpg_mcu_yuyv(stbi__write_context *s, const stbiw__jpg_image *im, int x, int y, int *bitBuf, int *bitCnt, int *DCY, int *DCU, int *DCV) {
+   const float yscale = 255.0f / 219.0f, cscale = 255.0f / 224.0f;
+   int width = im->width, height = im->height;
+   float Y[256], U[128], V[128];
+   int row, col, pos;
+   for(row = y, pos = 0; row < y+im->mcu_h; ++row) {
+      // row >= height => use last input row
+      int clamped_row = (row < height) ? row : height - 1;
+      const unsigned char *line = im->data + (stbi__flip_vertically_on_write ? (height-1-clamped_row) : clamped_row)*im->stride;
+      for(col = x; col < x+16; ++col, ++pos) {
+         // if col >= width => use pixel from last input column
+         int c = (col < width) ? col : (width-1);
+         const unsigned char *p = line + (c>>1)*4;
+         Y[pos] = stbiw__jpg_clamp128((p[(c&1)*2] - 16) * yscale - 128);
+         if (!(col & 1)) {
+            U[pos>>1] = stbiw__jpg_clamp128((p[1] - 128) * cscale);
+            V[pos>>1] = stbiw__jpg_clamp128((p[3] - 128) * cscale);
+         }
+      }
    }
+   *DCY = stbiw__jpg_processDU(s, bitBuf, bitCnt, Y+0,   16, (float *) im->fdtbl_Y, *DCY, stbiw__jpg_YDC_HT, stbiw__jpg_YAC_HT);
+   *DCY = stbiw__jpg_processDU(s, bitBuf, bitCnt, Y+8,   16, (float *) im->fdtbl_Y, *DCY, stbiw__jpg_YDC_HT, stbiw__jpg_YAC_HT);
+   if(im->subsample) {
+      float subU[64], subV[64];
+      int j;
+      *DCY = stbiw__jpg_processDU(s, bitBuf, bitCnt, Y+128, 16, (float *) im->fdtbl_Y, *DCY, stbiw__jpg_YDC_HT, stbiw__jpg_YAC_HT);
+      *DCY = stbiw__jpg_processDU(s, bitBuf, bitCnt, Y+136, 16, (float *) im->fdtbl_Y, *DCY, stbiw__jpg_YDC_HT, stbiw__jpg_YAC_HT);
+      for(pos = 0; pos < 64; ++pos) {
+         j = (pos>>3)*16 + (pos&7);
+         subU[pos] = (U[j] + U[j+8]) * 0.5f;
+         subV[pos] = (V[j] + V[j+8]) * 0.5f;
+      }
+      *DCU = stbiw__jpg_processDU(s, bitBuf, bitCnt, subU, 8, (float *) im->fdtbl_UV, *DCU, stbiw__jpg_UVDC_HT, stbiw__jpg_UVAC_HT);
+      *DCV = stbiw__jpg_processDU(s, bitBuf, bitCnt, subV, 8, (float *) im->fdtbl_UV, *DCV, stbiw__jpg_UVDC_HT, stbiw__jpg_UVAC_HT);
+   } else {
+      *DCU = stbiw__jpg_processDU(s, bitBuf, bitCnt, U, 8, (float *) im->fdtbl_UV, *DCU, stbiw__jpg_UVDC_HT, stbiw__jpg_UVAC_HT);
+      *DCV = stbiw__jpg_processDU(s, bitBuf, bitCnt, V, 8, (float *) im->fdtbl_UV, *DCV, stbiw__jpg_UVDC_HT, stbiw__jpg_UVAC_HT);
+   }
+}
 
-   for(row = 0, k = 0; row < 8; ++row) {
-      for(col = 0; col < 8; ++col, ++k) {
-         fdtbl_Y[k]  = 1 / (YTable [stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
-         fdtbl_UV[k] = 1 / (UVTable[stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
+// entropy codes the MCU rows starting at pixel rows y0 up to y1 as one
+// self-contained run: DC predictors start at 0 and the end is byte aligned,
+// which is exactly what a restart interval needs
+static void stbiw__jpg_encode_rows(stbi__write_context *s, const stbiw__jpg_image *im, int y0, int y1) {
+   static const unsigned short fillBits[] = {0x7F, 7};
+   int DCY=0, DCU=0, DCV=0;
+   int bitBuf=0, bitCnt=0;
+   int x, y;
+   for(y = y0; y < y1; y += im->mcu_h) {
+      for(x = 0; x < im->width; x += im->mcu_w) {
+         if(im->yuyv)
+            stbiw__jpg_mcu_yuyv(s, im, x, y, &bitBuf, &bitCnt, &DCY, &DCU, &DCV);
+         else
+            stbiw__jpg_mcu_rgb(s, im, x, y, &bitBuf, &bitCnt, &DCY, &DCU, &DCV);
       }
    }
+   // Do the bit alignment of the EOI/RSTn marker
+   stbiw__jpg_writeBits(s, &bitBuf, &bitCnt, fillBits);
+   stbiw__write_flush(s);
+}
 
-   // Write Headers
-   {
-      static const unsigned char head0[] = { 0xFF,0xD8,0xFF,0xE0,0,0x10,'J','F','I','F',0,1,1,0,0,1,0,1,0,0,0xFF,0xDB,0,0x84,0 };
-      static const unsigned char head2[] = { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 };
-      const unsigned char head1[] = { 0xFF,0xC0,0,0x11,8,(unsigned char)(height>>8),STBIW_UCHAR(height),(unsigned char)(width>>8),STBIW_UCHAR(width),
-                                      3,1,(unsigned char)(subsample?0x22:0x11),0,2,0x11,1,3,0x11,1,0xFF,0xC4,0x01,0xA2,0 };
-      s->func(s->context, (void*)head0, sizeof(head0));
-      s->func(s->context, (void*)YTable, sizeof(YTable));
-      stbiw__putc(s, 1);
-      s->func(s->context, UVTable, sizeof(UVTable));
-      s->func(s->context, (void*)head1, sizeof(head1));
-      s->func(s->context, (void*)(std_dc_luminance_nrcodes+1), sizeof(std_dc_luminance_nrcodes)-1);
-      s->func(s->context, (void*)std_dc_luminance_values, sizeof(std_dc_luminance_values));
-      stbiw__putc(s, 0x10); // HTYACinfo
-      s->func(s->context, (void*)(std_ac_luminance_nrcodes+1), sizeof(std_ac_luminance_nrcodes)-1);
-      s->func(s->context, (void*)std_ac_luminance_values, sizeof(std_ac_luminance_values));
-      stbiw__putc(s, 1); // HTUDCinfo
-      s->func(s->context, (void*)(std_dc_chrominance_nrcodes+1), sizeof(std_dc_chrominance_nrcodes)-1);
-      s->func(s->context, (void*)std_dc_chrominance_values, sizeof(std_dc_chrominance_values));
-      stbiw__putc(s, 0x11); // HTUACinfo
-      s->func(s->context, (void*)(std_ac_chrominance_nrcodes+1), sizeof(std_ac_chrominance_nrcodes)-1);
-      s->func(s->context, (void*)std_ac_chrominance_values, sizeof(std_ac_chrominance_values));
-      s->func(s->context, (void*)head2, sizeof(head2));
-   }
-
-   // Encode 8x8 macroblocks
-   {
-      static const unsigned short fillBits[] = {0x7F, 7};
-      int DCY=0, DCU=0, DCV=0;
-      int bitBuf=0, bitCnt=0;
-      // comp == 2 is grey+alpha (alpha is ignored)
-      int ofsG = comp > 2 ? 1 : 0, ofsB = comp > 2 ? 2 : 0;
-      const unsigned char *dataR = (const unsigned char *)data;
-      const unsigned char *dataG = dataR + ofsG;
-      const unsigned char *dataB = dataR + ofsB;
-      int x, y, pos;
-      if(subsample) {
-         for(y = 0; y < height; y += 16) {
-            for(x = 0; x < width; x += 16) {
-               float Y[256], U[256], V[256];
-               for(row = y, pos = 0; row < y+16; ++row) {
-                  // row >= height => use last input row
-                  int clamped_row = (row < height) ? row : height - 1;
-                  int base_p = (stbi__flip_vertically_on_write ? (height-1-clamped_row) : clamped_row)*width*comp;
-                  for(col = x; col < x+16; ++col, ++pos) {
-                     // if col >= width => use pixel from last input column
-                     int p = base_p + ((col < width) ? col : (width-1))*comp;
-                     float r = dataR[p], g = dataG[p], b = dataB[p];
-                     Y[pos]= +0.29900f*r + 0.58700f*g + 0.11400f*b - 128;
-                     U[pos]= -0.16874f*r - 0.33126f*g + 0.50000f*b;
-                     V[pos]= +0.50000f*r - 0.41869f*g - 0.08131f*b;
-                  }
-               }
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+0,   16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+8,   16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+128, 16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+136, 16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-
-               // subsample U,V
-               {
-                  float subU[64], subV[64];
-                  int yy, xx;
-                  for(yy = 0, pos = 0; yy < 8; ++yy) {
-                     for(xx = 0; xx < 8; ++xx, ++pos) {
-                        int j = yy*32+xx*2;
-                        subU[pos] = (U[j+0] + U[j+1] + U[j+16] + U[j+17]) * 0.25f;
-                        subV[pos] = (V[j+0] + V[j+1] + V[j+16] + V[j+17]) * 0.25f;
-                     }
-                  }
-                  DCU = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, subU, 8, fdtbl_UV, DCU, UVDC_HT, UVAC_HT);
-                  DCV = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, subV, 8, fdtbl_UV, DCV, UVDC_HT, UVAC_HT);
-               }
-            }
-         }
-      } else {
-         for(y = 0; y < height; y += 8) {
-            for(x = 0; x < width; x += 8) {
-               float Y[64], U[64], V[64];
-               for(row = y, pos = 0; row < y+8; ++row) {
-                  // row >= height => use last input row
-                  int clamped_row = (row < height) ? row : height - 1;
-                  int base_p = (stbi__flip_vertically_on_write ? (height-1-clamped_row) : clamped_row)*width*comp;
-                  for(col = x; col < x+8; ++col, ++pos) {
-                     // if col >= width => use pixel from last input column
-                     int p = base_p + ((col < width) ? col : (width-1))*comp;
-                     float r = dataR[p], g = dataG[p], b = dataB[p];
-                     Y[pos]= +0.29900f*r + 0.58700f*g + 0.11400f*b - 128;
-                     U[pos]= -0.16874f*r - 0.33126f*g + 0.50000f*b;
-                     V[pos]= +0.50000f*r - 0.41869f*g - 0.08131f*b;
-                  }
-               }
+typedef struct
+{
+   unsigned char *data;
+   int len, cap, error;
+} stbiw__jpg_membuf;
 
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y, 8, fdtbl_Y,  DCY, YDC_HT, YAC_HT);
-               DCU = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, U, 8, fdtbl_UV, DCU, UVDC_HT, UVAC_HT);
-               DCV = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, V, 8, fdtbl_UV, DCV, UVDC_HT, UVAC_HT);
-            }
+static void stbiw__jpg_mem_write(void *context, void *data, int size)
+{
+   stbiw__jpg_membuf *m = (stbiw__jpg_membuf *) context;
+   if(m->error) return;
+   if(m->len + size > m->cap) {
+      int cap = m->cap ? m->cap*2 : 4096;
+      unsigned char *p;
+      while(cap < m->len + size) cap *= 2;
+      p = (unsigned char *) STBIW_REALLOC_SIZED(m->data, m->cap, cap);
+      if(!p) { m->error = 1; return; }
+      m->data = p;
+      m->cap = cap;
+   }
+   memcpy(m->data + m->len, data, size);
+   m->len += size;
+}
+
+// writes the scan, the headers are already out; with restart_rows each group
+// of that many MCU rows is coded separately (in parallel under OpenMP) and the
+// pieces are joined with RSTn markers
+static int stbiw__jpg_write_scan(stbi__write_context *s, const stbiw__jpg_image *im, int restart_rows) {
+   stbiw__jpg_membuf *parts;
+   int n, i, ok = 1;
+   int mcu_rows = (im->height + im->mcu_h - 1) / im->mcu_h;
+
+   if(restart_rows <= 0 || mcu_rows <= restart_rows) {
+      stbiw__jpg_encode_rows(s, im, 0, im->height);
+      return 1;
+   }
+
+   n = (mcu_rows + restart_rows - 1) / restart_rows;
+   parts = (stbiw__jpg_membuf *) STBIW_MALLOC(n * sizeof(*parts));
+   if(!parts) return 0;
+   memset(parts, 0, n * sizeof(*parts));
+
+#ifdef _OPENMP
+   #pragma omp parallel for schedule(dynamic)
+#endif
+   for(i = 0; i < n; ++i) {
+      stbi__write_context part = { 0 };
+      int y0 = i * restart_rows * im->mcu_h;
+      int y1 = y0 + restart_rows * im->mcu_h;
+      stbi__start_write_callbacks(&part, stbiw__jpg_mem_write, &parts[i]);
+      part.simd = s->simd;
+      stbiw__jpg_encode_rows(&part, im, y0, y1 < im->height ? y1 : im->height);
+   }
+
+   for(i = 0; i < n; ++i) {
+      if(parts[i].error) ok = 0;
+      if(ok) {
+         s->func(s->context, parts[i].data, parts[i].len);
+         if(i+1 < n) {
+            stbiw__putc(s, 0xFF);
+            stbiw__putc(s, STBIW_UCHAR(0xD0 + (i & 7)));
          }
       }
-
-      // Do the bit alignment of the EOI marker
-      stbiw__jpg_writeBits(s, &bitBuf, &bitCnt, fillBits);
+      STBIW_FREE(parts[i].data);
    }
+   STBIW_FREE(parts);
+   return ok;
+}
+
+// the number of MCU rows per restart interval that will actually be used
+static int stbiw__jpg_restart_rows(const stbiw__jpg_image *im) {
+   int mcus_per_row = (im->width + im->mcu_w - 1) / im->mcu_w;
+   int rows = stbi_write_jpg_restart_rows;
+   if(rows <= 0) return 0;
+   // the DRI interval is counted in MCUs and has to fit 16 bits
+   if(rows * mcus_per_row > 65535) rows = 65535 / mcus_per_row;
+   return rows;
+}
+
+static int stbiw__jpg_encode(stbi__write_context *s, stbiw__jpg_image *im, int quality, int y_sampling) {
+   unsigned char YTable[64], UVTable[64];
+   int restart_rows = stbiw__jpg_restart_rows(im);
+   int mcus_per_row = (im->width + im->mcu_w - 1) / im->mcu_w;
+#ifdef STBIW__X86_SIMD
+   s->simd = stbiw__cpu_has_ssse3();
+#endif
+   stbiw__jpg_quant_tables(quality, YTable, UVTable, im->fdtbl_Y, im->fdtbl_UV);
+   stbiw__jpg_write_headers(s, im->width, im->height, y_sampling, restart_rows * mcus_per_row, YTable, UVTable);
+
+   if(!stbiw__jpg_write_scan(s, im, restart_rows))
+      return 0;
 
    // EOI
    stbiw__putc(s, 0xFF);
    stbiw__putc(s, 0xD9);
-
    return 1;
 }
 
+static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, int comp, const void* data, int quality) {
+   stbiw__jpg_image im;
+
+   if(!data || !width || !height || comp > 4 || comp < 1) {
+      return 0;
+   }
+
+   memset(&im, 0, sizeof(im));
+   quality = quality ? quality : 90;
+   im.subsample = quality <= 90 ? 1 : 0;
+   quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+   im.data = (const unsigned char *) data;
+   im.width = width;
+   im.height = height;
+   im.comp = comp;
+   im.mcu_w = im.mcu_h = im.subsample ? 16 : 8;
+   return stbiw__jpg_encode(s, &im, quality, im.subsample ? 0x22 : 0x11);
+}
+
+// Encodes packed YCbCr 4:2:2 (Y0 Cb Y1 Cr, as V4L2_PIX_FMT_YUYV) without going
+// through RGB. subsample=0 keeps the native 4:2:2 chroma (16x8 MCUs, H2V1),
+// subsample=1 averages vertical chroma pairs down to 4:2:0 (16x16 MCUs, H2V2).
+static int stbi_write_jpg_yuyv_core(stbi__write_context *s, int width, int height, const void* data, int stride, int quality, int subsample) {
+   stbiw__jpg_image im;
+
+   if(!data || width <= 0 || height <= 0) {
+      return 0;
+   }
+
+   memset(&im, 0, sizeof(im));
+   quality = quality ? quality : 90;
+   quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+   im.data = (const unsigned char *) data;
+   im.width = width;
+   im.height = height;
+   im.stride = stride ? stride : width*2;
+   im.yuyv = 1;
+   im.subsample = subsample;
+   im.mcu_w = 16;
+   im.mcu_h = subsample ? 16 : 8;
+   return stbiw__jpg_encode(s, &im, quality, subsample ? 0x22 : 0x21);
+}
+
 STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int quality)
 {
    stbi__write_context s = { 0 };
@@ -1625,6 +2707,26 @@ STBIWDEF int stbi_write_jpg(char const *filename, int x, int y, int comp, const
 }
 #endif
 
+STBIWDEF int stbi_write_jpg_yuyv_to_func(stbi_write_func *func, void *context, int x, int y, const void *data, int stride_in_bytes, int quality, int subsample)
+{
+   stbi__write_context s = { 0 };
+   stbi__start_write_callbacks(&s, func, context);
+   return stbi_write_jpg_yuyv_core(&s, x, y, data, stride_in_bytes, quality, subsample);
+}
+
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int stbi_write_jpg_yuyv(char const *filename, int x, int y, const void *data, int stride_in_bytes, int quality, int subsample)
+{
+   stbi__write_context s = { 0 };
+   if (stbi__start_write_file(&s,filename)) {
+      int r = stbi_write_jpg_yuyv_core(&s, x, y, data, stride_in_bytes, quality, subsample);
+      stbi__end_write_file(&s);
+      return r;
+   } else
+      return 0;
+}
+#endif
+
 #endif // STB_IMAGE_WRITE_IMPLEMENTATION
 
 /* Revision history
@@ -0,0 +1,452 @@
+// Checks what was added to stb_image_write.h: the SIMD paths against the scalar code they
+// replace, restart intervals against the plain JPEG output and the PNG stream against its input.
+// gcc -O2 stbiw_test.c -o stbiw_test -ljpeg -lpng -lm && ./stbiw_test
+#include <stdio.h>           // Standard input/output (printf)
+#include <stdlib.h>          // rand
+#include <string.h>          // memset
+#include <setjmp.h>          // libjpeg error recovery
+#include <jpeglib.h>         // decoding the test JPEGs (libjpeg-turbo)
+#include <png.h>             // decoding the test PNGs (libpng)
+#include <math.h>            // PSNR
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "./stb_image_write.h"
+#define TEST_BUFFER (1 << 18)
+#define TEST_RUNS 4000
+#define TEST_WIDTH 64
+#define TEST_HEIGHT 48
+#define PSNR_WIDTH 320
+#define PSNR_HEIGHT 240
+#define PSNR_TOLERANCE 1.0 // dB the fixed point DCT may lose against the float one, only q100 comes close
+#define PSNR_AGREE 45.0    // dB the two decoded pictures must at least match each other by
+#define RESTART_QUALITY 90 // 4:2:0 for RGB input
+
+static unsigned char buffer[TEST_BUFFER + 64];
+
+// random offset (so unaligned) and length, short lengths are all tried first
+static unsigned char *test_range(int run, int *len)
+{
+    int offset = rand() % 64;
+    *len = run < 512 ? run : rand() % TEST_BUFFER;
+    if (run % 8 == 0)
+        memset(buffer + offset, 0xff, *len); // long runs of 255 push the sums furthest
+    else
+        for (int i = 0; i < *len; i++)
+            buffer[offset + i] = rand();
+    return buffer + offset;
+}
+
+static int test_crc32(void)
+{
+    int failed = 0;
+    for (int run = 0; run < TEST_RUNS; run++)
+    {
+        int len;
+        unsigned char *data = test_range(run, &len);
+        unsigned int scalar = ~stbiw__crc32_slice8(~0u, data, len);
+        if (stbiw__crc32(data, len) != scalar)
+        {
+            printf("crc32: %d bytes at offset %d differ\n", len, (int)(data - buffer));
+            failed++;
+        }
+    }
+    if (stbiw__crc32((unsigned char *)"123456789", 9) != 0xcbf43926)
+    {
+        printf("crc32: wrong check value\n");
+        failed++;
+    }
+    return failed;
+}
+
+static int test_adler32(void)
+{
+    int failed = 0;
+    for (int run = 0; run < TEST_RUNS; run++)
+    {
+        int len;
+        unsigned char *data = test_range(run, &len);
+        unsigned int s1 = 1, s2 = 0;
+        stbiw__adler32_scalar(&s1, &s2, data, len);
+        if (stbiw__adler32(1, data, len) != ((s2 << 16) | s1))
+        {
+            printf("adler32: %d bytes at offset %d differ\n", len, (int)(data - buffer));
+            failed++;
+        }
+    }
+    return failed;
+}
+
+typedef struct TestJPEGError
+{
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+    int warnings;
+} TestJPEGError;
+static void test_jpeg_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((TestJPEGError *)cinfo->err)->jump, 1);
+}
+static void test_jpeg_message(j_common_ptr cinfo, int level)
+{
+    // level -1 is corrupt data libjpeg decided to skip over, e.g. "bad Huffman code"
+    if (level < 0)
+        ((TestJPEGError *)cinfo->err)->warnings++;
+}
+
+// decodes into rgb (width x height x 3), 0 if libjpeg found anything wrong
+static int test_decode(const unsigned char *jpeg, int size, unsigned char *rgb, int width, int height)
+{
+    struct jpeg_decompress_struct cinfo;
+    TestJPEGError jerr;
+    cinfo.err = jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit = test_jpeg_error_exit;
+    jerr.mgr.emit_message = test_jpeg_message;
+    jerr.warnings = 0;
+    jpeg_create_decompress(&cinfo);
+    if (setjmp(jerr.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        return 0;
+    }
+    jpeg_mem_src(&cinfo, (unsigned char *)jpeg, size);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    if ((int)cinfo.output_width != width || (int)cinfo.output_height != height)
+        longjmp(jerr.jump, 1);
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        unsigned char *row = rgb + cinfo.output_scanline * width * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return jerr.warnings == 0;
+}
+
+static int test_encode_yuyv(const unsigned char *yuyv, int quality, int subsample, unsigned char *rgb)
+{
+    stbiw__jpg_membuf jpeg = {0};
+    int ok = stbi_write_jpg_yuyv_to_func(stbiw__jpg_mem_write, &jpeg, TEST_WIDTH, TEST_HEIGHT, yuyv, 0,
+                                         quality, subsample) &&
+             !jpeg.error && test_decode(jpeg.data, jpeg.len, rgb, TEST_WIDTH, TEST_HEIGHT);
+    free(jpeg.data);
+    return ok;
+}
+
+// bytes 0 and 255 lie outside video range and expand to about -146..150, the
+// encoder has to clamp them or the coefficients overflow the Huffman tables
+static int test_jpeg_extremes(void)
+{
+    static unsigned char yuyv[TEST_HEIGHT][TEST_WIDTH * 2];
+    static unsigned char rgb[TEST_HEIGHT * TEST_WIDTH * 3];
+    int failed = 0;
+    for (int pattern = 0; pattern < 3; pattern++)
+    {
+        for (int y = 0; y < TEST_HEIGHT; y++)
+            for (int x = 0; x < TEST_WIDTH * 2; x++)
+            {
+                // 8x8 block checker (largest DC steps), pixel checker (largest AC), random 0/255
+                int on = pattern == 0 ? ((x / 16) ^ (y / 8)) & 1 : pattern == 1 ? ((x / 2) ^ y) & 1 : rand() & 1;
+                if (x & 1)
+                    on ^= (x >> 1) & 1; // Cb and Cr pull opposite ways
+                yuyv[y][x] = on ? 255 : 0;
+            }
+        for (int simd = 0; simd < 2; simd++)
+            for (int subsample = 0; subsample < 2; subsample++)
+            {
+#ifdef STBIW__X86_SIMD
+                stbiw__has_ssse3 = simd ? -1 : 0;
+#endif
+                for (int quality = 90; quality <= 100; quality += 10)
+                    if (!test_encode_yuyv(yuyv[0], quality, subsample, rgb))
+                    {
+                        printf("jpeg yuyv: pattern %d %s %s q%d does not decode cleanly\n", pattern,
+                               simd ? "simd" : "scalar", subsample ? "4:2:0" : "4:2:2", quality);
+                        failed++;
+                    }
+            }
+    }
+#ifdef STBIW__X86_SIMD
+    stbiw__has_ssse3 = -1;
+#endif
+    return failed;
+}
+
+static double test_psnr(const unsigned char *a, const unsigned char *b, int n)
+{
+    double error = 0;
+    for (int i = 0; i < n; i++)
+        error += (double)(a[i] - b[i]) * (a[i] - b[i]);
+    return error ? 10 * log10(255.0 * 255.0 * n / error) : 99;
+}
+
+// smooth gradients, fine detail, hard edges and a little noise
+static void test_picture(unsigned char *rgb)
+{
+    for (int y = 0; y < PSNR_HEIGHT; y++)
+        for (int x = 0; x < PSNR_WIDTH; x++)
+        {
+            unsigned char *p = rgb + (y * PSNR_WIDTH + x) * 3;
+            int edge = (x / 40 + y / 30) & 1 ? 60 : 0;
+            int detail = (int)(40 * sin(x * 0.3) * cos(y * 0.2));
+            for (int c = 0; c < 3; c++)
+            {
+                int v = x * (c + 1) * 255 / (PSNR_WIDTH * 3) + y * (3 - c) * 255 / (PSNR_HEIGHT * 3) + edge + detail +
+                        rand() % 9 - 4;
+                p[c] = v < 0 ? 0 : v > 255 ? 255 : v;
+            }
+        }
+}
+
+// encodes the same picture with the SSSE3 and the float DCT and compares how close each gets to it
+static int test_jpeg_psnr(void)
+{
+#ifdef STBIW__X86_SIMD
+    static unsigned char source[PSNR_HEIGHT * PSNR_WIDTH * 3];
+    static unsigned char decoded[2][PSNR_HEIGHT * PSNR_WIDTH * 3];
+    static const int qualities[] = {50, 75, 90, 95, 100};
+    int n = PSNR_WIDTH * PSNR_HEIGHT * 3;
+    int failed = 0;
+    if (!stbiw__cpu_has_ssse3())
+    {
+        printf("jpeg psnr: no SSSE3, skipped\n");
+        return 0;
+    }
+    test_picture(source);
+    for (int i = 0; i < (int)(sizeof(qualities) / sizeof(qualities[0])); i++)
+    {
+        double psnr[2];
+        for (int simd = 0; simd < 2; simd++)
+        {
+            stbiw__jpg_membuf jpeg = {0};
+            stbiw__has_ssse3 = simd;
+            if (!stbi_write_jpg_to_func(stbiw__jpg_mem_write, &jpeg, PSNR_WIDTH, PSNR_HEIGHT, 3, source,
+                                        qualities[i]) ||
+                jpeg.error || !test_decode(jpeg.data, jpeg.len, decoded[simd], PSNR_WIDTH, PSNR_HEIGHT))
+            {
+                printf("jpeg psnr: q%d %s does not decode cleanly\n", qualities[i], simd ? "simd" : "scalar");
+                failed++;
+            }
+            free(jpeg.data);
+            psnr[simd] = test_psnr(source, decoded[simd], n);
+        }
+        double agree = test_psnr(decoded[0], decoded[1], n);
+        printf("jpeg psnr: q%-3d scalar %.2f dB, simd %.2f dB, between them %.2f dB\n", qualities[i], psnr[0],
+               psnr[1], agree);
+        if (psnr[1] < psnr[0] - PSNR_TOLERANCE || agree < PSNR_AGREE)
+        {
+            printf("jpeg psnr: q%d simd is too far from scalar\n", qualities[i]);
+            failed++;
+        }
+    }
+    stbiw__has_ssse3 = -1;
+    return failed;
+#else
+    return 0;
+#endif
+}
+
+static int test_encode(stbiw__jpg_membuf *jpeg, const unsigned char *pixels, int width, int height, int yuyv,
+                       int subsample, int restart_rows)
+{
+    memset(jpeg, 0, sizeof(*jpeg));
+    stbi_write_jpg_restart_rows = restart_rows;
+    int ok = yuyv ? stbi_write_jpg_yuyv_to_func(stbiw__jpg_mem_write, jpeg, width, height, pixels, 0, RESTART_QUALITY,
+                                                subsample)
+                  : stbi_write_jpg_to_func(stbiw__jpg_mem_write, jpeg, width, height, 3, pixels, RESTART_QUALITY);
+    stbi_write_jpg_restart_rows = 0;
+    return ok && !jpeg->error;
+}
+
+// the DRI interval in MCUs (0 without one), restarts gets the RSTn markers in the scan
+static int test_markers(const stbiw__jpg_membuf *jpeg, int *restarts)
+{
+    const unsigned char *d = jpeg->data;
+    int interval = 0, i = 2;
+    while (i + 5 < jpeg->len && d[i] == 0xFF && d[i + 1] != 0xDA)
+    {
+        if (d[i + 1] == 0xDD)
+            interval = (d[i + 4] << 8) | d[i + 5];
+        i += 2 + ((d[i + 2] << 8) | d[i + 3]);
+    }
+    *restarts = 0;
+    for (; i + 1 < jpeg->len; i++)
+        if (d[i] == 0xFF && d[i + 1] >= 0xD0 && d[i + 1] <= 0xD7)
+            (*restarts)++;
+    return interval;
+}
+
+// restart intervals only reset the DC prediction, so the decoded pixels have to
+// be exactly those of the same image without them
+static int test_jpeg_restart(void)
+{
+    static const struct
+    {
+        int width, height, yuyv, subsample, rows, used_rows;
+    } cases[] = {
+        {1280, 720, 0, 0, 3, 3},     // 45 MCU rows, 15 intervals
+        {1280, 728, 0, 0, 3, 3},     // 46 MCU rows, the last one half height, the last interval one row
+        {1280, 720, 1, 0, 7, 7},     // 4:2:2, 90 MCU rows, 13 intervals
+        {1278, 724, 1, 1, 4, 4},     // 4:2:0, partial MCUs on both edges
+        {4096, 2100, 1, 0, 300, 255}, // 256 MCUs a row, 300 rows would overflow DRI's 16 bits
+    };
+    int failed = 0;
+    for (int c = 0; c < (int)(sizeof(cases) / sizeof(cases[0])); c++)
+    {
+        int width = cases[c].width, height = cases[c].height;
+        size_t size = (size_t)width * height * (cases[c].yuyv ? 2 : 3);
+        unsigned char *pixels = (unsigned char *)malloc(size);
+        unsigned char *rgb[2] = {(unsigned char *)malloc((size_t)width * height * 3),
+                                 (unsigned char *)malloc((size_t)width * height * 3)};
+        for (size_t i = 0; i < size; i++)
+            pixels[i] = (unsigned char)((i % 509) / 2 + (i / (width * 7)) + rand() % 24);
+        int mcu_w = 16; // 4:2:2 and 4:2:0 MCUs are both 16 wide
+        int mcu_h = cases[c].yuyv && !cases[c].subsample ? 8 : 16;
+        int mcu_rows = (height + mcu_h - 1) / mcu_h;
+        int intervals = (mcu_rows + cases[c].used_rows - 1) / cases[c].used_rows;
+        int restarts[2], interval[2], decoded[2];
+        for (int r = 0; r < 2; r++)
+        {
+            stbiw__jpg_membuf jpeg;
+            decoded[r] = test_encode(&jpeg, pixels, width, height, cases[c].yuyv, cases[c].subsample,
+                                     r ? cases[c].rows : 0) &&
+                         test_decode(jpeg.data, jpeg.len, rgb[r], width, height);
+            interval[r] = test_markers(&jpeg, &restarts[r]);
+            free(jpeg.data);
+        }
+        if (!decoded[0] || !decoded[1])
+        {
+            printf("jpeg restart: %dx%d does not decode cleanly\n", width, height);
+            failed++;
+        }
+        else if (memcmp(rgb[0], rgb[1], (size_t)width * height * 3) != 0)
+        {
+            printf("jpeg restart: %dx%d every %d rows decodes differently\n", width, height, cases[c].rows);
+            failed++;
+        }
+        int mcus_per_row = (width + mcu_w - 1) / mcu_w;
+        if (interval[0] != 0 || restarts[0] != 0 || interval[1] != cases[c].used_rows * mcus_per_row ||
+            restarts[1] != intervals - 1)
+        {
+            printf("jpeg restart: %dx%d has DRI %d/%d and %d/%d RSTn, wanted 0/%d and 0/%d\n", width, height,
+                   interval[0], interval[1], restarts[0], restarts[1], cases[c].used_rows * mcus_per_row,
+                   intervals - 1);
+            failed++;
+        }
+        free(pixels);
+        free(rgb[0]);
+        free(rgb[1]);
+    }
+
+    // the rows per interval are cut down until the interval fits DRI's 16 bits
+    static const struct
+    {
+        int width, mcu_w, rows, used_rows;
+    } clamps[] = {
+        {640, 16, 0, 0}, {640, 16, -2, 0}, {640, 16, 3, 3}, {65535, 8, 7, 7}, {65535, 8, 8, 7}, {65535, 16, 100, 15},
+    };
+    for (int c = 0; c < (int)(sizeof(clamps) / sizeof(clamps[0])); c++)
+    {
+        stbiw__jpg_image im;
+        memset(&im, 0, sizeof(im));
+        im.width = clamps[c].width;
+        im.mcu_w = clamps[c].mcu_w;
+        stbi_write_jpg_restart_rows = clamps[c].rows;
+        int rows = stbiw__jpg_restart_rows(&im);
+        if (rows != clamps[c].used_rows)
+        {
+            printf("jpeg restart: %d rows of %d wide MCUs in %d pixels became %d, wanted %d\n", clamps[c].rows,
+                   clamps[c].mcu_w, clamps[c].width, rows, clamps[c].used_rows);
+            failed++;
+        }
+    }
+    stbi_write_jpg_restart_rows = 0;
+    return failed;
+}
+
+// streams an image through the PNG writer and decodes it again with libpng,
+// every size is well past the 32K deflate window the stream slides over
+static int test_png_stream(void)
+{
+    static const struct
+    {
+        int width, height, comp;
+    } cases[] = {
+        {1280, 720, 3}, // 3841 bytes a row, 8 rows to a window, many IDATs
+        {640, 480, 4},
+        {100, 700, 2},
+        {8, 5000, 1}, // rows far shorter than the match lookahead
+    };
+    static const int formats[] = {0, PNG_FORMAT_GRAY, PNG_FORMAT_GA, PNG_FORMAT_RGB, PNG_FORMAT_RGBA};
+    int failed = 0;
+    for (int c = 0; c < (int)(sizeof(cases) / sizeof(cases[0])); c++)
+    {
+        int width = cases[c].width, height = cases[c].height, stride = width * cases[c].comp;
+        unsigned char *pixels = (unsigned char *)malloc((size_t)stride * height);
+        unsigned char *decoded = (unsigned char *)malloc((size_t)stride * height);
+        // gradients, noise and pairs of rows repeated from just under 32K back, so
+        // the matches reach across where the window slides, and from just over,
+        // out of reach (a filtered row depends on the one above, hence pairs)
+        int near = 32000 / (stride + 1);
+        int far = 33000 / (stride + 1) + 1;
+        for (int y = 0; y < height; y++)
+        {
+            unsigned char *row = pixels + (size_t)y * stride;
+            int back = y % 8 >= 6 ? far : y % 8 >= 2 && y % 8 < 4 ? near : 0;
+            if (back > 0 && y >= back)
+                memcpy(row, row - (size_t)back * stride, stride);
+            else
+                for (int x = 0; x < stride; x++)
+                    row[x] = y % 2 ? rand() : x / 3 + y;
+        }
+
+        stbiw__jpg_membuf png = {0};
+        stbi_png_stream *ps = stbi_write_png_stream_begin(stbiw__jpg_mem_write, &png, width, height, cases[c].comp);
+        for (int y = 0; ps != NULL && y < height; y++)
+            stbi_write_png_stream_row(ps, pixels + (size_t)y * stride);
+        int ok = stbi_write_png_stream_end(ps) && !png.error;
+
+        // libpng checks every chunk CRC and zlib the Adler-32 while inflating
+        png_image image;
+        memset(&image, 0, sizeof(image));
+        image.version = PNG_IMAGE_VERSION;
+        ok = ok && png_image_begin_read_from_memory(&image, png.data, png.len) && (int)image.width == width &&
+             (int)image.height == height;
+        image.format = formats[cases[c].comp];
+        ok = ok && png_image_finish_read(&image, NULL, decoded, stride, NULL) && image.warning_or_error == 0;
+        png_image_free(&image);
+        if (!ok)
+        {
+            printf("png stream: %dx%dx%d does not decode cleanly\n", width, height, cases[c].comp);
+            failed++;
+        }
+        else if (memcmp(pixels, decoded, (size_t)stride * height) != 0)
+        {
+            printf("png stream: %dx%dx%d decodes to different pixels\n", width, height, cases[c].comp);
+            failed++;
+        }
+        free(png.data);
+        free(pixels);
+        free(decoded);
+    }
+    return failed;
+}
+
+int main(void)
+{
+    int failed = 0;
+    srand(1);
+#ifdef STBIW__X86_SIMD
+    printf("pclmul %d, ssse3 %d\n", stbiw__cpu_has_pclmul(), stbiw__cpu_has_ssse3());
+#else
+    printf("no SIMD paths built, comparing the scalar code with itself\n");
+#endif
+    failed += test_crc32();
+    failed += test_adler32();
+    failed += test_jpeg_extremes();
+    failed += test_jpeg_psnr();
+    failed += test_jpeg_restart();
+    failed += test_png_stream();
+    printf("%s, %d failures\n", failed ? "FAILED" : "passed", failed);
+    return failed != 0;
+}